@@ -0,0 +1,457 @@
+/*
+ * load generator for bench_server, every thread drives its connections
+ * from its own epoll instance.
+ *
+ *  closed loop: every connection keeps -P requests in flight.
+ *  open loop:   -R req/s in total with exponential inter-arrival times.
+ *               latency counts from the scheduled send time, so a slow
+ *               server is not hidden by the generator backing off.
+ *  connect:     -C, every thread connects, runs one request and closes
+ *               in a loop, reports the connection setup rate.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c bench/bench_client.c -o bench_client -lpthread -lm
+ *  ./bench_client [-a addr] [-p port] [-t threads] [-c conns] [-d seconds]
+ *                 [-w warmup seconds] [-s req size] [-r resp size] [-P pipeline]
+ *                 [-R rate] [-C] [-S server pid]
+ *
+ *  -r is the rpc response size of the server, 0 for the echo server.
+ *  -S adds the cpu time per request of the server process.
+ *  the last output line is key=value pairs for scripts.
+ */
+#include "network.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MAX_INFLIGHT        1024    // per connection in open loop
+#define READ_BUF_SIZE       (64 * 1024)
+
+typedef struct client_conn {
+    socket_t        fd;
+    uint32_t        unsent;         // queued requests not written yet
+    uint32_t        out_off;        // bytes of the first one written
+    uint32_t        in_partial;     // bytes of an incomplete response
+    uint32_t        head, tail;     // send times in flight
+    uint64_t        *sent_at;
+} client_conn_t;
+
+typedef struct client_thread {
+    pthread_t       tid;
+    int             id;
+    int             nconns;
+    client_conn_t   *conns;
+    double          rate;           // open loop req/s of this thread
+    uint64_t        requests;
+    uint64_t        missed;         // open loop sends skipped, all conns full
+    uint64_t        connects;
+    hist_t          *hist;
+} client_thread_t;
+
+static const char *addr = "127.0.0.1";
+static port_t port = 19900;
+static int threads = 1;
+static int conns = 16;
+static int duration = 5;
+static int warmup = 1;
+static uint32_t req_size = 64;
+static uint32_t resp_size;
+static int pipeline = 1;
+static double rate;
+static bool connect_mode;
+static int server_pid;
+
+static size_t req_frame, resp_frame;
+static char *req_block;             // MAX_INFLIGHT requests back to back
+static volatile int measuring;
+static volatile int stopping;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, per thread */
+static inline double rand_uniform(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return ((*s * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static socket_t open_conn(void)
+{
+    socket_t fd;
+
+    fd = sock_connect_to(inet_addr(addr), port, 3);
+    if(fd == INVALID_SOCK)
+        return INVALID_SOCK;
+
+    set_sockopt_nodelay(fd);
+    return fd;
+}
+
+static inline uint32_t inflight(client_conn_t *c)
+{
+    return c->tail - c->head;
+}
+
+static void queue_request(client_conn_t *c, uint64_t ts)
+{
+    c->sent_at[c->tail++ & (MAX_INFLIGHT - 1)] = ts;
+    c->unsent++;
+}
+
+/* write as many queued requests as the socket takes */
+static int flush_conn(client_conn_t *c)
+{
+    size_t len;
+    ssize_t n;
+
+    while(c->unsent) {
+        len = (size_t)(c->unsent < MAX_INFLIGHT ? c->unsent : MAX_INFLIGHT) * req_frame -
+            c->out_off;
+        n = write(c->fd, req_block + c->out_off, len);
+        if(n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+        n += c->out_off;
+        c->unsent -= n / req_frame;
+        c->out_off = n % req_frame;
+    }
+
+    return 0;
+}
+
+/* return the completed responses, -1 if the connection is broken */
+static int read_conn(client_thread_t *t, client_conn_t *c, char *buf)
+{
+    uint64_t now;
+    ssize_t n;
+    int done = 0, complete;
+
+    for(;;) {
+        n = read(c->fd, buf, READ_BUF_SIZE);
+        if(n == 0)
+            return -1;
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return errno == EAGAIN ? done : -1;
+        }
+
+        complete = (c->in_partial + n) / resp_frame;
+        c->in_partial = (c->in_partial + n) % resp_frame;
+        if(complete == 0)
+            continue;
+
+        now = now_ns();
+        done += complete;
+        while(complete--) {
+            if(measuring)
+                hist_record(t->hist, now - c->sent_at[c->head & (MAX_INFLIGHT - 1)]);
+            c->head++;
+        }
+    }
+}
+
+static void *closed_open_loop(client_thread_t *t)
+{
+    struct epoll_event ev, events[256];
+    client_conn_t *c = NULL;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (t->id + 1);
+    uint64_t next_send = 0, now;
+    char *buf;
+    int efd, nfds, i, j, rr = 0, timeout, done;
+
+    efd = epoll_create1(0);
+    buf = malloc(READ_BUF_SIZE);
+
+    for(i = 0; i < t->nconns; i++) {
+        c = &t->conns[i];
+        c->fd = open_conn();
+        if(c->fd == INVALID_SOCK) {
+            perror("connect");
+            exit(1);
+        }
+        set_sockopt_nonblock(c->fd);
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &ev);
+
+        if(rate == 0) {
+            for(j = 0; j < pipeline; j++)
+                queue_request(c, now_ns());
+            flush_conn(c);
+        }
+    }
+    next_send = now_ns();
+
+    while(!stopping) {
+        timeout = -1;
+        if(rate > 0) {
+            /* send everything due, latency counts from the schedule */
+            now = now_ns();
+            while(next_send <= now) {
+                for(j = 0; j < t->nconns; j++) {
+                    c = &t->conns[rr++ % t->nconns];
+                    if(inflight(c) < MAX_INFLIGHT)
+                        break;
+                }
+                if(j == t->nconns) {
+                    if(measuring)
+                        t->missed++;
+                } else {
+                    queue_request(c, next_send);
+                    if(flush_conn(c) != 0) {
+                        perror("write");
+                        exit(1);
+                    }
+                }
+                next_send += (uint64_t)(-log(1.0 - rand_uniform(&seed)) / t->rate * 1e9);
+            }
+            timeout = (next_send - now) / 1000000;
+        }
+
+        nfds = epoll_wait(efd, events, 256, rate > 0 ? timeout : 100);
+        for(i = 0; i < nfds; i++) {
+            c = events[i].data.ptr;
+            if(flush_conn(c) != 0 || (done = read_conn(t, c, buf)) < 0) {
+                fprintf(stderr, "connection broken\n");
+                exit(1);
+            }
+
+            if(measuring)
+                t->requests += done;
+
+            if(rate == 0) {
+                now = now_ns();
+                for(j = 0; j < done; j++)
+                    queue_request(c, now);
+                if(flush_conn(c) != 0) {
+                    perror("write");
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    for(i = 0; i < t->nconns; i++)
+        close(t->conns[i].fd);
+    close(efd);
+    free(buf);
+    return NULL;
+}
+
+/* connection setup rate: connect, one request, close */
+static void *connect_loop(client_thread_t *t)
+{
+    char *buf = malloc(resp_frame);
+    uint64_t start;
+    size_t got;
+    ssize_t n;
+    socket_t fd;
+
+    while(!stopping) {
+        start = now_ns();
+        fd = open_conn();
+        if(fd == INVALID_SOCK) {
+            perror("connect");
+            exit(1);
+        }
+
+        if(write(fd, req_block, req_frame) != (ssize_t)req_frame) {
+            perror("write");
+            exit(1);
+        }
+        for(got = 0; got < resp_frame; got += n) {
+            n = read(fd, buf + got, resp_frame - got);
+            if(n <= 0) {
+                perror("read");
+                exit(1);
+            }
+        }
+        close(fd);
+
+        if(measuring) {
+            t->connects++;
+            t->requests++;
+            hist_record(t->hist, now_ns() - start);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+    client_thread_t *t = arg;
+
+    return connect_mode ? connect_loop(t) : closed_open_loop(t);
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* utime + stime of another process, -1 if unknown */
+static double proc_cpu_seconds(int pid)
+{
+    char path[64], line[1024], *p;
+    unsigned long utime, stime;
+    FILE *fp;
+    int i;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fp = fopen(path, "r");
+    if(!fp)
+        return -1;
+    if(!fgets(line, sizeof(line), fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    /* the command may contain spaces, fields restart after ')' */
+    p = strrchr(line, ')');
+    if(!p)
+        return -1;
+    for(i = 0; i < 12 && p; i++)
+        p = strchr(p + 1, ' ');
+    if(!p || sscanf(p, " %lu %lu", &utime, &stime) != 2)
+        return -1;
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a addr] [-p port] [-t threads] [-c conns] [-d seconds] "
+            "[-w warmup] [-s req size] [-r resp size] [-P pipeline] [-R rate] [-C] "
+            "[-S server pid]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    client_thread_t *ts;
+    hist_t *total;
+    uint64_t requests = 0, missed = 0, connects = 0;
+    uint64_t t0, t1;
+    double cpu0, cpu1, scpu0 = -1, scpu1 = -1, secs;
+    int opt, i, j, per, extra;
+
+    while((opt = getopt(argc, argv, "a:p:t:c:d:w:s:r:P:R:CS:")) != -1) {
+        switch(opt) {
+        case 'a': addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 's': req_size = atoi(optarg); break;
+        case 'r': resp_size = atoi(optarg); break;
+        case 'P': pipeline = atoi(optarg); break;
+        case 'R': rate = atof(optarg); break;
+        case 'C': connect_mode = true; break;
+        case 'S': server_pid = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(threads <= 0 || conns < threads || pipeline <= 0 || pipeline > MAX_INFLIGHT)
+        usage(argv[0]);
+
+    req_frame = sizeof(uint32_t) + req_size;
+    resp_frame = resp_size ? sizeof(uint32_t) + resp_size : req_frame;
+    req_block = malloc(req_frame * MAX_INFLIGHT);
+    for(i = 0; i < MAX_INFLIGHT; i++) {
+        memcpy(req_block + i * req_frame, &req_size, sizeof(req_size));
+        memset(req_block + i * req_frame + sizeof(req_size), 'q', req_size);
+    }
+
+    ts = calloc(threads, sizeof(client_thread_t));
+    per = conns / threads;
+    extra = conns % threads;
+    for(i = 0; i < threads; i++) {
+        ts[i].id = i;
+        ts[i].nconns = per + (i < extra);
+        ts[i].rate = rate / threads;
+        ts[i].hist = hist_create();
+        ts[i].conns = calloc(ts[i].nconns, sizeof(client_conn_t));
+        for(j = 0; j < ts[i].nconns; j++)
+            ts[i].conns[j].sent_at = calloc(MAX_INFLIGHT, sizeof(uint64_t));
+        pthread_create(&ts[i].tid, NULL, client_thread, &ts[i]);
+    }
+
+    sleep(warmup);
+
+    if(server_pid)
+        scpu0 = proc_cpu_seconds(server_pid);
+    cpu0 = cpu_seconds();
+    t0 = now_ns();
+    measuring = 1;
+
+    sleep(duration);
+
+    measuring = 0;
+    t1 = now_ns();
+    cpu1 = cpu_seconds();
+    if(server_pid)
+        scpu1 = proc_cpu_seconds(server_pid);
+
+    stopping = 1;
+    total = hist_create();
+    for(i = 0; i < threads; i++) {
+        pthread_join(ts[i].tid, NULL);
+        requests += ts[i].requests;
+        missed += ts[i].missed;
+        connects += ts[i].connects;
+        hist_merge(total, ts[i].hist);
+    }
+
+    secs = (t1 - t0) / 1e9;
+    printf("%s, %d threads, %d conns, %u/%u byte req/resp, %.1f s\n",
+            connect_mode ? "connect" : rate > 0 ? "open loop" : "closed loop",
+            threads, conns, req_size, resp_size ? resp_size : req_size, secs);
+    printf("  %.0f req/s  latency p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+            requests / secs, hist_percentile(total, 50.0) / 1e3,
+            hist_percentile(total, 99.0) / 1e3, hist_percentile(total, 99.9) / 1e3,
+            total->max / 1e3);
+    if(connect_mode)
+        printf("  %.0f connections/s\n", connects / secs);
+    if(rate > 0)
+        printf("  target %.0f req/s, %lu sends missed\n", rate, missed);
+    printf("  client cpu %.2fus/req", requests ? (cpu1 - cpu0) * 1e6 / requests : 0.0);
+    if(scpu0 >= 0 && scpu1 >= 0)
+        printf("  server cpu %.2fus/req", requests ? (scpu1 - scpu0) * 1e6 / requests : 0.0);
+    printf("\n");
+
+    printf("mode=%s threads=%d conns=%d pipeline=%d rate=%.0f req_s=%.0f "
+            "p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f conn_s=%.0f missed=%lu "
+            "cli_cpu_us=%.3f srv_cpu_us=%.3f\n",
+            connect_mode ? "connect" : rate > 0 ? "open" : "closed",
+            threads, conns, pipeline, rate, requests / secs,
+            hist_percentile(total, 50.0) / 1e3, hist_percentile(total, 99.0) / 1e3,
+            hist_percentile(total, 99.9) / 1e3, total->max / 1e3, connects / secs, missed,
+            requests ? (cpu1 - cpu0) * 1e6 / requests : 0.0,
+            requests && scpu0 >= 0 && scpu1 >= 0 ? (scpu1 - scpu0) * 1e6 / requests : -1.0);
+
+    return 0;
+}
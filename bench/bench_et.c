@@ -0,0 +1,189 @@
+/*
+ * compare level and edge triggered connections: syscalls per request of
+ * a pipelined echo server built on the data callback.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c bench/bench_et.c -o bench_et -lpthread
+ *  ./bench_et [seconds] [threads] [conns per thread] [pipeline] [msg size]
+ */
+#include "lcepoll.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_PORT      19800
+
+static int duration = 3;
+static int threads = 2;
+static int conns = 16;
+static int pipeline = 32;
+static int msgsize = 64;
+
+static volatile int stop_clients;
+
+static bool on_accept(lcs_conn_t *conn)
+{
+    UNUSED(conn);
+    return true;
+}
+
+/* echo every complete [len][payload] message */
+static bool on_data(lcs_conn_t *conn, lcs_slice_t *in)
+{
+    uint32_t len;
+    size_t total = 0;
+
+    while(in->len - total >= sizeof(len)) {
+        memcpy(&len, in->data + total, sizeof(len));
+        if(in->len - total < sizeof(len) + len)
+            break;
+        total += sizeof(len) + len;
+    }
+
+    if(total == 0)
+        return true;
+
+    if(lcs_conn_send(conn, in->data, total) != 0)
+        return false;
+
+    lcs_slice_consume(in, total);
+    return true;
+}
+
+static void *client_thread(void *arg)
+{
+    uint64_t *requests = arg;
+    size_t reqsize = sizeof(uint32_t) + msgsize;
+    size_t burst = reqsize * pipeline;
+    socket_t *fds;
+    char *out, *in;
+    size_t got;
+    ssize_t n;
+    uint32_t len = msgsize;
+    int i, j;
+
+    fds = calloc(conns, sizeof(socket_t));
+    out = malloc(burst);
+    in = malloc(burst);
+    for(j = 0; j < pipeline; j++) {
+        memcpy(out + j * reqsize, &len, sizeof(len));
+        memset(out + j * reqsize + sizeof(len), 'x', msgsize);
+    }
+
+    for(i = 0; i < conns; i++) {
+        fds[i] = sock_connect_to(inet_addr("127.0.0.1"), BENCH_PORT, 3);
+        if(fds[i] == -1) {
+            perror("connect");
+            exit(1);
+        }
+        set_sockopt_nodelay(fds[i]);
+    }
+
+    while(!stop_clients) {
+        for(i = 0; i < conns; i++) {
+            if(write(fds[i], out, burst) != (ssize_t)burst) {
+                perror("write");
+                exit(1);
+            }
+        }
+
+        for(i = 0; i < conns; i++) {
+            for(got = 0; got < burst; got += n) {
+                n = read(fds[i], in + got, burst - got);
+                if(n <= 0) {
+                    perror("read");
+                    exit(1);
+                }
+            }
+            *requests += pipeline;
+        }
+    }
+
+    for(i = 0; i < conns; i++)
+        close(fds[i]);
+    free(fds);
+    free(out);
+    free(in);
+    return NULL;
+}
+
+static void run(bool edge_triggered)
+{
+    lcs_config_t cfg;
+    lcserver_t *server;
+    pthread_t *tids;
+    uint64_t *requests, total = 0, reads, polls;
+    lcs_stats_t stats;
+    struct timespec t1, t2;
+    double secs;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = BENCH_PORT;
+    cfg.slave_num = 1;
+    cfg.max_conns = threads * conns + 16;
+    cfg.edge_triggered = edge_triggered;
+    cfg.in_buf_num = cfg.max_conns;
+
+    server = lcserver_create(&cfg);
+    if(!server) {
+        fprintf(stderr, "lcserver_create failed\n");
+        exit(1);
+    }
+    lcserver_register_accept(server, on_accept);
+    lcserver_register_data(server, on_data);
+    if(lcserver_start(server) != 0) {
+        fprintf(stderr, "lcserver_start failed\n");
+        exit(1);
+    }
+
+    tids = calloc(threads, sizeof(pthread_t));
+    requests = calloc(threads, sizeof(uint64_t));
+    stop_clients = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, client_thread, &requests[i]);
+
+    sleep(duration);
+    stop_clients = 1;
+
+    for(i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total += requests[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    lcserver_stop(server);
+    lcserver_get_worker_stats(server, 0, &stats);
+    reads = stats.reads;
+    polls = stats.wakeups;
+
+    secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    printf("%-4s %12.0f req/s  recv/req %.4f  epoll_wait/req %.4f  syscalls/req %.4f\n",
+            edge_triggered ? "ET" : "LT", total / secs,
+            (double)reads / total, (double)polls / total,
+            (double)(reads + polls) / total);
+
+    lcserver_destroy(server);
+    free(tids);
+    free(requests);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc > 1) duration = atoi(argv[1]);
+    if(argc > 2) threads = atoi(argv[2]);
+    if(argc > 3) conns = atoi(argv[3]);
+    if(argc > 4) pipeline = atoi(argv[4]);
+    if(argc > 5) msgsize = atoi(argv[5]);
+
+    printf("%d threads x %d conns, pipeline %d, %d byte messages\n",
+            threads, conns, pipeline, msgsize);
+
+    run(false);
+    run(true);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * echo and fixed-size request/response server for bench_client.
+ *
+ * every request is [uint32 len][len bytes]. the echo mode sends it back
+ * as is, the rpc mode answers each one with [uint32 size][size bytes].
+ * SIGINT/SIGTERM stop it and print the request count, the server stats
+ * and the cpu time per request.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c bench/bench_server.c -o bench_server -lpthread
+ *  ./bench_server [-p port] [-w workers] [-m echo|rpc] [-r resp size]
+ *                 [-c max conns] [-d dispatch] [-b busy poll usec] [-e] [-R] [-u] [-l]
+ *
+ *  -e edge triggered, -R SO_REUSEPORT listeners, -u io_uring,
+ *  -l callback latency histograms
+ */
+#include "lcepoll.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_MAX_WORKERS   256
+
+typedef struct bench_counter {
+    uint64_t    requests;
+} __attribute__((aligned(CACHE_LINE_SIZE))) bench_counter_t;
+
+static bench_counter_t counters[BENCH_MAX_WORKERS];
+
+static bool rpc_mode;
+static char *resp;
+static size_t resp_len;
+
+static bool on_accept(lcs_conn_t *conn)
+{
+    set_sockopt_nodelay(conn->s);
+    return true;
+}
+
+static bool on_data(lcs_conn_t *conn, lcs_slice_t *in)
+{
+    uint32_t len;
+    size_t total = 0;
+    uint64_t n = 0;
+
+    while(in->len - total >= sizeof(len)) {
+        memcpy(&len, in->data + total, sizeof(len));
+        if(in->len - total < sizeof(len) + len)
+            break;
+
+        if(rpc_mode && lcs_conn_send(conn, resp, resp_len) != 0)
+            return false;
+
+        total += sizeof(len) + len;
+        n++;
+    }
+
+    if(total == 0)
+        return true;
+
+    if(!rpc_mode && lcs_conn_send(conn, in->data, total) != 0)
+        return false;
+
+    counters[conn->worker->worker_id].requests += n;
+    lcs_slice_consume(in, total);
+    return true;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void print_latency(lcserver_t *server, int idx)
+{
+    static const struct {
+        int         type;
+        const char  *name;
+    } types[] = {
+        {LCS_LAT_CONN,      "conn"},
+        {LCS_LAT_LISTEN,    "listen"},
+        {LCS_LAT_WAKEUP,    "wakeup"},
+        {LCS_LAT_TIMER,     "timer"},
+    };
+    lcs_latency_t lat;
+    size_t t;
+
+    for(t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        if(lcserver_get_latency(server, idx, types[t].type, &lat) != 0 || lat.count == 0)
+            continue;
+        printf("  worker %d %-6s n=%lu p50=%luns p99=%luns p999=%luns max=%luns\n",
+                idx, types[t].name, lat.count, lat.p50, lat.p99, lat.p999, lat.max);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p port] [-w workers] [-m echo|rpc] [-r resp size] "
+            "[-c max conns] [-d dispatch] [-b busy poll usec] [-e] [-R] [-u] [-l]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    lcs_config_t cfg;
+    lcserver_t *server;
+    lcs_stats_t stats;
+    sigset_t set;
+    uint64_t requests = 0;
+    uint32_t size = 64;
+    double cpu0, cpu1;
+    int opt, sig, i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = 19900;
+    cfg.slave_num = 1;
+    cfg.max_conns = 4096;
+
+    while((opt = getopt(argc, argv, "p:w:m:r:c:d:b:eRul")) != -1) {
+        switch(opt) {
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'w': cfg.slave_num = atoi(optarg); break;
+        case 'm': rpc_mode = strcmp(optarg, "rpc") == 0; break;
+        case 'r': size = atoi(optarg); break;
+        case 'c': cfg.max_conns = atoi(optarg); break;
+        case 'd': cfg.dispatch = atoi(optarg); break;
+        case 'b': cfg.busy_poll_us = atoi(optarg); break;
+        case 'e': cfg.edge_triggered = true; break;
+        case 'R': cfg.reuseport = true; break;
+        case 'u': cfg.backend = EV_BACKEND_IO_URING; break;
+        case 'l': cfg.latency = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(cfg.slave_num <= 0 || cfg.slave_num > BENCH_MAX_WORKERS)
+        usage(argv[0]);
+    cfg.in_buf_num = cfg.max_conns;
+
+    resp_len = sizeof(uint32_t) + size;
+    resp = malloc(resp_len);
+    memcpy(resp, &size, sizeof(size));
+    memset(resp + sizeof(size), 'r', size);
+
+    /* the workers inherit the mask, only sigwait() sees the signals */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    server = lcserver_create(&cfg);
+    if(!server) {
+        fprintf(stderr, "lcserver_create failed\n");
+        return 1;
+    }
+    lcserver_register_accept(server, on_accept);
+    lcserver_register_data(server, on_data);
+    if(lcserver_start(server) != 0) {
+        fprintf(stderr, "lcserver_start failed\n");
+        return 1;
+    }
+
+    printf("%s server on port %u, %d workers%s%s\n", rpc_mode ? "rpc" : "echo",
+            cfg.port, cfg.slave_num, cfg.edge_triggered ? ", edge triggered" : "",
+            cfg.reuseport ? ", reuseport" : "");
+    fflush(stdout);
+
+    cpu0 = cpu_seconds();
+    sigwait(&set, &sig);
+    cpu1 = cpu_seconds();
+
+    lcserver_stop(server);
+    for(i = 0; i < cfg.slave_num; i++)
+        requests += counters[i].requests;
+    lcserver_get_stats(server, &stats);
+
+    printf("requests=%lu accepted=%lu bytes_in=%lu bytes_out=%lu wakeups=%lu "
+            "events/wakeup=%.2f cpu_us/req=%.3f\n",
+            requests, stats.accepted, stats.bytes_in, stats.bytes_out, stats.wakeups,
+            stats.wakeups ? (double)stats.events / stats.wakeups : 0.0,
+            requests ? (cpu1 - cpu0) * 1e6 / requests : 0.0);
+
+    if(cfg.latency) {
+        for(i = 0; i < cfg.slave_num; i++)
+            print_latency(server, i);
+    }
+
+    lcserver_destroy(server);
+    free(resp);
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * throughput and quality of the hash functions in hash.h.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c bench/hashbench.c -o hashbench -lpthread
+ *  ./hashbench [-s scale]
+ *
+ * throughput is ns per hash and GB/s for keys of 4 to 4096 bytes.
+ * avalanche is the largest bias of any output bit flipping when one
+ * input bit flips, ~0 is ideal and 0.5 means some bit never or always
+ * flips. chi2 is the bucket distribution of 64k buckets indexed by the
+ * low or the high bits of the 32 bit hash, as htable uses both, for
+ * sequential integers and for ipv4 tuples with one byte changing. 1.0
+ * is a uniform spread, above ~1.05 starts to lengthen probes.
+ */
+#include "hash.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BUF_SIZE        (64 * 1024)
+#define CHI_BITS        16
+#define CHI_BUCKETS     (1 << CHI_BITS)
+
+typedef uint64_t (*hash_fn_t)(const void *key, size_t len, uint64_t seed);
+
+typedef struct hash_impl {
+    const char  *name;
+    hash_fn_t   fn;
+    int         bits;       // output width
+    size_t      len;        // only this key size, 0 for any
+} hash_impl_t;
+
+static double scale = 1.0;
+static uint8_t buf[BUF_SIZE + 4096];
+static uint32_t buckets[CHI_BUCKETS];
+static volatile uint64_t sink;      // keeps the hashes from being optimized out
+
+static uint64_t murmur2(const void *key, size_t len, uint64_t seed)
+{
+    return hash_murmur2(key, len, seed);
+}
+
+static uint64_t crc32c(const void *key, size_t len, uint64_t seed)
+{
+    return hash_crc32c(key, len, seed);
+}
+
+static uint64_t fixed_u32(const void *key, size_t len, uint64_t seed)
+{
+    uint32_t k;
+
+    UNUSED(len);
+    memcpy(&k, key, sizeof(k));
+    return hash64_u32(k, seed);
+}
+
+static uint64_t fixed_u64(const void *key, size_t len, uint64_t seed)
+{
+    uint64_t k;
+
+    UNUSED(len);
+    memcpy(&k, key, sizeof(k));
+    return hash64_u64(k, seed);
+}
+
+static uint64_t fixed_u128(const void *key, size_t len, uint64_t seed)
+{
+    UNUSED(len);
+    return hash64_u128(key, seed);
+}
+
+static const hash_impl_t impls[] = {
+    {"murmur2",     murmur2,    32, 0},
+    {"hash64",      hash64,     64, 0},
+    {"crc32c",      crc32c,     32, 0},
+    {"hash64_u32",  fixed_u32,  64, 4},
+    {"hash64_u64",  fixed_u64,  64, 8},
+    {"hash64_u128", fixed_u128, 64, 16},
+};
+
+#define NR_IMPLS    (sizeof(impls) / sizeof(impls[0]))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static uint32_t hash32(const hash_impl_t *h, const void *key, size_t len)
+{
+    uint64_t v = h->fn(key, len, 0);
+
+    return h->bits == 64 ? hash_fold32(v) : (uint32_t)v;
+}
+
+static bool fits(const hash_impl_t *h, size_t len)
+{
+    return h->len == 0 || h->len == len;
+}
+
+
+static void throughput(const hash_impl_t *h, size_t len)
+{
+    uint64_t n, i, sum = 0, t;
+    size_t off = 0;
+
+    n = (uint64_t)(scale * 20000000 / (1 + len / 16));
+    if(n == 0)
+        n = 1;
+
+    t = now_ns();
+    for(i = 0; i < n; i++) {
+        sum += h->fn(buf + off, len, i);
+        off = (off + 64) & (BUF_SIZE - 1);
+    }
+    t = now_ns() - t;
+    sink = sum;
+
+    printf("%-12s %5zu bytes  %8.2f ns/hash  %7.2f GB/s\n", h->name, len,
+            (double)t / n, (double)n * len / t);
+}
+
+static double avalanche(const hash_impl_t *h, size_t len)
+{
+    static uint32_t flips[16 * 8][64];
+    uint8_t key[16];
+    uint64_t seed = 0x2545f4914f6cdd1dULL, base, diff, trials, t;
+    double bias, worst = 0;
+    size_t j, k;
+
+    trials = (uint64_t)(scale * 20000);
+    if(trials < 100)
+        trials = 100;
+
+    memset(flips, 0, sizeof(flips));
+    for(t = 0; t < trials; t++) {
+        for(j = 0; j < len; j++)
+            key[j] = rnd(&seed);
+        base = h->fn(key, len, 0);
+
+        for(j = 0; j < len * 8; j++) {
+            key[j / 8] ^= 1 << (j % 8);
+            diff = h->fn(key, len, 0) ^ base;
+            key[j / 8] ^= 1 << (j % 8);
+
+            for(k = 0; k < (size_t)h->bits; k++)
+                flips[j][k] += (diff >> k) & 1;
+        }
+    }
+
+    for(j = 0; j < len * 8; j++) {
+        for(k = 0; k < (size_t)h->bits; k++) {
+            bias = (double)flips[j][k] / trials - 0.5;
+            if(bias < 0)
+                bias = -bias;
+            if(bias > worst)
+                worst = bias;
+        }
+    }
+
+    return worst;
+}
+
+/* the key of sample i: a 4 byte integer, or an addr:port or 4-tuple */
+static void make_key(uint8_t *key, size_t len, uint32_t i)
+{
+    uint32_t addr = 0x0a000000 | (i >> 4);      // 10.x.y.z
+    uint16_t port = 1024 + (i & 15);
+
+    memset(key, 0, len);
+    if(len == 4) {
+        memcpy(key, &i, 4);
+    } else {
+        memcpy(key, &addr, 4);
+        memcpy(key + 4, &port, 2);
+        if(len == 16) {
+            /* fixed local addr:port */
+            addr = 0xc0a80001;
+            port = 80;
+            memcpy(key + 8, &addr, 4);
+            memcpy(key + 12, &port, 2);
+        }
+    }
+}
+
+static double chi2(const hash_impl_t *h, size_t len, bool high)
+{
+    uint32_t n = CHI_BUCKETS * 8, i, v;
+    uint8_t key[16];
+    double expect = (double)n / CHI_BUCKETS, sum = 0, d;
+
+    memset(buckets, 0, sizeof(buckets));
+    for(i = 0; i < n; i++) {
+        make_key(key, len, i);
+        v = hash32(h, key, len);
+        buckets[high ? v >> (32 - CHI_BITS) : v & (CHI_BUCKETS - 1)]++;
+    }
+
+    for(i = 0; i < CHI_BUCKETS; i++) {
+        d = buckets[i] - expect;
+        sum += d * d / expect;
+    }
+
+    return sum / (CHI_BUCKETS - 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {4, 8, 13, 16, 32, 64, 256, 1024, 4096};
+    static const size_t qsizes[] = {4, 8, 16};
+    uint64_t seed = 88172645463325252ULL;
+    size_t i, j;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:")) != -1) {
+        switch(opt) {
+        case 's': scale = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s scale]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for(i = 0; i < sizeof(buf); i++)
+        buf[i] = rnd(&seed);
+
+    printf("crc32c: %s\n\n", hash_crc32c_hw() ? "sse4.2" : "table");
+
+    for(i = 0; i < NR_IMPLS; i++) {
+        for(j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            if(fits(&impls[i], sizes[j]))
+                throughput(&impls[i], sizes[j]);
+        }
+    }
+
+    printf("\n%-12s %5s  %9s  %8s  %8s\n", "", "key", "avalanche", "chi2 low", "chi2 high");
+    for(i = 0; i < NR_IMPLS; i++) {
+        for(j = 0; j < sizeof(qsizes) / sizeof(qsizes[0]); j++) {
+            if(!fits(&impls[i], qsizes[j]))
+                continue;
+            printf("%-12s %5zu  %9.4f  %8.3f  %8.3f\n", impls[i].name, qsizes[j],
+                    avalanche(&impls[i], qsizes[j]),
+                    chi2(&impls[i], qsizes[j], false), chi2(&impls[i], qsizes[j], true));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,815 @@
+/*
+ * microbenchmarks of the building blocks: pool, ring, hash table and
+ * timer wheel. reports ns/op, ops/s and, where perf counters can be
+ * opened, cache misses and instructions per op.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c bench/microbench.c -o microbench -lpthread
+ *  ./microbench [-s scale] [-f text|csv|json] [-o file] [filter]
+ *
+ * -s multiplies the op counts, filter runs only the benchmarks whose
+ * name contains it. csv and json (one object per line) go to -o or
+ * stdout, for tracking regressions over time. the ring runs need one cpu
+ * per thread and are skipped on smaller machines.
+ */
+#define _GNU_SOURCE
+
+#include "pool.h"
+#include "ring.h"
+#include "hash_table.h"
+#include "chash_table.h"
+#include "event.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+static double scale = 1.0;
+static int format = FMT_TEXT;
+static FILE *out;
+static const char *filter;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t scaled(uint64_t n)
+{
+    uint64_t v = n * scale;
+
+    return v ? v : 1;
+}
+
+/* xorshift64 */
+static inline uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+
+/*
+ * perf counters of the calling thread and the threads it creates while
+ * they are open. -1 when the kernel or the sandbox does not allow them.
+ */
+typedef struct counters {
+    int         fd_misses;
+    int         fd_instrs;
+    uint64_t    misses;
+    uint64_t    instrs;
+} counters_t;
+
+static int perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_start(counters_t *c)
+{
+    c->fd_misses = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    c->fd_instrs = perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+    if(c->fd_misses >= 0)
+        ioctl(c->fd_misses, PERF_EVENT_IOC_ENABLE, 0);
+    if(c->fd_instrs >= 0)
+        ioctl(c->fd_instrs, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static uint64_t counter_stop(int fd)
+{
+    uint64_t v;
+
+    if(fd < 0)
+        return UINT64_MAX;
+
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(fd, &v, sizeof(v)) != sizeof(v))
+        v = UINT64_MAX;
+    close(fd);
+    return v;
+}
+
+static void counters_stop(counters_t *c)
+{
+    c->misses = counter_stop(c->fd_misses);
+    c->instrs = counter_stop(c->fd_instrs);
+}
+
+
+typedef struct result {
+    const char  *name;
+    const char  *param;
+    uint64_t    ops;
+    uint64_t    ns;
+    counters_t  cnt;
+} result_t;
+
+static void report(result_t *r)
+{
+    double ns_op = (double)r->ns / r->ops;
+    double mops = r->ops / (r->ns / 1e3);
+    double miss = r->cnt.misses == UINT64_MAX ? -1 : (double)r->cnt.misses / r->ops;
+    double ins = r->cnt.instrs == UINT64_MAX ? -1 : (double)r->cnt.instrs / r->ops;
+
+    switch(format) {
+    case FMT_CSV:
+        fprintf(out, "%s,%s,%lu,%.3f,%.0f,%.4f,%.1f\n", r->name, r->param, r->ops,
+                ns_op, mops * 1e6, miss, ins);
+        break;
+    case FMT_JSON:
+        fprintf(out, "{\"name\":\"%s\",\"param\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.3f,"
+                "\"ops_per_sec\":%.0f,\"cache_misses_per_op\":%.4f,\"instrs_per_op\":%.1f}\n",
+                r->name, r->param, r->ops, ns_op, mops * 1e6, miss, ins);
+        break;
+    default:
+        fprintf(out, "%-22s %-18s %10.2f ns/op %9.2f Mops/s", r->name, r->param,
+                ns_op, mops);
+        if(miss >= 0)
+            fprintf(out, "  %8.4f miss/op  %7.1f ins/op", miss, ins);
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
+
+static bool selected(const char *name)
+{
+    return !filter || strstr(name, filter);
+}
+
+#define BENCH_BEGIN(r)      do { counters_start(&(r)->cnt); (r)->ns = now_ns(); } while(0)
+#define BENCH_END(r)        do { (r)->ns = now_ns() - (r)->ns; counters_stop(&(r)->cnt); } while(0)
+
+
+/* pool */
+
+#define POOL_SIZE       4096
+#define POOL_LIVE       1024
+
+static void bench_pool(bool locked)
+{
+    result_t r = {locked ? "pool_alloc_free_lock" : "pool_alloc_free", "64B", 0, 0, {0}};
+    pthread_spinlock_t lock;
+    void *objs[POOL_LIVE];
+    pool_t *p;
+    uint64_t i, n = scaled(20000000);
+    int j;
+
+    if(!selected(r.name))
+        return;
+
+    p = pool_create(64, POOL_SIZE);
+    pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE);
+    for(j = 0; j < POOL_LIVE; j++)
+        objs[j] = pool_alloc_obj(p);
+
+    /* free the oldest, allocate a new one: a steady set of live objects */
+    BENCH_BEGIN(&r);
+    for(i = 0; i < n; i++) {
+        j = i & (POOL_LIVE - 1);
+        if(locked) {
+            pthread_spin_lock(&lock);
+            pool_free_obj(p, objs[j]);
+            objs[j] = pool_alloc_obj(p);
+            pthread_spin_unlock(&lock);
+        } else {
+            pool_free_obj(p, objs[j]);
+            objs[j] = pool_alloc_obj(p);
+        }
+    }
+    BENCH_END(&r);
+
+    r.ops = n;
+    report(&r);
+    pthread_spin_destroy(&lock);
+    pool_destroy(p);
+}
+
+static void bench_pool_bulk(void)
+{
+    result_t r = {"pool_bulk", "64B x32", 0, 0, {0}};
+    void *objs[32];
+    pool_t *p;
+    uint64_t i, n = scaled(1000000);
+
+    if(!selected(r.name))
+        return;
+
+    p = pool_create(64, POOL_SIZE);
+
+    BENCH_BEGIN(&r);
+    for(i = 0; i < n; i++) {
+        pool_alloc_bulk(p, objs, 32);
+        pool_free_bulk(p, objs, 32);
+    }
+    BENCH_END(&r);
+
+    r.ops = n * 32;
+    report(&r);
+    pool_destroy(p);
+}
+
+#define POOL_BURST      (64 * 1024)
+
+/* a burst fills chunks on demand, freeing it unmaps all but the spare */
+static void bench_pool_slab(const char *name, unsigned int flags)
+{
+    result_t r = {name, "64B x64k", 0, 0, {0}};
+    static void *objs[POOL_BURST];
+    pool_t *p;
+    uint64_t i, n = scaled(50);
+    int j;
+
+    if(!selected(r.name))
+        return;
+
+    p = pool_create_ex(64, POOL_BURST, 1024, flags);
+    if(!p) {
+        fprintf(stderr, "%s: pool_create_ex failed\n", name);
+        return;
+    }
+
+    BENCH_BEGIN(&r);
+    for(i = 0; i < n; i++) {
+        for(j = 0; j < POOL_BURST; j++)
+            objs[j] = pool_alloc_obj(p);
+        for(j = 0; j < POOL_BURST; j++)
+            pool_free_obj(p, objs[j]);
+    }
+    BENCH_END(&r);
+
+    r.ops = n * POOL_BURST;
+    report(&r);
+    pool_destroy(p);
+}
+
+
+/* ring */
+
+/* spin a little, then give the cpu away in case the other side shares it */
+static inline void ring_wait(unsigned int *spins)
+{
+    if(++*spins & 63)
+        cpu_relax();
+    else
+        sched_yield();
+}
+
+typedef struct ring_arg {
+    ring_t      *r;
+    uint64_t    n;
+    uint64_t    done;       // shared by the consumers, they stop at n
+    unsigned int burst;
+} ring_arg_t;
+
+static void *ring_producer(void *arg)
+{
+    ring_arg_t *a = arg;
+    void *objs[64];
+    uint64_t sent = 0;
+    unsigned int k, spins = 0;
+
+    for(k = 0; k < a->burst; k++)
+        objs[k] = (void *)(uintptr_t)(k + 1);
+
+    while(sent < a->n) {
+        k = a->n - sent < a->burst ? a->n - sent : a->burst;
+        k = ring_enqueue_burst(a->r, objs, k);
+        if(k == 0)
+            ring_wait(&spins);
+        sent += k;
+    }
+
+    return NULL;
+}
+
+static void *ring_consumer(void *arg)
+{
+    ring_arg_t *a = arg;
+    void *objs[64];
+    unsigned int k, spins = 0;
+
+    while(__atomic_load_n(&a->done, __ATOMIC_RELAXED) < a->n) {
+        k = ring_dequeue_burst(a->r, objs, a->burst);
+        if(k == 0)
+            ring_wait(&spins);
+        else
+            __atomic_add_fetch(&a->done, k, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void bench_ring(const char *name, unsigned int flags, int producers,
+        int consumers, unsigned int burst)
+{
+    result_t r = {name, NULL, 0, 0, {0}};
+    pthread_t tids[16];
+    ring_arg_t pa, ca;
+    char param[32];
+    uint64_t n = scaled(4000000);
+    int i;
+
+    if(!selected(name))
+        return;
+
+    snprintf(param, sizeof(param), "%dp%dc burst %u", producers, consumers, burst);
+    r.param = param;
+
+    /* a preempted producer stalls the others in __ring_update_tail() */
+    if(producers + consumers > sysconf(_SC_NPROCESSORS_ONLN)) {
+        fprintf(stderr, "%s %s: skipped, needs %d cpus\n", name, param,
+                producers + consumers);
+        return;
+    }
+
+    n -= n % producers;
+    pa.r = ca.r = ring_create(1024, flags);
+    pa.n = n / producers;
+    ca.n = n;
+    pa.done = ca.done = 0;
+    pa.burst = ca.burst = burst;
+
+    BENCH_BEGIN(&r);
+    for(i = 0; i < producers; i++)
+        pthread_create(&tids[i], NULL, ring_producer, &pa);
+    for(i = 0; i < consumers; i++)
+        pthread_create(&tids[producers + i], NULL, ring_consumer, &ca);
+    for(i = 0; i < producers + consumers; i++)
+        pthread_join(tids[i], NULL);
+    BENCH_END(&r);
+
+    r.ops = n;
+    report(&r);
+    ring_destroy(pa.r);
+}
+
+
+/* hash table */
+
+typedef struct ht_entry {
+    uint64_t    key;
+    list_head_t node;
+} ht_entry_t;
+
+static uint32_t ht_hash(const uint64_t *key)
+{
+    return (*key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static int ht_cmp(const uint64_t *key, list_head_t *node)
+{
+    return list_entry(node, ht_entry_t, node)->key == *key;
+}
+
+HTABLE_DEFINE(ht64, uint64_t, ht_hash, ht_cmp)
+
+static void bench_htable(int count, bool typed)
+{
+    result_t r = {typed ? "htable_find_typed" : "htable_find", NULL, 0, 0, {0}};
+    char param[32];
+    ht_entry_t *entries;
+    htable_t *t;
+    uint64_t seed = 88172645463325252ULL, key, i, n = scaled(4000000);
+    uint64_t found = 0;
+    int j;
+
+    if(!selected(r.name))
+        return;
+
+    snprintf(param, sizeof(param), "%d entries", count);
+    r.param = param;
+
+    t = ht64_create(count);
+    entries = calloc(count, sizeof(ht_entry_t));
+    for(j = 0; j < count; j++) {
+        entries[j].key = rnd(&seed);
+        htable_add(t, &entries[j].key, &entries[j].node);
+    }
+
+    /* hits in random order */
+    seed = 2463534242ULL;
+    BENCH_BEGIN(&r);
+    if(typed) {
+        for(i = 0; i < n; i++) {
+            key = entries[rnd(&seed) % count].key;
+            found += ht64_find(t, &key) != NULL;
+        }
+    } else {
+        for(i = 0; i < n; i++) {
+            key = entries[rnd(&seed) % count].key;
+            found += htable_find(t, &key) != NULL;
+        }
+    }
+    BENCH_END(&r);
+
+    if(found != n)
+        fprintf(stderr, "%s: %lu of %lu found\n", r.name, found, n);
+
+    r.ops = n;
+    report(&r);
+    free(entries);
+    htable_destroy(t);
+}
+
+
+/* from an empty table: every resize on the way up and down is paid here */
+static void bench_htable_grow(int count)
+{
+    result_t add = {"htable_add_grow", NULL, count, 0, {0}};
+    result_t del = {"htable_delete_shrink", NULL, count, 0, {0}};
+    uint64_t seed = 88172645463325252ULL;
+    char param[32];
+    ht_entry_t *entries;
+    htable_t *t;
+    int j;
+
+    if(!selected(add.name) && !selected(del.name))
+        return;
+
+    snprintf(param, sizeof(param), "%d entries", count);
+    add.param = del.param = param;
+
+    t = ht64_create(0);
+    entries = calloc(count, sizeof(ht_entry_t));
+    for(j = 0; j < count; j++)
+        entries[j].key = rnd(&seed);
+
+    BENCH_BEGIN(&add);
+    for(j = 0; j < count; j++)
+        ht64_add(t, &entries[j].key, &entries[j].node);
+    BENCH_END(&add);
+
+    BENCH_BEGIN(&del);
+    for(j = 0; j < count; j++)
+        ht64_delete(t, &entries[j].key);
+    BENCH_END(&del);
+
+    report(&add);
+    report(&del);
+    free(entries);
+    htable_destroy(t);
+}
+
+
+/* shared hash table: readers on 1 to ncpu threads */
+
+#define CHT_ENTRIES     (1 << 20)
+#define CHT_CHURN       4096        // keys the writer adds and deletes
+
+enum { CHT_FIND, CHT_BULK, CHT_WRITER, CHT_LOCKED };
+
+typedef struct cht_arg {
+    chtable_t       *t;
+    htable_t        *ht;            // CHT_LOCKED, behind lock
+    pthread_mutex_t *lock;
+    ht_entry_t      *entries;
+    uint64_t        n;
+    uint64_t        seed;
+    int             mode;
+    volatile bool   *stop;
+} cht_arg_t;
+
+static uint32_t cht_hash(htable_key_t key)
+{
+    return ht_hash(key);
+}
+
+static int cht_cmp(htable_key_t key, list_head_t *node)
+{
+    return ht_cmp(key, node);
+}
+
+static void *cht_reader(void *arg)
+{
+    cht_arg_t *a = arg;
+    htable_key_t keys[16];
+    list_head_t *nodes[16];
+    uint64_t k[16], i, found = 0, seed = a->seed;
+    int j;
+
+    for(j = 0; j < 16; j++)
+        keys[j] = &k[j];
+
+    for(i = 0; i < a->n; i += 16) {
+        for(j = 0; j < 16; j++)
+            k[j] = a->entries[rnd(&seed) % CHT_ENTRIES].key;
+
+        if(a->mode == CHT_BULK) {
+            found += chtable_find_bulk(a->t, keys, 16, nodes);
+        } else if(a->mode == CHT_LOCKED) {
+            for(j = 0; j < 16; j++) {
+                pthread_mutex_lock(a->lock);
+                found += htable_find(a->ht, keys[j]) != NULL;
+                pthread_mutex_unlock(a->lock);
+            }
+        } else {
+            for(j = 0; j < 16; j++)
+                found += chtable_find(a->t, keys[j]) != NULL;
+        }
+    }
+
+    if(found != i)
+        fprintf(stderr, "cht_reader: %lu of %lu found\n", found, i);
+
+    return NULL;
+}
+
+static void *cht_writer(void *arg)
+{
+    cht_arg_t *a = arg;
+    ht_entry_t *churn = a->entries + CHT_ENTRIES;
+    int j;
+
+    while(!*a->stop) {
+        for(j = 0; j < CHT_CHURN; j++)
+            chtable_add(a->t, &churn[j].key, &churn[j].node);
+        for(j = 0; j < CHT_CHURN; j++)
+            chtable_delete(a->t, &churn[j].key);
+    }
+
+    return NULL;
+}
+
+static void bench_chtable(int threads, int mode)
+{
+    static const char *names[] = {"chtable_find", "chtable_find_bulk",
+        "chtable_find_writer", "htable_lock_find"};
+    result_t r = {names[mode], NULL, 0, 0, {0}};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    volatile bool stop = false;
+    pthread_t tids[64], wtid;
+    cht_arg_t args[64], warg;
+    uint64_t seed = 88172645463325252ULL;
+    ht_entry_t *entries;
+    char param[32];
+    chtable_t *t;
+    htable_t *ht;
+    int i;
+
+    if(!selected(r.name))
+        return;
+
+    snprintf(param, sizeof(param), "%d threads", threads);
+    r.param = param;
+
+    entries = calloc(CHT_ENTRIES + CHT_CHURN, sizeof(ht_entry_t));
+    t = chtable_create(64, CHT_ENTRIES, cht_cmp, cht_hash);
+    ht = htable_create(mode == CHT_LOCKED ? CHT_ENTRIES : 0, cht_cmp, cht_hash);
+    for(i = 0; i < CHT_ENTRIES + CHT_CHURN; i++)
+        entries[i].key = rnd(&seed);
+    for(i = 0; i < CHT_ENTRIES; i++) {
+        if(mode == CHT_LOCKED)
+            htable_add(ht, &entries[i].key, &entries[i].node);
+        else
+            chtable_add(t, &entries[i].key, &entries[i].node);
+    }
+
+    if(mode == CHT_WRITER) {
+        warg.t = t;
+        warg.entries = entries;
+        warg.stop = &stop;
+        pthread_create(&wtid, NULL, cht_writer, &warg);
+    }
+
+    BENCH_BEGIN(&r);
+    for(i = 0; i < threads; i++) {
+        args[i].t = t;
+        args[i].ht = ht;
+        args[i].lock = &lock;
+        args[i].entries = entries;
+        args[i].n = scaled(2000000);
+        args[i].seed = 2463534242ULL + i;
+        args[i].mode = mode;
+        pthread_create(&tids[i], NULL, cht_reader, &args[i]);
+    }
+    for(i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    BENCH_END(&r);
+
+    if(mode == CHT_WRITER) {
+        stop = true;
+        pthread_join(wtid, NULL);
+    }
+
+    r.ops = DIV_ROUND_UP(scaled(2000000), 16) * 16 * threads;
+    report(&r);
+    chtable_destroy(t);
+    htable_destroy(ht);
+    free(entries);
+}
+
+static void bench_chtable_scaling(void)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN), threads, mode;
+
+    if(ncpu > 64)
+        ncpu = 64;
+
+    for(mode = CHT_FIND; mode <= CHT_LOCKED; mode++) {
+        for(threads = 1; threads < ncpu; threads *= 2)
+            bench_chtable(threads, mode);
+        bench_chtable(ncpu, mode);
+    }
+}
+
+
+/* timers */
+
+static uint64_t timers_fired;
+
+static void timer_cb(ev_timer_t *timer)
+{
+    UNUSED(timer);
+    timers_fired++;
+}
+
+/* an always readable eventfd keeps ev_run from sleeping */
+typedef struct wake_event {
+    ev_event_t      event;
+    ev_context_t    *c;
+    uint64_t        expect;
+} wake_event_t;
+
+static void stop_cb(ev_event_t *event)
+{
+    wake_event_t *w = container_of(event, wake_event_t, event);
+
+    if(timers_fired >= w->expect)
+        w->c->stopped = 1;
+}
+
+static void bench_timers(uint64_t count)
+{
+    result_t start = {"timer_start", NULL, 0, 0, {0}};
+    result_t rearm = {"timer_rearm", NULL, 0, 0, {0}};
+    result_t expire = {"timer_expire", NULL, 0, 0, {0}};
+    result_t cancel = {"timer_cancel", NULL, 0, 0, {0}};
+    ev_context_t *c;
+    ev_timer_t *timers;
+    wake_event_t wake;
+    char param[32];
+    uint64_t seed = 0x2545f4914f6cdd1dULL, i, one = 1;
+
+    if(!selected("timer_"))
+        return;
+
+    snprintf(param, sizeof(param), "%lu timers", count);
+    start.param = rearm.param = expire.param = cancel.param = param;
+
+    c = ev_create_context(16);
+    timers = calloc(count, sizeof(ev_timer_t));
+
+    /* spread over 1 to 100000 msec, all wheel levels get some */
+    for(i = 0; i < count; i++)
+        ev_init_timer(&timers[i], 1 + rnd(&seed) % 100000, timer_cb);
+
+    BENCH_BEGIN(&start);
+    for(i = 0; i < count; i++)
+        ev_start_timer(c, &timers[i]);
+    BENCH_END(&start);
+    start.ops = count;
+
+    BENCH_BEGIN(&rearm);
+    for(i = 0; i < count; i++)
+        ev_start_timer(c, &timers[i]);
+    BENCH_END(&rearm);
+    rearm.ops = count;
+
+    BENCH_BEGIN(&cancel);
+    for(i = 0; i < count; i++)
+        ev_cancel_timer(c, &timers[i]);
+    BENCH_END(&cancel);
+    cancel.ops = count;
+
+    /* everything due within 2 msec, expired by one ev_run round */
+    for(i = 0; i < count; i++) {
+        timers[i].msec = 1 + (i & 1);
+        ev_start_timer(c, &timers[i]);
+    }
+    usleep(5000);
+
+    memset(&wake, 0, sizeof(wake));
+    wake.c = c;
+    wake.expect = count;
+    wake.event.fd = eventfd(0, EFD_NONBLOCK);
+    wake.event.events = EV_READ_EVENT;
+    wake.event.callback = stop_cb;
+    if(write(wake.event.fd, &one, sizeof(one)) != sizeof(one))
+        perror("eventfd");
+    ev_register_event(c, &wake.event);
+
+    timers_fired = 0;
+    BENCH_BEGIN(&expire);
+    ev_run(c);
+    BENCH_END(&expire);
+    expire.ops = count;
+
+    report(&start);
+    report(&rearm);
+    report(&cancel);
+    report(&expire);
+
+    ev_unregister_event(c, &wake.event);
+    close(wake.event.fd);
+    free(timers);
+    ev_destroy_context(c);
+}
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s scale] [-f text|csv|json] [-o file] [filter]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    out = stdout;
+    while((opt = getopt(argc, argv, "s:f:o:")) != -1) {
+        switch(opt) {
+        case 's':
+            scale = atof(optarg);
+            break;
+        case 'f':
+            if(strcmp(optarg, "csv") == 0)
+                format = FMT_CSV;
+            else if(strcmp(optarg, "json") == 0)
+                format = FMT_JSON;
+            else if(strcmp(optarg, "text") != 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind < argc)
+        filter = argv[optind];
+
+    if(format == FMT_CSV)
+        fprintf(out, "name,param,ops,ns_per_op,ops_per_sec,cache_misses_per_op,instrs_per_op\n");
+
+    bench_pool(false);
+    bench_pool(true);
+    bench_pool_bulk();
+    bench_pool_slab("pool_slab", 0);
+    bench_pool_slab("pool_slab_release", POOL_F_RELEASE);
+    bench_pool_slab("pool_slab_huge", POOL_F_RELEASE | POOL_F_HUGEPAGE);
+
+    bench_ring("ring_spsc", RING_F_SPSC, 1, 1, 1);
+    bench_ring("ring_spsc", RING_F_SPSC, 1, 1, 32);
+    bench_ring("ring_mpsc", RING_F_MPSC, 2, 1, 1);
+    bench_ring("ring_mpsc", RING_F_MPSC, 2, 1, 32);
+    bench_ring("ring_mpmc", RING_F_MPMC, 2, 2, 1);
+    bench_ring("ring_mpmc", RING_F_MPMC, 2, 2, 32);
+
+    bench_htable(1 << 10, false);
+    bench_htable(1 << 10, true);
+    bench_htable(1 << 16, false);
+    bench_htable(1 << 16, true);
+    bench_htable(1 << 20, false);
+    bench_htable(1 << 20, true);
+    bench_htable_grow(1 << 20);
+    bench_chtable_scaling();
+
+    bench_timers(10000);
+    bench_timers(100000);
+    bench_timers(1000000);
+
+    if(out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# closed loop echo runs over worker and connection counts, one
+# key=value line per run. build bench_server and bench_client first,
+# see the head of their sources.
+#
+#  bench/run_matrix.sh [workers...] -- [conns...]
+#
+# BIN (default .), PORT, DURATION, THREADS, PIPELINE and SERVER_ARGS
+# override the defaults.
+
+BIN=${BIN:-.}
+PORT=${PORT:-19900}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+PIPELINE=${PIPELINE:-1}
+
+WORKERS=""
+CONNS=""
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    WORKERS="$WORKERS $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+CONNS="$*"
+
+WORKERS=${WORKERS:-"1 2 4"}
+CONNS=${CONNS:-"2 16 64 256"}
+
+for w in $WORKERS; do
+    $BIN/bench_server -p $PORT -w $w $SERVER_ARGS > /dev/null &
+    pid=$!
+    sleep 1
+
+    for c in $CONNS; do
+        t=$THREADS
+        [ $c -lt $t ] && t=$c
+        printf "workers=%s " $w
+        $BIN/bench_client -p $PORT -t $t -c $c -d $DURATION -P $PIPELINE -S $pid | tail -n 1
+    done
+
+    kill -INT $pid
+    wait $pid
+done
@@ -0,0 +1,131 @@
+/*
+ * lock-free chtable readers against a writer that keeps growing and
+ * shrinking the table, so slot arrays are retired and reused under the
+ * readers. cmp must only ever be given entries, and keys that stay in
+ * the table must always be found.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c demo/check_chtable.c -o check_chtable -lpthread
+ *  ./check_chtable [seconds]
+ */
+#include "chash_table.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CHECK_ENTRIES       20000
+#define CHECK_STABLE        500     // never deleted
+#define CHECK_READERS       3
+
+typedef struct entry {
+    uint64_t        key;
+    list_head_t     node;
+} entry_t;
+
+static entry_t entries[CHECK_ENTRIES];
+static chtable_t *table;
+static volatile bool stop;
+
+static _Atomic uint64_t bad_nodes;
+static _Atomic uint64_t misses;
+static _Atomic uint64_t wrong;
+
+static uint32_t entry_hash(htable_key_t key)
+{
+    return hash_fold32(hash64_u64(*(uint64_t *)key, 0));
+}
+
+/* a racing reader may see a deleted entry, never anything else */
+static int entry_cmp(htable_key_t key, list_head_t *node)
+{
+    entry_t *e = list_entry(node, entry_t, node);
+
+    if(e < entries || e >= entries + CHECK_ENTRIES || node != &e->node) {
+        atomic_fetch_add(&bad_nodes, 1);
+        return 0;
+    }
+
+    return e->key == *(uint64_t *)key;
+}
+
+static void *reader(void *arg)
+{
+    uint64_t seed = (uintptr_t)arg + 1, key;
+    list_head_t *node;
+    uint32_t i;
+
+    while(!stop) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        i = seed % CHECK_ENTRIES;
+        key = entries[i].key;
+
+        node = chtable_find(table, &key);
+        if(node && node != &entries[i].node)
+            atomic_fetch_add(&wrong, 1);
+        if(!node && i < CHECK_STABLE)
+            atomic_fetch_add(&misses, 1);
+    }
+
+    return NULL;
+}
+
+/* fill up and empty out again, each round grows and shrinks the table */
+static void *writer(void *arg)
+{
+    uint64_t *rounds = arg;
+    int i;
+
+    while(!stop) {
+        for(i = CHECK_STABLE; i < CHECK_ENTRIES; i++)
+            if(chtable_add(table, &entries[i].key, &entries[i].node) != 0)
+                atomic_fetch_add(&wrong, 1);
+
+        for(i = CHECK_STABLE; i < CHECK_ENTRIES; i++)
+            if(chtable_delete(table, &entries[i].key) != &entries[i].node)
+                atomic_fetch_add(&wrong, 1);
+
+        (*rounds)++;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t readers[CHECK_READERS], w;
+    int seconds = argc > 1 ? atoi(argv[1]) : 2;
+    uint64_t rounds = 0;
+    int i;
+
+    for(i = 0; i < CHECK_ENTRIES; i++)
+        entries[i].key = i * 0x10001ULL + 5;
+
+    /* one shard, all readers race the writer */
+    table = chtable_create(1, 0, entry_cmp, entry_hash);
+    if(!table)
+        return 1;
+
+    for(i = 0; i < CHECK_STABLE; i++)
+        chtable_add(table, &entries[i].key, &entries[i].node);
+
+    for(i = 0; i < CHECK_READERS; i++)
+        pthread_create(&readers[i], NULL, reader, (void *)(uintptr_t)i);
+    pthread_create(&w, NULL, writer, &rounds);
+
+    sleep(seconds);
+    stop = true;
+
+    pthread_join(w, NULL);
+    for(i = 0; i < CHECK_READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    printf("%lu rounds, %lu bad nodes to cmp, %lu misses, %lu wrong\n",
+            (unsigned long)rounds, (unsigned long)bad_nodes,
+            (unsigned long)misses, (unsigned long)wrong);
+
+    chtable_destroy(table);
+    return bad_nodes || misses || wrong || rounds == 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * idle connections must hold no input buffer. an edge triggered read
+ * that fills the buffer reads again and finds the socket empty, at once
+ * or in the next round when the read budget is used up. the buffer
+ * taken for that read must go back to buf_pool.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c demo/check_inbuf.c -o check_inbuf -lpthread
+ *  ./check_inbuf [port]
+ */
+#include "lcepoll.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK_BUF_SIZE      1024
+#define CHECK_BUF_NUM       16
+#define CHECK_CONNS         4
+
+static bool on_accept(lcs_conn_t *conn)
+{
+    UNUSED(conn);
+    return true;
+}
+
+/* consume whole buffers of input, one byte of answer each */
+static bool on_data(lcs_conn_t *conn, lcs_slice_t *in)
+{
+    while(in->len >= CHECK_BUF_SIZE) {
+        lcs_slice_consume(in, CHECK_BUF_SIZE);
+        if(lcs_conn_send(conn, "k", 1) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static void sleep_ms(int ms)
+{
+    usleep(ms * 1000);
+}
+
+/* free input buffers, the workers must be stopped */
+static int free_bufs(lcs_worker_t *w)
+{
+    void *bufs[CHECK_BUF_NUM];
+    int n;
+
+    n = pool_alloc_bulk(w->buf_pool, bufs, CHECK_BUF_NUM);
+    pool_free_bulk(w->buf_pool, bufs, n);
+
+    return n;
+}
+
+/*
+ * CHECK_CONNS peers send exactly a buffer each and stay connected. with
+ * read_iters 1 the read that fills the buffer uses up the budget, the
+ * empty read comes in the pended round.
+ */
+static int check(const char *name, port_t port, uint32_t read_iters)
+{
+    lcs_config_t cfg;
+    lcserver_t *server;
+    socket_t fds[CHECK_CONNS];
+    char out[CHECK_BUF_SIZE], c;
+    int i, n, failed = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = port;
+    cfg.slave_num = 1;
+    cfg.max_conns = 16;
+    cfg.backend = EV_BACKEND_EPOLL;
+    cfg.edge_triggered = true;
+    cfg.read_budget_iters = read_iters;
+    cfg.in_buf_size = CHECK_BUF_SIZE;
+    cfg.in_buf_num = CHECK_BUF_NUM;
+
+    server = lcserver_create(&cfg);
+    if(!server)
+        return 1;
+    lcserver_register_accept(server, on_accept);
+    lcserver_register_data(server, on_data);
+    if(lcserver_start(server) != 0) {
+        lcserver_destroy(server);
+        return 1;
+    }
+
+    memset(out, 'x', sizeof(out));
+    for(i = 0; i < CHECK_CONNS; i++) {
+        fds[i] = sock_connect_to(inet_addr("127.0.0.1"), port, 1);
+        if(fds[i] < 0 || write(fds[i], out, sizeof(out)) != sizeof(out) ||
+                read(fds[i], &c, 1) != 1) {
+            printf("%s: no answer\n", name);
+            failed = 1;
+        }
+    }
+
+    /* let the pended rounds run */
+    sleep_ms(50);
+    lcserver_stop(server);
+
+    n = free_bufs(&server->slave[0]);
+    if(n != CHECK_BUF_NUM) {
+        printf("%s: %d idle connections hold %d input buffers\n",
+                name, CHECK_CONNS, CHECK_BUF_NUM - n);
+        failed = 1;
+    } else if(!failed) {
+        printf("%s: ok\n", name);
+    }
+
+    for(i = 0; i < CHECK_CONNS; i++)
+        if(fds[i] >= 0)
+            close(fds[i]);
+    lcserver_destroy(server);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    port_t port = argc > 1 ? atoi(argv[1]) : 19720;
+    int failed = 0;
+
+    failed |= check("epoll et drained", port, 0);
+    failed |= check("epoll et pended", port + 1, 1);
+
+    return failed;
+}
@@ -0,0 +1,152 @@
+/*
+ * connections that are active partway through their timeout must survive
+ * it, and be closed one full timeout after their last activity. the data
+ * cases run io_uring connections in completion mode.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c demo/check_timeout.c -o check_timeout -lpthread
+ *  ./check_timeout [port]
+ */
+#include "lcepoll.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CHECK_TIMEOUT_MS    300
+
+static bool on_accept(lcs_conn_t *conn)
+{
+    UNUSED(conn);
+    return true;
+}
+
+static bool on_read(lcs_conn_t *conn)
+{
+    char buf[64];
+    ssize_t n;
+
+    n = read(conn->s, buf, sizeof(buf));
+    if(n <= 0)
+        return false;
+
+    return lcs_conn_send(conn, buf, n) == 0;
+}
+
+static bool on_data(lcs_conn_t *conn, lcs_slice_t *in)
+{
+    if(lcs_conn_send_slice(conn, in) != 0)
+        return false;
+
+    lcs_slice_consume(in, in->len);
+    return true;
+}
+
+static void sleep_ms(int ms)
+{
+    usleep(ms * 1000);
+}
+
+/* 1 closed by the server, 0 still open, -1 error */
+static int peer_closed(socket_t fd)
+{
+    char c;
+    ssize_t n;
+
+    n = recv(fd, &c, 1, MSG_DONTWAIT);
+    if(n == 0)
+        return 1;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+
+    return n < 0 && errno == ECONNRESET ? 1 : -1;
+}
+
+/*
+ * a client that writes at 2/3 of the timeout gets its echo back and
+ * must still be connected at 4/3, when an activity stamp taken at the
+ * start of the poll would have closed it already.
+ */
+static int check(const char *name, port_t port, ev_backend_type_t backend,
+        bool data, uint32_t idle_ms, uint32_t read_ms)
+{
+    lcs_config_t cfg;
+    lcserver_t *server;
+    socket_t fd;
+    char c;
+    int failed = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = port;
+    cfg.slave_num = 1;
+    cfg.max_conns = 16;
+    cfg.backend = backend;
+    cfg.idle_timeout_ms = idle_ms;
+    cfg.read_timeout_ms = read_ms;
+
+    server = lcserver_create(&cfg);
+    if(!server)
+        return 1;
+    lcserver_register_accept(server, on_accept);
+    if(data)
+        lcserver_register_data(server, on_data);
+    else
+        lcserver_register_read(server, on_read);
+    if(lcserver_start(server) != 0) {
+        lcserver_destroy(server);
+        return 1;
+    }
+
+    fd = sock_connect_to(inet_addr("127.0.0.1"), port, 1);
+    if(fd < 0) {
+        failed = 1;
+        goto out;
+    }
+
+    sleep_ms(CHECK_TIMEOUT_MS * 2 / 3);
+    if(write(fd, "x", 1) != 1 || recv(fd, &c, 1, 0) != 1) {
+        printf("%s: no echo\n", name);
+        failed = 1;
+        goto out;
+    }
+
+    sleep_ms(CHECK_TIMEOUT_MS * 2 / 3);
+    if(peer_closed(fd) != 0) {
+        printf("%s: closed before the timeout\n", name);
+        failed = 1;
+        goto out;
+    }
+
+    sleep_ms(CHECK_TIMEOUT_MS * 2 / 3);
+    if(peer_closed(fd) != 1) {
+        printf("%s: not closed after the timeout\n", name);
+        failed = 1;
+        goto out;
+    }
+
+    printf("%s: ok\n", name);
+
+out:
+    if(fd >= 0)
+        close(fd);
+    lcserver_stop(server);
+    lcserver_destroy(server);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    port_t port = argc > 1 ? atoi(argv[1]) : 19700;
+    int failed = 0;
+
+    failed |= check("epoll idle", port, EV_BACKEND_EPOLL, false, CHECK_TIMEOUT_MS, 0);
+    failed |= check("epoll read", port + 1, EV_BACKEND_EPOLL, false, 0, CHECK_TIMEOUT_MS);
+    failed |= check("io_uring idle", port + 2, EV_BACKEND_IO_URING, false, CHECK_TIMEOUT_MS, 0);
+    failed |= check("io_uring read", port + 3, EV_BACKEND_IO_URING, false, 0, CHECK_TIMEOUT_MS);
+    failed |= check("io_uring data idle", port + 4, EV_BACKEND_IO_URING, true,
+            CHECK_TIMEOUT_MS, 0);
+    failed |= check("io_uring data read", port + 5, EV_BACKEND_IO_URING, true,
+            0, CHECK_TIMEOUT_MS);
+
+    return failed;
+}
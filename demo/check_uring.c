@@ -0,0 +1,389 @@
+/*
+ * io_uring completion mode: input buffers lent to the kernel through the
+ * provided buffer ring must all come back, and sends still in flight when
+ * their connection closes must complete and be freed.
+ *
+ *  gcc -O2 -std=gnu11 -Iinclude lib/[a-z]*.c demo/check_uring.c -o check_uring -lpthread
+ *  ./check_uring [port]
+ */
+#include "lcepoll.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK_BUF_SIZE      1024
+#define CHECK_BUF_NUM       32
+#define CHECK_CONNS         8
+#define CHECK_ROUNDS        40
+#define CHECK_BIG_SEND      (4 * 1024 * 1024)
+
+static char *big;
+
+static void sleep_ms(int ms)
+{
+    usleep(ms * 1000);
+}
+
+static bool on_accept(lcs_conn_t *conn)
+{
+    UNUSED(conn);
+    return true;
+}
+
+/* echo messages of a 4 byte length and a payload, an empty one closes */
+static bool on_echo(lcs_conn_t *conn, lcs_slice_t *in)
+{
+    lcs_slice_t msg;
+    uint32_t len;
+
+    while(in->len >= sizeof(len)) {
+        memcpy(&len, in->data, sizeof(len));
+        if(len == 0)
+            return false;
+        if(in->len < sizeof(len) + len)
+            break;
+
+        lcs_slice_retain(in, 0, sizeof(len) + len, &msg);
+        if(lcs_conn_send_slice(conn, &msg) != 0) {
+            lcs_slice_release(&msg);
+            return false;
+        }
+        lcs_slice_release(&msg);
+        lcs_slice_consume(in, sizeof(len) + len);
+    }
+
+    return true;
+}
+
+/* answer every 4 bytes with CHECK_BIG_SEND bytes */
+static bool on_flood(lcs_conn_t *conn, lcs_slice_t *in)
+{
+    while(in->len >= 4) {
+        lcs_slice_consume(in, 4);
+        if(lcs_conn_send(conn, big, CHECK_BIG_SEND) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static lcserver_t *start(port_t port, lcs_data_callback_t on_data, uint32_t idle_ms)
+{
+    lcs_config_t cfg;
+    lcserver_t *server;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = port;
+    cfg.slave_num = 1;
+    cfg.max_conns = 64;
+    cfg.backend = EV_BACKEND_IO_URING;
+    cfg.in_buf_size = CHECK_BUF_SIZE;
+    cfg.in_buf_num = CHECK_BUF_NUM;
+    cfg.idle_timeout_ms = idle_ms;
+
+    server = lcserver_create(&cfg);
+    if(!server)
+        return NULL;
+    lcserver_register_accept(server, on_accept);
+    lcserver_register_data(server, on_data);
+    if(lcserver_start(server) != 0) {
+        lcserver_destroy(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+static bool wait_closed(lcserver_t *server)
+{
+    lcs_stats_t stats;
+    int i;
+
+    for(i = 0; i < 200; i++) {
+        lcserver_get_stats(server, &stats);
+        if(stats.active_conns == 0)
+            return true;
+        sleep_ms(10);
+    }
+
+    return false;
+}
+
+/*
+ * once the server is stopped and every connection is gone, each input
+ * buffer is either free in buf_pool or lent to the ring.
+ */
+static int count_bufs(lcs_worker_t *w)
+{
+    void *bufs[CHECK_BUF_NUM];
+    int n, i;
+
+    n = pool_alloc_bulk(w->buf_pool, bufs, CHECK_BUF_NUM);
+    pool_free_bulk(w->buf_pool, bufs, n);
+
+    for(i = 0; i < (int)w->nr_ring_bufs; i++)
+        if(w->ring_bufs[i])
+            n++;
+
+    return n;
+}
+
+static void reset_close(socket_t fd)
+{
+    struct linger lg = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+/*
+ * ask the server to close with more than a ring buffer behind, which
+ * the kernel completes in several recvs, so the ones after the close are
+ * stale and carry buffers.
+ */
+static void quit_close(socket_t fd)
+{
+    char c;
+
+    memset(big, 0, CHECK_BUF_SIZE * 3);
+    if(write(fd, big, CHECK_BUF_SIZE * 3) < 0)
+        return;
+
+    while(read(fd, &c, 1) > 0)
+        ;
+    close(fd);
+}
+
+static bool echo_one(socket_t fd, uint32_t len)
+{
+    char out[CHECK_BUF_SIZE], in[CHECK_BUF_SIZE];
+    uint32_t i, got = 0;
+    ssize_t n;
+
+    memcpy(out, &len, sizeof(len));
+    for(i = 0; i < len; i++)
+        out[sizeof(len) + i] = rand();
+    len += sizeof(len);
+
+    if(write(fd, out, len) != (ssize_t)len)
+        return false;
+
+    while(got < len) {
+        n = read(fd, in + got, len - got);
+        if(n <= 0)
+            return false;
+        got += n;
+    }
+
+    return memcmp(in, out, len) == 0;
+}
+
+/*
+ * a burst of exactly the ring's worth of messages in one write: the
+ * kernel runs out of ring buffers only if some were lost.
+ */
+static bool burst(port_t port, uint32_t bufs)
+{
+    uint32_t len = CHECK_BUF_SIZE / 2 - sizeof(len);
+    uint32_t i, total = bufs * CHECK_BUF_SIZE, got = 0;
+    char *out, *in;
+    socket_t fd;
+    ssize_t n;
+    bool ok = false;
+
+    out = malloc(total);
+    in = malloc(total);
+    fd = sock_connect_to(inet_addr("127.0.0.1"), port, 1);
+    if(!out || !in || fd < 0)
+        goto done;
+
+    for(i = 0; i < total; i += CHECK_BUF_SIZE / 2)
+        memcpy(out + i, &len, sizeof(len));
+    if(write(fd, out, total) != (ssize_t)total)
+        goto done;
+
+    while(got < total) {
+        n = read(fd, in + got, total - got);
+        if(n <= 0)
+            goto done;
+        got += n;
+    }
+    ok = memcmp(in, out, total) == 0;
+
+done:
+    if(fd >= 0)
+        close(fd);
+    free(out);
+    free(in);
+    return ok;
+}
+
+/*
+ * rounds of connections sending more than the ring holds. half of them
+ * reset with data the server has not read yet, one a round is closed by
+ * the server with recv completions still queued, whose buffers must go
+ * back to the ring.
+ */
+static int check_recycle(port_t port)
+{
+    lcserver_t *server;
+    lcs_worker_t *w;
+    socket_t fds[CHECK_CONNS];
+    lcs_stats_t stats;
+    uint64_t ring_empty;
+    int round, i, j, failed = 0;
+
+    server = start(port, on_echo, 0);
+    if(!server)
+        return 1;
+    w = &server->slave[0];
+
+    for(round = 0; round < CHECK_ROUNDS && !failed; round++) {
+        for(i = 0; i < CHECK_CONNS; i++)
+            fds[i] = sock_connect_to(inet_addr("127.0.0.1"), port, 1);
+
+        for(i = 0; i < CHECK_CONNS; i++) {
+            if(fds[i] < 0) {
+                failed = 1;
+                continue;
+            }
+
+            for(j = 0; j < 4; j++) {
+                if(!echo_one(fds[i], 1 + rand() % (CHECK_BUF_SIZE / 2))) {
+                    printf("ring recycle: bad echo in round %d\n", round);
+                    failed = 1;
+                    break;
+                }
+            }
+
+            if(i & 1) {
+                if(write(fds[i], big, CHECK_BUF_SIZE) < 0)
+                    failed = 1;
+                reset_close(fds[i]);
+            }
+            else if(i == 2) {
+                quit_close(fds[i]);
+            }
+            else {
+                close(fds[i]);
+            }
+        }
+    }
+
+    if(!wait_closed(server)) {
+        printf("ring recycle: connections left open\n");
+        failed = 1;
+    }
+
+    lcserver_get_stats(server, &stats);
+    ring_empty = stats.ring_empty;
+    if(!failed && !burst(port, w->nr_ring_bufs)) {
+        printf("ring recycle: bad burst echo\n");
+        failed = 1;
+    }
+    wait_closed(server);
+
+    lcserver_get_stats(server, &stats);
+    lcserver_stop(server);
+
+    if(!w->completions) {
+        printf("ring recycle: skipped, no completion mode\n");
+    }
+    else if(stats.ring_empty != ring_empty) {
+        printf("ring recycle: ring buffers lost\n");
+        failed = 1;
+    }
+    else if(count_bufs(w) != CHECK_BUF_NUM) {
+        printf("ring recycle: %d of %d input buffers back\n",
+                count_bufs(w), CHECK_BUF_NUM);
+        failed = 1;
+    }
+    else if(!failed) {
+        printf("ring recycle: ok, %lu reads\n", (unsigned long)stats.reads);
+    }
+
+    lcserver_destroy(server);
+    return failed;
+}
+
+/*
+ * one peer resets while megabytes are being sent to it, another stops
+ * reading and is closed by the idle timeout: both leave linked sends in
+ * flight that must be freed when they complete.
+ */
+static int check_orphans(port_t port)
+{
+    lcserver_t *server;
+    lcs_worker_t *w;
+    socket_t a, b;
+    char buf[1024];
+    int failed = 0;
+
+    server = start(port, on_flood, 200);
+    if(!server)
+        return 1;
+    w = &server->slave[0];
+
+    a = sock_connect_to(inet_addr("127.0.0.1"), port, 1);
+    b = sock_connect_to(inet_addr("127.0.0.1"), port, 1);
+    if(a < 0 || b < 0 || write(a, "abcd", 4) != 4 || write(b, "abcd", 4) != 4) {
+        failed = 1;
+        goto out;
+    }
+
+    sleep_ms(100);
+    if(read(b, buf, sizeof(buf)) <= 0)
+        failed = 1;
+    reset_close(b);
+    b = -1;
+
+    if(!wait_closed(server)) {
+        printf("orphaned send: connections left open\n");
+        failed = 1;
+    }
+
+out:
+    if(a >= 0)
+        close(a);
+    if(b >= 0)
+        close(b);
+    sleep_ms(50);
+    lcserver_stop(server);
+
+    if(!w->completions) {
+        printf("orphaned send: skipped, no completion mode\n");
+    }
+    else if(!list_empty(&w->orphans)) {
+        printf("orphaned send: sends left on the worker\n");
+        failed = 1;
+    }
+    else if(count_bufs(w) != CHECK_BUF_NUM) {
+        printf("orphaned send: %d of %d input buffers back\n",
+                count_bufs(w), CHECK_BUF_NUM);
+        failed = 1;
+    }
+    else if(!failed) {
+        printf("orphaned send: ok\n");
+    }
+
+    lcserver_destroy(server);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    port_t port = argc > 1 ? atoi(argv[1]) : 19710;
+    int failed = 0;
+
+    big = calloc(1, CHECK_BIG_SEND);
+    if(!big)
+        return 1;
+
+    failed |= check_recycle(port);
+    failed |= check_orphans(port + 1);
+
+    free(big);
+    return failed;
+}
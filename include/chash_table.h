@@ -0,0 +1,72 @@
+#ifndef CHASH_TABLE_H
+#define CHASH_TABLE_H
+
+#include "hash_table.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * htable shared between threads. the keys are spread over a power of 2
+ * number of shards, each one an htable_t with its own writer lock and
+ * sequence count:
+ *
+ *  - writers take the shard lock and make the sequence odd while they
+ *    change the table.
+ *  - readers take no lock and write nothing shared, they probe the
+ *    table and retry if the sequence was odd or moved meanwhile.
+ *
+ * a reader may probe slots a writer is changing or has just replaced.
+ * replaced slot arrays are kept by the shard and only reused for a
+ * table of the same capacity, or freed by chtable_destroy(), so such a
+ * reader reads stale memory but never freed memory. an insert fills the
+ * slot before its control byte and reused arrays are zeroed, so cmp is
+ * never given a pointer that was not an entry. cmp may likewise be
+ * called on an entry that was deleted a moment ago: entries must stay
+ * readable while the table exists, e.g. by coming from a pool_t not
+ * created with POOL_F_RELEASE.
+ *
+ * an entry returned by chtable_find() may be deleted by another thread
+ * right after, the caller needs its own way to keep it alive.
+ */
+
+typedef struct chtable_shard {
+    pthread_mutex_t     lock;
+    _Atomic uint32_t    seq;
+    htable_t            ht;
+    htable_mem_t        mem;
+
+    /* slot arrays a reader may still be probing */
+    struct {
+        void            *mem;
+        size_t          len;
+    }                   *retired;
+    int                 nr_retired;
+    int                 max_retired;
+} __attribute__((aligned(CACHE_LINE_SIZE))) chtable_shard_t;
+
+typedef struct chtable {
+    uint32_t            shard_bits;
+    htable_hash_t       hash;
+    chtable_shard_t     *shards;
+} chtable_t;
+
+
+/* shards is rounded up to a power of 2, size is spread over them */
+chtable_t *chtable_create(int shards, int size, htable_cmp_t cmp, htable_hash_t hash);
+void chtable_destroy(chtable_t *t);
+
+list_head_t *chtable_find(chtable_t *t, htable_key_t key);
+
+/* look n keys up at once, nodes[i] is NULL for a miss. return the hits */
+int chtable_find_bulk(chtable_t *t, htable_key_t *keys, int n, list_head_t **nodes);
+
+/* 0 on success, -1 if the key is already in or growing the shard failed */
+int chtable_add(chtable_t *t, htable_key_t key, list_head_t *data);
+
+/* return the removed entry, NULL if the key is not in */
+list_head_t *chtable_delete(chtable_t *t, htable_key_t key);
+
+uint32_t chtable_size(chtable_t *t);
+
+#endif
@@ -24,6 +24,14 @@
 	const typeof( ((type *)0)->member ) *__mptr = (ptr);	\
 	(type *)( (char *)__mptr - offsetof(type,member) );})
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()     __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()     __asm__ __volatile__("" ::: "memory")
+#endif
+
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 
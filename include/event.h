@@ -3,29 +3,102 @@
 
 #include "common.h"
 #include "list.h"
+#include "histogram.h"
+#include "ring.h"
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
 
 
 #define EV_TIMER_RESOLUTION     1   // 1 msec
 
+/*
+ * hierarchical timing wheel, the same layout as the classic linux kernel
+ * timer wheel: tv1 holds the next 256 ticks, each of the 4 upper levels
+ * covers 64 times the range of the level below and is cascaded down when
+ * the lower level wraps. one tick is EV_TIMER_RESOLUTION msec.
+ */
+#define EV_TVR_BITS         8
+#define EV_TVN_BITS         6
+#define EV_TVR_SIZE         (1 << EV_TVR_BITS)
+#define EV_TVN_SIZE         (1 << EV_TVN_BITS)
+#define EV_TVR_MASK         (EV_TVR_SIZE - 1)
+#define EV_TVN_MASK         (EV_TVN_SIZE - 1)
+#define EV_TVN_LEVELS       4
+#define EV_TIMER_MAX_TICKS  ((1ULL << (EV_TVR_BITS + EV_TVN_LEVELS * EV_TVN_BITS)) - 1)
+
+/*
+ * callback latency histograms of a context, see ev_enable_latency().
+ * events pick theirs by ev_event_t.lat_type, all timers share the last.
+ */
+#define EV_LAT_TYPES        8
+#define EV_LAT_POST         (EV_LAT_TYPES - 2)
+#define EV_LAT_TIMER        (EV_LAT_TYPES - 1)
+
+/*
+ * tasks posted to a context from other threads, see ev_post(). at most
+ * EV_POST_BUDGET of them run per loop round, the rest in the next ones.
+ */
+#define EV_POST_RING_SIZE   4096
+#define EV_POST_BUDGET      256
+
 #define EV_READ_EVENT       EPOLLIN
 #define EV_WRITE_EVENT      EPOLLOUT
+#define EV_EDGE_TRIGGERED   EPOLLET
 
 struct ev_event;
 struct ev_timer;
+struct ev_io;
+struct ev_context;
+struct ev_backend;
 
 typedef void* ev_user_ptr;
 typedef void(*ev_event_callback_t)(struct ev_event *event);
 typedef void(*ev_timer_callback_t)(struct ev_timer *timer);
+typedef void(*ev_io_callback_t)(struct ev_io *io);
+typedef void(*ev_post_callback_t)(void *arg);
 
 
 typedef struct ev_event {
     int                 fd;
     int                 events;
+    int                 revents;    // set by ev_run before callback
     ev_event_callback_t callback;
+
+    /* see ev_pend_event() */
+    int                 pending_revents;
+    list_head_t         pending;
+
+    /* private to the backend */
+    uint32_t            bk_slot;
+    uint16_t            bk_flags;
+
+    uint8_t             lat_type;   // latency histogram, < EV_LAT_TIMER
 } ev_event_t;
 
 
+/*
+ * completion based i/o, see ev_has_completions(). the kernel runs the
+ * operation and the callback gets its result, instead of a readiness
+ * wakeup followed by a syscall. one ev_io_t runs one kind of operation,
+ * its callback is called once per completion.
+ */
+typedef struct ev_io {
+    int                 fd;
+    ev_io_callback_t    callback;
+    uint8_t             lat_type;   // latency histogram, < EV_LAT_TIMER
+
+    /* set before callback */
+    int                 res;        // bytes, an fd or -errno
+    int                 bid;        // buffer the kernel picked, -1 if none
+    bool                more;       // a multishot operation is still armed
+
+    /* private to the backend */
+    uint32_t            bk_slot;
+    uint32_t            bk_inflight;
+} ev_io_t;
+
+
 typedef struct ev_timer {
     uint64_t            msec;
     uint64_t            abs_msec;
@@ -35,28 +108,164 @@ typedef struct ev_timer {
 } ev_timer_t;
 
 
+typedef struct ev_post {
+    ev_post_callback_t  fn;
+    void                *arg;
+} ev_post_t;
+
+
+typedef struct ev_timer_wheel {
+    uint64_t            clock;      // next tick to be processed
+    uint32_t            count;      // pending timers
+    uint64_t            tv1_map[EV_TVR_SIZE / 64];  // may hold stale bits
+    list_head_t         tv1[EV_TVR_SIZE];
+    list_head_t         tvn[EV_TVN_LEVELS][EV_TVN_SIZE];
+} ev_timer_wheel_t;
+
+
+/*
+ * the poller behind a context. EV_BACKEND_IO_URING polls through
+ * io_uring and falls back to epoll when the kernel lacks support, see
+ * ev_create_context_ex().
+ */
+typedef enum ev_backend_type {
+    EV_BACKEND_EPOLL = 0,
+    EV_BACKEND_IO_URING,
+} ev_backend_type_t;
+
+/* flags for ev_create_context_ex() */
+#define EV_F_SQPOLL         0x01    // io_uring: kernel thread polls submissions
+
+
+/*
+ * written by the loop's own thread only, with plain increments. other
+ * threads read them through ev_get_stats(). all fields are uint64_t.
+ */
+typedef struct ev_stats {
+    uint64_t            polls;      // epoll_wait/io_uring_enter rounds
+    uint64_t            events;     // ready events returned by the polls
+    uint64_t            pending;    // pended events run, see ev_pend_event()
+    uint64_t            timers;     // timer callbacks run
+    uint64_t            spins;      // empty polls while busy polling
+    uint64_t            spin_hits;  // spins which found events
+    uint64_t            spin_ns;    // time of the empty spins
+    uint64_t            work_ns;    // callbacks of busy poll rounds with events
+    uint64_t            posts;      // posted tasks run
+    uint64_t            post_wakeups;   // eventfd reads for posted tasks
+} ev_stats_t;
+
+
 typedef struct ev_context {
     int                 efd;        //for epoll instance
     volatile int        stopped;
-    list_head_t         timer_list;
+    const struct ev_backend *backend;
+    void                *backend_data;
+    bool                completions;    // see ev_has_completions()
+    ev_timer_wheel_t    timers;
+    uint64_t            loop_msec;  // see ev_loop_msec()
+    list_head_t         pending;    // events to run without polling
+    ev_stats_t          stats;
+
+    /* ev_post(): an MPSC ring, woken through post_fd once per burst */
+    ring_t              *posts;
+    int                 post_fd;
+    ev_event_t          post_event;
+    _Atomic bool        post_wake;
+
+    /* busy polling, see ev_set_busy_poll() */
+    uint64_t            busy_poll_max_ns;   // 0: always block
+    uint64_t            busy_poll_ns;       // current spin window
+    uint64_t            last_active_ns;     // end of the last round with events
+    uint64_t            wake_ns;            // set by the backend after waiting
+
+    /* NULL unless ev_enable_latency() */
+    hist_t              *latency[EV_LAT_TYPES];
+    bool                latency_on;
+
     int                 max_events; // for epoll
     struct epoll_event  events[0];  // flexible arrays
 } ev_context_t;
 
 ev_context_t *ev_create_context(int max_events);
 
+ev_context_t *ev_create_context_ex(int max_events, ev_backend_type_t type,
+        unsigned int flags);
+
+ev_backend_type_t ev_backend_type(ev_context_t *ptr_context);
+
 void ev_destroy_context(ev_context_t *ptr_context);
 
+void ev_get_stats(ev_context_t *ptr_context, ev_stats_t *stats);
+
+void ev_set_busy_poll(ev_context_t *ptr_context, uint32_t usecs);
+
+int ev_enable_latency(ev_context_t *ptr_context);
+
+int ev_get_latency(ev_context_t *ptr_context, int type, hist_t *hist);
+
+int ev_set_napi_busy_poll(ev_context_t *ptr_context, uint32_t usecs,
+        uint16_t budget, bool prefer);
+
 int ev_run(ev_context_t *ptr_context);
 
 int ev_register_event(ev_context_t *ptr_context, ev_event_t *event);
 
+int ev_modify_event(ev_context_t *ptr_context, ev_event_t *event);
+
 void ev_unregister_event(ev_context_t *ptr_context, ev_event_t *event);
 
+void ev_pend_event(ev_context_t *ptr_context, ev_event_t *event, int revents);
+
+void ev_unpend_event(ev_context_t *ptr_context, ev_event_t *event);
+
+bool ev_has_completions(ev_context_t *ptr_context);
+
+int ev_io_buffers(ev_context_t *ptr_context, unsigned int entries);
+
+void ev_io_provide(ev_context_t *ptr_context, int bid, void *addr, uint32_t len);
+
+int ev_io_accept(ev_context_t *ptr_context, ev_io_t *io);
+
+int ev_io_recv(ev_context_t *ptr_context, ev_io_t *io);
+
+int ev_io_sendmsg(ev_context_t *ptr_context, ev_io_t *io, struct msghdr *msgs, int n);
+
+void ev_io_cancel(ev_context_t *ptr_context, ev_io_t *io);
+
+int ev_post(ev_context_t *ptr_context, ev_post_callback_t fn, void *arg);
+
+int ev_post_bulk(ev_context_t *ptr_context, const ev_post_t *tasks, int n);
+
+int ev_take_posts(ev_context_t *ptr_context, ev_post_t *tasks, int n);
+
 void ev_init_timer(ev_timer_t *timer, uint64_t msec, ev_timer_callback_t callback);
 
 void ev_start_timer(ev_context_t *ptr_context, ev_timer_t *timer);
 
 void ev_cancel_timer(ev_context_t *ptr_context, ev_timer_t *timer);
 
+static inline uint64_t ev_now_ns(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * msec when the poll of the current loop round returned, or when the
+ * timers ran for timer callbacks. no clock read, only in the loop's own
+ * thread.
+ */
+static inline uint64_t ev_loop_msec(ev_context_t *c)
+{
+    return c->loop_msec;
+}
+
+static inline bool ev_timer_pending(ev_timer_t *timer)
+{
+    return !list_empty(&timer->list);
+}
+
 #endif
@@ -0,0 +1,78 @@
+#ifndef LC_EVENT_BACKEND_H
+#define LC_EVENT_BACKEND_H
+
+#include "event.h"
+
+/*
+ * operations of a poller behind ev_context_t. poll() waits up to timeout
+ * msec and runs the callbacks of the ready events itself, so a backend
+ * can drop completions of events that were unregistered meanwhile. the
+ * io_* operations are only called if init() set c->completions.
+ */
+typedef struct ev_backend {
+    ev_backend_type_t   type;
+    const char          *name;
+
+    int     (*init)(ev_context_t *c, unsigned int flags);
+    void    (*destroy)(ev_context_t *c);
+    int     (*add)(ev_context_t *c, ev_event_t *event);
+    int     (*mod)(ev_context_t *c, ev_event_t *event);
+    void    (*del)(ev_context_t *c, ev_event_t *event);
+    int     (*poll)(ev_context_t *c, int timeout);
+
+    int     (*io_buffers)(ev_context_t *c, unsigned int entries);
+    void    (*io_provide)(ev_context_t *c, int bid, void *addr, uint32_t len);
+    int     (*io_accept)(ev_context_t *c, ev_io_t *io);
+    int     (*io_recv)(ev_context_t *c, ev_io_t *io);
+    int     (*io_sendmsg)(ev_context_t *c, ev_io_t *io, struct msghdr *msgs, int n);
+    void    (*io_cancel)(ev_context_t *c, ev_io_t *io);
+} ev_backend_t;
+
+/*
+ * poll() calls it when the wait returned, before running any callback.
+ * the one clock read of the round, callbacks get it from ev_loop_msec().
+ */
+static inline void ev_backend_woken(ev_context_t *c)
+{
+    c->wake_ns = ev_now_ns();
+    c->loop_msec = c->wake_ns / 1000000;
+}
+
+/* run an event's callback, timed if latency histograms are on */
+static inline void ev_run_callback(ev_context_t *c, ev_event_t *event)
+{
+    uint64_t start;
+    int type;
+
+    if(likely(!c->latency_on)) {
+        event->callback(event);
+        return;
+    }
+
+    /* the callback may free the event */
+    type = event->lat_type;
+    start = hist_now();
+    event->callback(event);
+    hist_record(c->latency[type], hist_elapsed_ns(start, hist_now()));
+}
+
+static inline void ev_run_io_callback(ev_context_t *c, ev_io_t *io)
+{
+    uint64_t start;
+    int type;
+
+    if(likely(!c->latency_on)) {
+        io->callback(io);
+        return;
+    }
+
+    type = io->lat_type;
+    start = hist_now();
+    io->callback(io);
+    hist_record(c->latency[type], hist_elapsed_ns(start, hist_now()));
+}
+
+extern const ev_backend_t ev_epoll_backend;
+extern const ev_backend_t ev_uring_backend;
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef LC_HASH_H
+#define LC_HASH_H
+
+#include "common.h"
+
+/*
+ * hash functions for hash tables, all seeded:
+ *
+ *  - hash_murmur2(): the 32 bit MurmurHash2 of Austin Appleby.
+ *  - hash64(): 64 bit, wyhash style multiply-fold mixing. the fastest
+ *    for keys of any length and the one to use by default.
+ *  - hash_crc32c(): CRC32C (Castagnoli) with the SSE4.2 crc32
+ *    instruction when the cpu has it, a table otherwise. the result is
+ *    a checksum compatible one, but linear, so it hashes worse than the
+ *    other two.
+ *  - hash64_u32/u64/u128(): hash64 class mixing for fixed size keys
+ *    like ipv4 addr + port tuples, inlined, no length dispatch.
+ *
+ * hash_fold32() folds a 64 bit hash for htable_hash_t.
+ */
+
+#define HASH_P0     0xa0761d6478bd642fULL
+#define HASH_P1     0xe7037ed1a0b428dbULL
+#define HASH_P2     0x8ebc6af09c88c6e3ULL
+#define HASH_P3     0x589965cc75374cc3ULL
+
+uint32_t hash_murmur2(const void *key, size_t len, uint32_t seed);
+uint64_t hash64(const void *key, size_t len, uint64_t seed);
+uint32_t hash_crc32c(const void *key, size_t len, uint32_t seed);
+
+/* true if hash_crc32c() uses the crc32 instruction */
+bool hash_crc32c_hw(void);
+
+/* 64x64 -> 128 bit multiply, the two halves xored */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    unsigned __int128 r = (unsigned __int128)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint32_t hash_fold32(uint64_t h)
+{
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static inline uint64_t hash64_u64(uint64_t key, uint64_t seed)
+{
+    return hash_mix(hash_mix(key ^ HASH_P0, seed ^ HASH_P1) ^ HASH_P2, 8 ^ HASH_P3);
+}
+
+static inline uint64_t hash64_u32(uint32_t key, uint64_t seed)
+{
+    return hash_mix(hash_mix(key ^ HASH_P0, seed ^ HASH_P1) ^ HASH_P2, 4 ^ HASH_P3);
+}
+
+/* 16 bytes, no alignment needed */
+static inline uint64_t hash64_u128(const void *key, uint64_t seed)
+{
+    uint64_t a, b;
+
+    __builtin_memcpy(&a, key, 8);
+    __builtin_memcpy(&b, (const char *)key + 8, 8);
+
+    return hash_mix(hash_mix(a ^ HASH_P0, b ^ seed ^ HASH_P1) ^ HASH_P2, 16 ^ HASH_P3);
+}
+
+#endif
@@ -4,30 +4,280 @@
 #include "common.h"
 #include "list.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * open addressing hash table in the style of the abseil swiss table.
+ *
+ *  - every slot has a control byte: EMPTY, DELETED, or the low 7 bits
+ *    of the hash (h2) when it is in use. the rest of the hash (h1)
+ *    picks the first group.
+ *  - slots are probed a group of HTABLE_GROUP at a time, the control
+ *    bytes of a group are compared with one SSE2 instruction, only the
+ *    slots whose h2 matches are passed to cmp.
+ *  - groups are probed triangularly, a lookup stops at the first group
+ *    with an EMPTY slot. at most 7/8 of the slots are used.
+ *
+ * the table stores pointers to the list_head_t embedded in the entries,
+ * like the chained table did, the list itself is not used. the hash of
+ * each entry is kept too, so it is never recomputed on rehash.
+ *
+ * the table grows when it runs out of EMPTY slots and shrinks below 1/8
+ * of its max load, never under the size given to htable_create(). a
+ * resize is incremental like in redis: new entries go to the new slots
+ * while every add, find and delete moves HTABLE_REHASH_STEP groups of
+ * the old ones, lookups check both until the old slots are empty.
+ *
+ * HTABLE_DEFINE() generates typed wrappers with hash and cmp inlined
+ * into the probe loop, htable_find()/htable_add() call them through the
+ * pointers given to htable_create().
+ */
 
 typedef void *htable_key_t;
 
 typedef int(*htable_cmp_t) (htable_key_t, list_head_t *);
 typedef uint32_t (*htable_hash_t)(htable_key_t);
 
+#define HTABLE_GROUP        16
+#define HTABLE_MAX_SLOTS    (1U << 30)
+#define HTABLE_REHASH_STEP  2       // old groups moved per operation
+
+#define HTABLE_EMPTY        ((uint8_t)0x80)
+#define HTABLE_DELETED      ((uint8_t)0xfe)
+
+typedef struct htable_slots {
+    uint8_t         *ctrl;          // capacity control bytes, group aligned
+    list_head_t     **slots;
+    uint32_t        *hashes;
+
+    uint32_t        capacity;       // power of 2, >= HTABLE_GROUP, 0 if unused
+    uint32_t        group_mask;     // capacity / HTABLE_GROUP - 1
+    uint32_t        size;           // entries in use
+    uint32_t        growth_left;    // EMPTY slots that may still be filled
+} htable_slots_t;
+
+/* where the slots come from, aligned_alloc()/free() by default */
+typedef struct htable_mem {
+    void            *(*alloc)(void *arg, size_t len);
+    void            (*free)(void *arg, void *mem, size_t len);
+    void            *arg;
+} htable_mem_t;
+
 typedef struct htable {
-    int             size;
+    htable_slots_t  cur;
+    htable_slots_t  old;            // being moved to cur while capacity != 0
+    uint32_t        rehash_idx;     // next group of old to move
+    uint32_t        min_capacity;
+
     htable_cmp_t    cmp;
     htable_hash_t   hash;
-    list_head_t     bucket[0];
+    htable_mem_t    *mem;
 } htable_t;
 
 
-uint32_t htable_defaut_hash(htable_key_t key, size_t len);
+/* murmur2 of len bytes at key, for htable_hash_t callbacks of fixed size keys */
+uint32_t htable_default_hash(htable_key_t key, size_t len);
+
+/* room for at least size entries */
 htable_t *htable_create(int size, htable_cmp_t cmp, htable_hash_t hash);
 void htable_destroy(htable_t *ht);
 
+/* the same for a table embedded in another struct, mem may be NULL */
+int htable_init(htable_t *ht, int size, htable_cmp_t cmp, htable_hash_t hash,
+        htable_mem_t *mem);
+void htable_fini(htable_t *ht);
+
 list_head_t *htable_find(htable_t *ht, htable_key_t key);
-void htable_delete(htable_t *ht, htable_key_t key);
 
+/* 0 on success, -1 if the key is already in or growing the table failed */
+int htable_add(htable_t *ht, htable_key_t key, list_head_t *data);
+
+/* return the removed entry, NULL if the key is not in */
+list_head_t *htable_delete(htable_t *ht, htable_key_t key);
+
+static inline uint32_t htable_size(htable_t *ht)
+{
+    return ht->cur.size + ht->old.size;
+}
+
+static inline bool htable_rehashing(htable_t *ht)
+{
+    return ht->old.capacity != 0;
+}
+
+/* slow paths shared by the generic and the typed API */
+int __htable_insert(htable_t *ht, uint32_t hash, list_head_t *data);
+void __htable_erase(htable_t *ht, list_head_t **slot);
+void __htable_rehash_step(htable_t *ht);
+
+
+#define HTABLE_H1(hash)     ((hash) >> 7)
+#define HTABLE_H2(hash)     ((uint8_t)((hash) & 0x7f))
+
+static inline bool htable_ctrl_full(uint8_t c)
+{
+    return !(c & 0x80);
+}
+
+/* bit i is set if control byte i of the group equals c */
+static inline uint32_t __htable_match(const uint8_t *group, uint8_t c)
+{
+#if defined(__SSE2__)
+    __m128i g = _mm_load_si128((const __m128i *)group);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for(i = 0; i < HTABLE_GROUP; i++)
+        mask |= (uint32_t)(group[i] == c) << i;
+
+    return mask;
+#endif
+}
+
+/* bit i is set if control byte i is EMPTY or DELETED */
+static inline uint32_t __htable_match_free(const uint8_t *group)
+{
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for(i = 0; i < HTABLE_GROUP; i++)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+
+    return mask;
+#endif
+}
+
+/*
+ * the slot holding key, NULL if it is not in. always inlined so a
+ * constant cmp is inlined into the loop as well. a slot may be NULL
+ * under a matching control byte only to a chtable reader racing a
+ * writer, it is skipped.
+ */
+static inline __attribute__((always_inline)) list_head_t **__htable_probe(
+        htable_slots_t *s, uint32_t hash, htable_key_t key, htable_cmp_t cmp)
+{
+    uint32_t g = HTABLE_H1(hash) & s->group_mask, step = 0, mask;
+    uint8_t h2 = HTABLE_H2(hash);
+    const uint8_t *group;
+
+    for(;;) {
+        group = s->ctrl + g * HTABLE_GROUP;
+
+        mask = __htable_match(group, h2);
+        while(mask) {
+            uint32_t idx = g * HTABLE_GROUP + __builtin_ctz(mask);
+
+            if(likely(s->slots[idx] && cmp(key, s->slots[idx])))
+                return &s->slots[idx];
+            mask &= mask - 1;
+        }
+
+        if(likely(__htable_match(group, HTABLE_EMPTY)))
+            return NULL;
+
+        /* triangular probing visits every group once */
+        if(unlikely(++step > s->group_mask))
+            return NULL;
+        g = (g + step) & s->group_mask;
+    }
+}
+
+static inline __attribute__((always_inline)) list_head_t **__htable_lookup(
+        htable_t *ht, uint32_t hash, htable_key_t key, htable_cmp_t cmp)
+{
+    list_head_t **slot = __htable_probe(&ht->cur, hash, key, cmp);
+
+    if(!slot && unlikely(htable_rehashing(ht)))
+        slot = __htable_probe(&ht->old, hash, key, cmp);
+
+    return slot;
+}
+
+
+/*
+ * typed API: HTABLE_DEFINE(sess, uint64_t, sess_hash, sess_cmp) with
+ *
+ *  uint32_t sess_hash(const uint64_t *key);
+ *  int sess_cmp(const uint64_t *key, list_head_t *node);
+ *
+ * defines sess_create(), sess_find(), sess_add() and sess_delete(). a
+ * table made by sess_create() also works with the generic functions.
+ */
+#define HTABLE_DEFINE(name, key_type, hash_fn, cmp_fn)                          \
+static inline uint32_t name##_hash(htable_key_t key)                            \
+{                                                                               \
+    return hash_fn((const key_type *)key);                                      \
+}                                                                               \
+static inline int name##_cmp(htable_key_t key, list_head_t *node)               \
+{                                                                               \
+    return cmp_fn((const key_type *)key, node);                                 \
+}                                                                               \
+static inline htable_t *name##_create(int size)                                 \
+{                                                                               \
+    return htable_create(size, name##_cmp, name##_hash);                        \
+}                                                                               \
+static inline list_head_t *name##_find(htable_t *ht, const key_type *key)       \
+{                                                                               \
+    list_head_t **slot;                                                         \
+    if(unlikely(htable_rehashing(ht)))                                          \
+        __htable_rehash_step(ht);                                               \
+    slot = __htable_lookup(ht, hash_fn(key), (htable_key_t)key, name##_cmp);    \
+    return slot ? *slot : NULL;                                                 \
+}                                                                               \
+static inline int name##_add(htable_t *ht, const key_type *key,                 \
+        list_head_t *data)                                                      \
+{                                                                               \
+    uint32_t hash = hash_fn(key);                                               \
+    if(unlikely(htable_rehashing(ht)))                                          \
+        __htable_rehash_step(ht);                                               \
+    if(__htable_lookup(ht, hash, (htable_key_t)key, name##_cmp))                \
+        return -1;                                                              \
+    return __htable_insert(ht, hash, data);                                     \
+}                                                                               \
+static inline list_head_t *name##_delete(htable_t *ht, const key_type *key)     \
+{                                                                               \
+    list_head_t **slot, *node;                                                  \
+    if(unlikely(htable_rehashing(ht)))                                          \
+        __htable_rehash_step(ht);                                               \
+    slot = __htable_lookup(ht, hash_fn(key), (htable_key_t)key, name##_cmp);    \
+    if(!slot)                                                                   \
+        return NULL;                                                            \
+    node = *slot;                                                               \
+    __htable_erase(ht, slot);                                                   \
+    return node;                                                                \
+}
+
+
+/* slot i counting through old, then cur, NULL if it is not in use */
+static inline list_head_t *__htable_iter_slot(htable_t *ht, uint32_t i)
+{
+    htable_slots_t *s = &ht->old;
+
+    if(i >= s->capacity) {
+        i -= s->capacity;
+        s = &ht->cur;
+    }
+
+    return htable_ctrl_full(s->ctrl[i]) ? s->slots[i] : NULL;
+}
 
-#define for_each_htable_entry(t, pos, member)       \
-    for(int b = t->size - 1; b >= 0; b--)           \
-list_for_each_entry(pos, &t->bucket[b],member)
+/*
+ * a single loop over the slots of old and cur, break and continue work
+ * as in any loop. do not add or delete while iterating, both may move
+ * entries.
+ */
+#define for_each_htable_entry(t, pos, member)                               \
+    for(uint32_t __i = 0; __i < (t)->old.capacity + (t)->cur.capacity; __i++) \
+        if(__htable_iter_slot(t, __i) &&                                    \
+                ((pos) = list_entry(__htable_iter_slot(t, __i),             \
+                                    typeof(*(pos)), member), 1))
 
 #endif
@@ -0,0 +1,96 @@
+#ifndef LC_HISTOGRAM_H
+#define LC_HISTOGRAM_H
+
+#include "common.h"
+#include <time.h>
+
+/*
+ * log-linear histogram in the style of HdrHistogram: values below
+ * HIST_SUB_COUNT have a bucket each, above that every power of two is
+ * split into HIST_SUB_COUNT linear buckets, so a recorded value is off
+ * by less than 1 / HIST_SUB_COUNT (~3%). values are nsec, anything
+ * above HIST_MAX_VALUE goes to the last bucket.
+ *
+ * a histogram has a single writer, hist_snapshot() copies it from any
+ * other thread.
+ */
+#define HIST_SUB_BITS       5
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS       44      // ~4.9 hours in nsec
+#define HIST_MAX_VALUE      ((1ULL << HIST_MAX_BITS) - 1)
+#define HIST_BUCKETS        ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct hist {
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    max;
+    uint64_t    counts[HIST_BUCKETS];
+} hist_t;
+
+
+hist_t *hist_create(void);
+void hist_destroy(hist_t *h);
+void hist_reset(hist_t *h);
+
+void hist_snapshot(hist_t *dst, const hist_t *src);
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* the smallest recorded value v with p percent of all values <= v */
+uint64_t hist_percentile(const hist_t *h, double p);
+
+static inline unsigned int hist_bucket(uint64_t v)
+{
+    unsigned int msb;
+
+    if(v < HIST_SUB_COUNT)
+        return v;
+    if(unlikely(v > HIST_MAX_VALUE))
+        v = HIST_MAX_VALUE;
+
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+        ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+static inline void hist_record(hist_t *h, uint64_t v)
+{
+    h->counts[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if(v > h->max)
+        h->max = v;
+}
+
+
+/*
+ * timestamps for short intervals: the tsc on x86 if it is invariant,
+ * CLOCK_MONOTONIC otherwise. call hist_clock_init() once before use.
+ */
+extern uint64_t hist_tsc_mult;      // nsec per tick << 32, 0 if no tsc
+
+void hist_clock_init(void);
+
+static inline uint64_t hist_now(void)
+{
+    struct timespec ts;
+
+#if defined(__x86_64__)
+    if(likely(hist_tsc_mult))
+        return __builtin_ia32_rdtsc();
+#endif
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t hist_elapsed_ns(uint64_t start, uint64_t end)
+{
+#if defined(__x86_64__)
+    if(likely(hist_tsc_mult))
+        return ((unsigned __int128)(end - start) * hist_tsc_mult) >> 32;
+#endif
+
+    return end - start;
+}
+
+#endif
@@ -5,24 +5,191 @@
 #include "network.h"
 #include "pool.h"
 #include "event.h"
+#include "ring.h"
 
 #include <pthread.h>
 
 struct lcserver;
 struct lcs_worker;
+struct lcs_sending;
 
 
+/*
+ * slave selection of the master for connections whose accept callback
+ * did not pick a worker index. unused in reuseport mode.
+ */
+typedef enum lcs_dispatch {
+    LCS_DISPATCH_RR = 0,            // round robin
+    LCS_DISPATCH_LEAST_CONN,        // fewest active connections
+    LCS_DISPATCH_LEAST_LATENCY,     // lowest event loop lag, then fewest conns
+    LCS_DISPATCH_P2C,               // fewer active conns of two random slaves
+    LCS_DISPATCH_HASH,              // jump consistent hash of peer ip and port
+    LCS_DISPATCH_HASH_IP,           // same, peer ip only
+} lcs_dispatch_t;
+
+#define LCS_LOAD_SAMPLE_MS      10  // loop lag sampling period
+
+/* event types of the latency histograms */
+#define LCS_LAT_CONN            0   // connection reads and writes
+#define LCS_LAT_LISTEN          1   // accept batches
+#define LCS_LAT_WAKEUP          EV_LAT_POST // handoffs and handle sends
+#define LCS_LAT_TIMER           EV_LAT_TIMER
+
+/* nsec */
+typedef struct lcs_latency {
+    uint64_t    count;
+    uint64_t    p50;
+    uint64_t    p99;
+    uint64_t    p999;
+    uint64_t    max;
+} lcs_latency_t;
+
 typedef struct lcs_config {
     port_t      port;   // listen port
     char *      ip;     // IP to bind
     int         slave_num;
-    int         max_conns;
+    int         max_conns;  // open connections, more are refused
+
+    /*
+     * every slave opens its own SO_REUSEPORT listener and accepts in its
+     * own event loop, no master thread is started. a worker index chosen
+     * by the accept callback is ignored, connections stay on the worker
+     * which accepted them.
+     */
+    bool        reuseport;
+
+    /*
+     * lcs_conn_send() output queue watermarks in bytes, write_high is
+     * notified when the queue grows above out_high_wm, write_low when it
+     * drains back to out_low_wm. 0 picks the defaults below.
+     */
+    size_t      out_high_wm;
+    size_t      out_low_wm;
+
+    /*
+     * input buffers of the data callback, every slave owns in_buf_num
+     * buffers of in_buf_size bytes. a message never exceeds in_buf_size.
+     * 0 picks the defaults below. in completion mode (see backend) up to
+     * a quarter of them are lent to the kernel to receive into.
+     */
+    uint32_t    in_buf_size;
+    uint32_t    in_buf_num;
+
+    /*
+     * connections and input buffers are mapped in chunks as they are
+     * needed, max_conns and in_buf_num are only the limits. hugepages
+     * backs the chunks by 2MB pages, see POOL_F_HUGEPAGE.
+     */
+    bool        hugepages;
+
+    /*
+     * register connections with EPOLLET, only applies to the data
+     * callback. every wakeup reads until EAGAIN, bounded by the per
+     * connection budgets below. 0 picks the defaults.
+     */
+    bool        edge_triggered;
+    uint32_t    read_budget_bytes;
+    uint32_t    read_budget_iters;
+
+    /*
+     * poller of the event loops, EV_BACKEND_IO_URING falls back to
+     * epoll if the kernel cannot run it. sqpoll lets a kernel thread
+     * pick up io_uring submissions of the slaves.
+     *
+     * on linux 6.0 and later io_uring runs in completion mode: listeners
+     * use a multishot accept and, with a data callback, connections a
+     * multishot recv into input buffers of a provided buffer ring. what
+     * the socket does not take at once is sent from the output queue by
+     * linked sendmsg operations, once per loop round, instead of on
+     * EPOLLOUT. a read callback keeps readiness polling.
+     */
+    ev_backend_type_t backend;
+    bool        sqpoll;
+
+    /*
+     * listen() backlog, 0 picks SOMAXCONN. every readiness of a listener
+     * accepts up to accept_batch connections, 0 picks the default.
+     */
+    int         backlog;
+    uint32_t    accept_batch;
+
+    /*
+     * slaves keep polling without sleeping for up to busy_poll_us after
+     * their last event, see ev_set_busy_poll(), and set SO_BUSY_POLL to
+     * as long on their connections. napi_busy_poll also asks epoll to
+     * poll the NIC queues for as long, it is best effort and needs
+     * linux 6.9.
+     */
+    uint32_t    busy_poll_us;
+    bool        napi_busy_poll;
+
+    /*
+     * pin slave i to slave_cpus[i], a negative cpu leaves it unpinned.
+     * NULL pins no slave. the master is pinned to master_cpu only if
+     * pin_master is set. every worker allocates its event loop, buffers
+     * and connection cache itself after pinning, on its local node.
+     */
+    int         *slave_cpus;
+    bool        pin_master;
+    int         master_cpu;
+
+    /* how the master picks a slave, see lcs_dispatch_t */
+    lcs_dispatch_t dispatch;
+
+    /* time all callbacks of every worker, see lcserver_get_latency() */
+    bool        latency;
+
+    /*
+     * close a connection after idle_timeout_ms without any event or
+     * send, or after read_timeout_ms without being readable. 0 disables
+     * either. activity only stamps the connection with the loop time,
+     * its timer is re-armed when it fires, at most once per timeout.
+     */
+    uint32_t    idle_timeout_ms;
+    uint32_t    read_timeout_ms;
 } lcs_config_t;
 
+#define LCS_DEFAULT_OUT_HIGH_WM     (256 * 1024)
+#define LCS_DEFAULT_OUT_LOW_WM      (64 * 1024)
+#define LCS_DEFAULT_IN_BUF_SIZE     (16 * 1024)
+#define LCS_DEFAULT_IN_BUF_NUM      1024
+#define LCS_DEFAULT_READ_BUDGET_BYTES   (64 * 1024)
+#define LCS_DEFAULT_READ_BUDGET_ITERS   16
+#define LCS_DEFAULT_ACCEPT_BATCH    64
+
 
 typedef int lcs_worker_idx;
 
 
+/*
+ * framework owned, reference counted input buffer. buffers come from
+ * the worker's buf_pool and must be released in the same worker thread.
+ */
+typedef struct lcs_buf {
+    uint32_t        refcnt;
+    uint32_t        size;
+    struct lcs_worker *worker;
+    char            data[0];
+} lcs_buf_t;
+
+/* a view of len bytes inside buf */
+typedef struct lcs_slice {
+    lcs_buf_t       *buf;
+    char            *data;
+    size_t          len;
+} lcs_slice_t;
+
+
+/*
+ * a connection addressed from any thread: the index of the lcs_conn_t in
+ * conn_pool in the low 32 bits, its generation in the high ones. the
+ * generation changes every time the connection is closed, so a handle
+ * never refers to a later connection reusing the same lcs_conn_t.
+ */
+typedef uint64_t lcs_handle_t;
+
+#define LCS_HANDLE_INVALID      0
+
 typedef struct lcs_conn {
     ev_event_t      event;
     socket_t        s;
@@ -31,17 +198,146 @@ typedef struct lcs_conn {
     lcs_worker_idx  idx;
     struct lcs_worker *worker;
     void *          user_ptr;
+    uint32_t        gen;            // never 0 once allocated, see lcs_handle_t
+
+    /* pending output of lcs_conn_send(), flushed on EPOLLOUT */
+    list_head_t     out_queue;
+    size_t          out_bytes;
+    uint32_t        flags;
+
+    /* unconsumed input is in_buf->data[in_start, in_end) */
+    lcs_buf_t       *in_buf;
+    uint32_t        in_start;
+    uint32_t        in_end;
+
+    /* idle and read timeouts, loop msec of the last activity */
+    ev_timer_t      timer;
+    uint64_t        last_active_ms;
+    uint64_t        last_read_ms;
+
+    /* completion mode, event is only pended to flush out_queue */
+    ev_io_t         recv_io;
+    struct lcs_sending *sending;    // sends in flight, cached
+    list_head_t     starved;        // worker->starved, recv waits for buffers
 } lcs_conn_t;
 
+#define LCS_CONN_WRITE_HIGH     0x01    // out_bytes went above out_high_wm
+#define LCS_CONN_REGISTERED     0x02    // in its worker's loop, until closed
+
 
 typedef bool (*lcs_callback_t)(lcs_conn_t *conn);
+/* return the slave index for conn, runs in the master thread */
+typedef int (*lcs_dispatch_callback_t)(struct lcserver *server, lcs_conn_t *conn);
+typedef void (*lcs_notify_t)(lcs_conn_t *conn);
+
+/*
+ * the framework reads into the connection's input buffer and calls this
+ * with everything not consumed so far. the callback consumes complete
+ * messages with lcs_slice_consume(), the rest is presented again with
+ * more data appended. return false to close the connection.
+ */
+typedef bool (*lcs_data_callback_t)(lcs_conn_t *conn, lcs_slice_t *in);
+
+
+#define LCS_CONN_CHUNK          1024    // conn_pool objects mapped at a time
+#define LCS_BUF_CHUNK           64      // buf_pool objects mapped at a time
+
+#define LCS_CONN_CACHE_SIZE     64
+#define LCS_CONN_CACHE_BATCH    (LCS_CONN_CACHE_SIZE / 2)
+
+/* per-worker free connections, refilled/drained from conn_pool in batches */
+typedef struct lcs_conn_cache {
+    int             count;
+    lcs_conn_t      *conns[LCS_CONN_CACHE_SIZE];
+} lcs_conn_cache_t;
+
+/*
+ * every worker writes its own counters with plain increments, no
+ * atomics on the hot path. lcserver_get_stats() reads them while the
+ * workers run. all fields are uint64_t.
+ */
+typedef struct lcs_stats {
+    uint64_t        accepted;           // sockets returned by accept4
+    uint64_t        refused;            // by the accept callback or conn_pool
+    uint64_t        accept_wakeups;     // listener readiness callbacks
+    uint64_t        accept_batch_full;  // wakeups stopped by accept_batch
+    uint64_t        accept_batch_max;   // most accepted in one wakeup
+    uint64_t        accept_backoffs;    // listener paused, out of fds or memory
+    uint64_t        bytes_in;           // of the data callback path
+    uint64_t        bytes_out;          // of lcs_conn_send*()
+    uint64_t        reads;              // recv calls or completions of the data path
+    uint64_t        writes;             // send/sendmsg calls or submissions
+    uint64_t        conn_pool_empty;    // refused at max_conns
+    uint64_t        buf_pool_empty;     // input buffer allocations failed
+    uint64_t        ring_empty;         // recvs stopped, no buffer in the ring
+    uint64_t        conn_cache_refills; // times conn_pool was locked to allocate
+    uint64_t        conn_cache_drains;  // times conn_pool was locked to free
+    uint64_t        handle_sends;       // lcs_send_by_handle() payloads delivered
+    uint64_t        handle_stale;       // dropped, the connection was gone
+    uint64_t        idle_timeouts;      // closed by idle_timeout_ms
+    uint64_t        read_timeouts;      // closed by read_timeout_ms
+
+    /* filled in by the snapshot */
+    uint64_t        active_conns;
+    uint64_t        closed;
+    uint64_t        wakeups;            // event loop polls
+    uint64_t        events;             // ready events of the polls
+    uint64_t        callbacks;          // events, pended events and timers run
+    uint64_t        timers;
+    uint64_t        posts;              // handoffs and other posted tasks run
+    uint64_t        spin_ns;            // see ev_stats_t
+    uint64_t        work_ns;
+} lcs_stats_t;
 
 
 typedef struct lcs_worker {
     pthread_t       tid;
     int             worker_id;
+    int             cpu;        // pinned cpu or -1
+    bool            init_failed;
     struct lcserver *server;
     ev_context_t    *event_context;
+    lcs_conn_cache_t *conn_cache;
+    pool_t          *buf_pool;  // lcs_buf_t of in_buf_size
+
+    /* the master, or every slave in reuseport mode */
+    socket_t        listen_sock;
+    ev_event_t      listen_event;
+    ev_timer_t      accept_timer;   // resumes a listener paused out of fds
+    uint64_t        accept_log_ms;
+    ev_io_t         accept_io;      // completion mode, listen_event is pended
+    uint32_t        accept_round;   // accepted since listen_event ran
+
+    /*
+     * completion mode of the connections: ring_bufs[bid] is the input
+     * buffer lent to the kernel under bid. bids left without one when
+     * buf_pool was empty wait in empty_bids, connections whose recv
+     * found the ring empty in starved, both are retried by ring_timer.
+     * sendings of closed connections stay in orphans until their sends
+     * complete.
+     */
+    bool            completions;
+    uint32_t        nr_ring_bufs;
+    lcs_buf_t       **ring_bufs;
+    uint32_t        *empty_bids;
+    uint32_t        nr_empty_bids;
+    list_head_t     starved;
+    ev_timer_t      ring_timer;
+    list_head_t     orphans;
+
+    /* master only, connections not yet pushed to the slaves */
+    struct lcs_handoff *staged;
+
+    lcs_stats_t     stats __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    /*
+     * load counters, each with a single writer and read by the master
+     * without locks. active connections = nr_assigned - nr_closed.
+     */
+    _Atomic uint64_t nr_assigned __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t nr_closed __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint32_t loop_lag_us;   // moving average, LEAST_LATENCY only
+    ev_timer_t      load_timer;
 } lcs_worker_t;
 
 
@@ -49,22 +345,64 @@ typedef struct lcserver {
     int32_t         ip;
     port_t          port;
     int             slave_num;
-    socket_t        listen_sock;
+    bool            reuseport;
+    int             backlog;
+    uint32_t        accept_batch;
 
     lcs_worker_t    master;
     lcs_worker_t    *slave;
     int             next_slave;
+    lcs_dispatch_t  dispatch;
+    lcs_dispatch_callback_t dispatch_cb;    // overrides dispatch if set
+    uint64_t        dispatch_seed;          // P2C random state
 
     volatile int    stopped;
 
     /* call when new commection arrives */
     lcs_callback_t  accept;
+    /* optional, call in the owning worker's thread before the first read */
+    lcs_callback_t  setup;
     lcs_callback_t  read;
+    /* if set, the framework reads and read is not used */
+    lcs_data_callback_t data;
+    uint32_t        in_buf_size;
+    uint32_t        in_buf_num;
+
+    bool            edge_triggered;
+    int             conn_events;    // epoll events of connections
+    uint32_t        read_budget_bytes;
+    uint32_t        read_budget_iters;
+
+    /* optional, output queue state of lcs_conn_send() */
+    lcs_notify_t    drain;      // queue flushed out completely by the loop
+    lcs_notify_t    write_high;
+    lcs_notify_t    write_low;
+    size_t          out_high_wm;
+    size_t          out_low_wm;
+
+    /* optional, called before a timed out connection is closed */
+    lcs_notify_t    timeout;
+    uint32_t        idle_timeout_ms;
+    uint32_t        read_timeout_ms;
 
     int             max_conns;
 
     pool_t          *conn_pool;
     pthread_spinlock_t conn_pool_lock;
+
+    /* connections out of conn_pool and the magazines, up to max_conns */
+    _Atomic int     nr_conns __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    /* workers are released together once all of them are initialized */
+    lcs_config_t    cfg;
+    pthread_mutex_t start_lock;
+    pthread_cond_t  start_cond;
+    int             nr_ready;
+    bool            start_go;
+
+    /* /proc/net/netstat counters at lcserver_start() */
+    uint64_t        listen_overflows_base;
+    uint64_t        listen_drops_base;
 } lcserver_t;
 
 
@@ -72,12 +410,91 @@ lcserver_t *lcserver_create(lcs_config_t *cfg);
 
 void lcserver_destroy(lcserver_t *server);
 
+int lcserver_get_listen_drops(lcserver_t *server, uint64_t *overflows, uint64_t *drops);
+
+/* idx -1 is the master */
+void lcserver_get_worker_stats(lcserver_t *server, int idx, lcs_stats_t *stats);
+
+/* the sum of all workers, accept_batch_max is the maximum */
+void lcserver_get_stats(lcserver_t *server, lcs_stats_t *stats);
+
+/* callbacks of type LCS_LAT_* on worker idx (-1 is the master) */
+int lcserver_get_latency(lcserver_t *server, int idx, int type, lcs_latency_t *lat);
+
 void lcserver_register_accept(lcserver_t *server, lcs_callback_t accept);
 
+void lcserver_register_setup(lcserver_t *server, lcs_callback_t setup);
+
 void lcserver_register_read(lcserver_t *server, lcs_callback_t read);
 
+void lcserver_register_data(lcserver_t *server, lcs_data_callback_t data);
+
+void lcserver_register_drain(lcserver_t *server, lcs_notify_t drain);
+
+void lcserver_register_watermark(lcserver_t *server, lcs_notify_t write_high,
+        lcs_notify_t write_low);
+
+void lcserver_register_dispatch(lcserver_t *server, lcs_dispatch_callback_t dispatch);
+
+void lcserver_register_timeout(lcserver_t *server, lcs_notify_t timeout);
+
 int lcserver_start(lcserver_t *server);
 
 void lcserver_stop(lcserver_t *server);
 
+/* connections handed to w and not closed yet, callable from any thread */
+static inline uint64_t lcs_worker_active_conns(lcs_worker_t *w)
+{
+    uint64_t closed = atomic_load_explicit(&w->nr_closed, memory_order_relaxed);
+
+    return atomic_load_explicit(&w->nr_assigned, memory_order_relaxed) - closed;
+}
+
+static inline uint32_t lcs_worker_loop_lag(lcs_worker_t *w)
+{
+    return atomic_load_explicit(&w->loop_lag_us, memory_order_relaxed);
+}
+
+/*
+ * queue len bytes to the peer, only from the connection's own worker
+ * thread (i.e. inside its callbacks). never blocks: what the socket does
+ * not take at once is copied to the output queue and written when it
+ * turns writable.
+ * return 0 on success, -1 if the connection is broken.
+ */
+int lcs_conn_send(lcs_conn_t *conn, const void *data, size_t len);
+
+/* as lcs_conn_send(), the unsent part keeps a reference instead of a copy */
+int lcs_conn_send_slice(lcs_conn_t *conn, const lcs_slice_t *slice);
+
+/* valid from the setup callback on, until the connection is closed */
+lcs_handle_t lcs_conn_handle(lcs_conn_t *conn);
+
+/*
+ * the connection of handle h, NULL if it is closed. only in the thread of
+ * the worker owning it.
+ */
+lcs_conn_t *lcs_handle_conn(lcserver_t *server, lcs_handle_t h);
+
+/*
+ * send len bytes to connection h from any thread. the data is copied
+ * and handed to the connection's worker, which sends it with
+ * lcs_conn_send() unless the connection was closed meanwhile.
+ * return 0 if the data was queued, -1 if h is stale or the worker's
+ * post queue is full.
+ */
+int lcs_send_by_handle(lcserver_t *server, lcs_handle_t h, const void *data, size_t len);
+
+
+static inline void lcs_slice_consume(lcs_slice_t *s, size_t n)
+{
+    s->data += n;
+    s->len -= n;
+}
+
+/* out refers to [off, off + len) of s and keeps the buffer alive */
+void lcs_slice_retain(const lcs_slice_t *s, size_t off, size_t len, lcs_slice_t *out);
+
+void lcs_slice_release(lcs_slice_t *s);
+
 #endif
@@ -19,12 +19,21 @@ int set_sockopt_nodelay(socket_t fd);
 int set_sockopt_rcv_timeout(socket_t fd, int sec);
 int set_sockopt_snd_timeout(socket_t fd, int sec);
 int set_sockopt_keepalive(socket_t fd, int sec);
+int set_sockopt_busy_poll(socket_t fd, int usec);
 
 int sock_read(socket_t fd, void *buf, size_t bufsize, uint32_t retries);
 int sock_write(socket_t fd, struct msghdr *msg, size_t msgsize, uint32_t retries);
 
-socket_t sock_conect_to(ip_addr_t ip, port_t port, int sec);
-socket_t sock_create_listen(port_t port, ip_addr_t ip);
+socket_t sock_connect_to(ip_addr_t ip, port_t port, int sec);
+/* flags for sock_create_listen() */
+#define SOCK_LISTEN_REUSEPORT   0x01
+#define SOCK_LISTEN_NONBLOCK    0x02
+
+/* backlog <= 0 picks SOMAXCONN */
+socket_t sock_create_listen(port_t port, ip_addr_t ip, int backlog, int flags);
+
+/* system wide listen queue overflow counters since boot */
+int sock_listen_overflows(uint64_t *overflows, uint64_t *drops);
 
 
 #endif
@@ -2,34 +2,103 @@
 #define LC_POOL_H
 
 #include "common.h"
+#include "list.h"
 
 typedef uint32_t    pool_size_t;
 typedef uint32_t    pool_obj_size_t;
 
+/*
+ * objects live in chunks of 2^chunk_shift objects, mapped on demand up
+ * to num objects in total. every chunk keeps its own free list, chunks
+ * with free objects are on a partial list, allocations come from its
+ * head. see pool_create_ex() for the flags.
+ *
+ * with POOL_F_RELEASE the partial chunks are grouped by how full they
+ * are and allocations come from the fullest group, so the emptier
+ * chunks drain and can be unmapped. partial[0] holds the unused ones.
+ * other pools keep all of them on partial[0].
+ */
+#define POOL_F_HUGEPAGE     0x01    // 2MB pages, MAP_HUGETLB or THP
+#define POOL_F_RELEASE      0x02    // unmap chunks that become free
+
+#define POOL_HUGE_PAGE_SIZE (2UL << 20)
+#define POOL_SPARE_CHUNKS   1       // free chunks kept by POOL_F_RELEASE
+#define POOL_GROUPS         5       // unused, then 4 quarters of fullness
+
+#define POOL_IDX_NONE       ((pool_size_t)-1)
+
+typedef struct pool_chunk {
+    char                *mem;       // NULL while not mapped
+    size_t              len;        // mapped bytes
+    pool_size_t         nr_objs;
+    pool_size_t         free_idx;   // first free object, POOL_IDX_NONE if full
+    pool_size_t         nr_used;    // POOL_F_RELEASE only
+    list_head_t         list;       // on a partial list while it has free objects
+} pool_chunk_t;
+
 typedef struct pool {
     pool_obj_size_t     objsize;
     pool_obj_size_t     objmemsize;
 
-    pool_size_t         num;
-    pool_size_t         free_idx;
-    pool_size_t         *freeobj;   // pointer the first free obj
+    pool_size_t         num;        // most objects, indexes are in [0, num)
+    unsigned int        flags;
+
+    uint32_t            chunk_shift;
+    pool_size_t         nr_chunks;
+    pool_size_t         nr_mapped;
+    pool_size_t         nr_empty;   // unused mapped chunks, POOL_F_RELEASE only
+    pool_chunk_t        *chunks;
+    list_head_t         partial[POOL_GROUPS];
 
-    void *obj;
-    char buffer[0];
+    pool_size_t         *freeobj;   // next free object, per object index
 } pool_t;
 
 
 typedef struct pool_obj_head {
-    pool_t  *head;
+    pool_t          *head;
+    pool_size_t     idx;
 } pool_obj_head_t;
 
 /* APIs declare here*/
 
 pool_t *pool_create(pool_obj_size_t objsize, pool_size_t poolsize);
+pool_t *pool_create_ex(pool_obj_size_t objsize, pool_size_t poolsize,
+        pool_size_t chunk_objs, unsigned int flags);
 void pool_destroy(pool_t *p);
 
 void *pool_alloc_obj(pool_t *p);
 void pool_free_obj(pool_t *p, void *obj);
 
+pool_size_t pool_alloc_bulk(pool_t *p, void **objs, pool_size_t n);
+void pool_free_bulk(pool_t *p, void **objs, pool_size_t n);
+
+/*
+ * every object has a fixed index in [0, num) for the life of the pool,
+ * whether it is allocated or not. pool_index_obj() returns NULL for an
+ * index out of range or in a chunk not mapped. without POOL_F_RELEASE
+ * chunks are never unmapped, and pool_index_obj() may race with
+ * allocations in other threads.
+ */
+static inline pool_size_t pool_obj_index(pool_t *p, void *obj)
+{
+    UNUSED(p);
+    return ((pool_obj_head_t *)((char *)obj - sizeof(pool_obj_head_t)))->idx;
+}
+
+static inline void *pool_index_obj(pool_t *p, pool_size_t idx)
+{
+    char *mem;
+
+    if(unlikely(idx >= p->num))
+        return NULL;
+
+    mem = __atomic_load_n(&p->chunks[idx >> p->chunk_shift].mem, __ATOMIC_ACQUIRE);
+    if(unlikely(!mem))
+        return NULL;
+
+    return mem + (size_t)(idx & ((1U << p->chunk_shift) - 1)) * p->objmemsize +
+        sizeof(pool_obj_head_t);
+}
+
 
 #endif
@@ -3,80 +3,307 @@
 
 #include "common.h"
 #include <string.h>
+#include <stdatomic.h>
 
-/* lock-free single producer and single consumer queue */
+/*
+ * lock-free bounded queue, the same algorithm as the DPDK rte_ring:
+ *
+ *  - head/tail are free-running 32 bit indexes, masked on access, so all
+ *    `size` slots are usable.
+ *  - a producer first moves prod.head to reserve slots (CAS when there
+ *    may be several producers), copies the objects, then publishes them
+ *    by moving prod.tail with a release store. consumers do the same on
+ *    the cons side.
+ *  - producer and consumer indexes live on separate cache lines.
+ *
+ * RING_F_SP_ENQ/RING_F_SC_DEQ select SPSC, MPSC and MPMC rings. slots are
+ * `esize` bytes, the pointer API is a ring of esize == sizeof(void *),
+ * ring_create_elem() stores small messages inline instead.
+ *
+ * *_bulk() moves exactly n objects or none, *_burst() moves as many as
+ * possible. both return the number of objects moved.
+ */
+
+#define RING_F_SP_ENQ       0x01    // single producer
+#define RING_F_SC_DEQ       0x02    // single consumer
+
+#define RING_F_SPSC         (RING_F_SP_ENQ | RING_F_SC_DEQ)
+#define RING_F_MPSC         RING_F_SC_DEQ
+#define RING_F_MPMC         0
+
+struct ring_headtail {
+    _Atomic unsigned int    head;
+    _Atomic unsigned int    tail;
+    bool                    single;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
 typedef struct ring {
-    unsigned int        size;
-    unsigned int        mask;
-    volatile unsigned int   head;
-    volatile unsigned int   tail;
-    void *volatile ring[0];
+    unsigned int            size;
+    unsigned int            mask;
+    unsigned int            esize;
+    unsigned int            flags;
+
+    struct ring_headtail    prod;
+    struct ring_headtail    cons;
+
+    char ring[0] __attribute__((aligned(CACHE_LINE_SIZE)));
 } ring_t;
 
 
-static inline ring_t* ring_create(unsigned int count)
+static inline ring_t *ring_create_elem(unsigned int count, unsigned int esize,
+        unsigned int flags)
 {
     ring_t    *r;
     size_t    ring_size;
 
-    if(!POWEROF2(count))
+    if(!POWEROF2(count) || count == 0 || esize == 0)
         return NULL;
 
-    ring_size = count * sizeof(void *) + sizeof(struct ring);
+    ring_size = CACHE_LINE_ROUNDUP(sizeof(struct ring) + (size_t)count * esize);
 
-    r = malloc(ring_size);
+    r = aligned_alloc(CACHE_LINE_SIZE, ring_size);
     if(!r)
         return NULL;
     memset(r, 0, ring_size);
     r->size = count;
     r->mask = count - 1;
+    r->esize = esize;
+    r->flags = flags;
+    r->prod.single = !!(flags & RING_F_SP_ENQ);
+    r->cons.single = !!(flags & RING_F_SC_DEQ);
 
     return r;
 }
 
+static inline ring_t *ring_create(unsigned int count, unsigned int flags)
+{
+    return ring_create_elem(count, sizeof(void *), flags);
+}
+
 static inline void ring_destroy(ring_t *r)
 {
     free(r);
 }
 
 
+/*
+ * a snapshot, exact only if the ring is idle. cons.tail is loaded first
+ * so a consumer moving meanwhile cannot make the difference wrap, and
+ * both sides moving between the loads may at most overshoot size.
+ */
 static inline unsigned int ring_len(ring_t *r)
 {
-    if(r->tail <= r->head)
-        return (r->head - r->tail);
-    else
-        return (r->size - r->tail + r->head);
+    unsigned int cons = atomic_load_explicit(&r->cons.tail, memory_order_acquire);
+    unsigned int len = atomic_load_explicit(&r->prod.tail, memory_order_acquire) - cons;
+
+    return len > r->size ? r->size : len;
+}
+
+static inline unsigned int ring_free_count(ring_t *r)
+{
+    return r->size - ring_len(r);
 }
 
 static inline bool ring_full(ring_t *r)
 {
-    return ((r->head + 1) & r->mask) == r->tail;
+    return ring_len(r) == r->size;
 }
 
 static inline bool ring_empty(ring_t *r)
 {
-    return (r->head == r->tail);
+    return ring_len(r) == 0;
 }
 
-static inline void *ring_peek(ring_t *r)
+
+static inline void __ring_copy_in(ring_t *r, unsigned int head,
+        const void *objs, unsigned int n)
 {
-    if(unlikely(r->head == r->tail))
-        return NULL;
+    unsigned int idx = head & r->mask;
+    unsigned int first = r->size - idx;
+    size_t esize = r->esize;
+
+    if(first >= n) {
+        memcpy(r->ring + idx * esize, objs, n * esize);
+    } else {
+        memcpy(r->ring + idx * esize, objs, first * esize);
+        memcpy(r->ring, (const char *)objs + first * esize, (n - first) * esize);
+    }
+}
+
+static inline void __ring_copy_out(ring_t *r, unsigned int head,
+        void *objs, unsigned int n)
+{
+    unsigned int idx = head & r->mask;
+    unsigned int first = r->size - idx;
+    size_t esize = r->esize;
+
+    if(first >= n) {
+        memcpy(objs, r->ring + idx * esize, n * esize);
+    } else {
+        memcpy(objs, r->ring + idx * esize, first * esize);
+        memcpy((char *)objs + first * esize, r->ring, (n - first) * esize);
+    }
+}
+
+/* wait for the earlier reservations of other threads, then publish */
+static inline void __ring_update_tail(struct ring_headtail *ht,
+        unsigned int old_val, unsigned int new_val)
+{
+    if(!ht->single) {
+        while(atomic_load_explicit(&ht->tail, memory_order_relaxed) != old_val)
+            cpu_relax();
+    }
+
+    atomic_store_explicit(&ht->tail, new_val, memory_order_release);
+}
+
+/*
+ * reserve up to n slots by moving ht->head, bounded by the other side's
+ * tail. return the reserved number, 0 on failure.
+ */
+static inline unsigned int __ring_move_head(struct ring_headtail *ht,
+        _Atomic unsigned int *other_tail, unsigned int capacity,
+        unsigned int n, bool fixed, unsigned int *old_head)
+{
+    unsigned int avail, max = n;
+    unsigned int head = atomic_load_explicit(&ht->head, memory_order_relaxed);
+
+    do {
+        n = max;
+
+        /*
+         * head, loaded above or by a failed cas, must not be reordered
+         * after the tail load below. a newer head with an older tail
+         * makes avail underflow and overrun the ring.
+         */
+        atomic_thread_fence(memory_order_acquire);
+
+        /* capacity is r->size for producers and 0 for consumers */
+        avail = capacity + atomic_load_explicit(other_tail, memory_order_acquire) - head;
+        if(unlikely(n > avail))
+            n = fixed ? 0 : avail;
+        if(unlikely(n == 0))
+            return 0;
+
+        if(ht->single) {
+            atomic_store_explicit(&ht->head, head + n, memory_order_relaxed);
+            break;
+        }
+    } while(unlikely(!atomic_compare_exchange_weak_explicit(&ht->head, &head,
+                    head + n, memory_order_relaxed, memory_order_relaxed)));
+
+    *old_head = head;
+    return n;
+}
+
+static inline unsigned int __ring_do_enqueue(ring_t *r, const void *objs,
+        unsigned int n, bool fixed)
+{
+    unsigned int head;
+
+    n = __ring_move_head(&r->prod, &r->cons.tail, r->size, n, fixed, &head);
+    if(n == 0)
+        return 0;
+
+    __ring_copy_in(r, head, objs, n);
+    __ring_update_tail(&r->prod, head, head + n);
+
+    return n;
+}
+
+static inline unsigned int __ring_do_dequeue(ring_t *r, void *objs,
+        unsigned int n, bool fixed)
+{
+    unsigned int head;
+
+    n = __ring_move_head(&r->cons, &r->prod.tail, 0, n, fixed, &head);
+    if(n == 0)
+        return 0;
+
+    __ring_copy_out(r, head, objs, n);
+    __ring_update_tail(&r->cons, head, head + n);
 
-    return r->ring[r->tail];
+    return n;
+}
+
+
+/* inline elements, objs points to an array of n * esize bytes */
+
+static inline unsigned int ring_enqueue_elem_bulk(ring_t *r, const void *objs, unsigned int n)
+{
+    return __ring_do_enqueue(r, objs, n, true);
+}
+
+static inline unsigned int ring_enqueue_elem_burst(ring_t *r, const void *objs, unsigned int n)
+{
+    return __ring_do_enqueue(r, objs, n, false);
+}
+
+static inline unsigned int ring_dequeue_elem_bulk(ring_t *r, void *objs, unsigned int n)
+{
+    return __ring_do_dequeue(r, objs, n, true);
+}
+
+static inline unsigned int ring_dequeue_elem_burst(ring_t *r, void *objs, unsigned int n)
+{
+    return __ring_do_dequeue(r, objs, n, false);
+}
+
+static inline bool ring_enqueue_elem(ring_t *r, const void *obj)
+{
+    return __ring_do_enqueue(r, obj, 1, true) == 1;
+}
+
+static inline bool ring_dequeue_elem(ring_t *r, void *obj)
+{
+    return __ring_do_dequeue(r, obj, 1, true) == 1;
+}
+
+
+/* pointer rings */
+
+static inline unsigned int ring_enqueue_bulk(ring_t *r, void * const *objs, unsigned int n)
+{
+    return __ring_do_enqueue(r, objs, n, true);
+}
+
+static inline unsigned int ring_enqueue_burst(ring_t *r, void * const *objs, unsigned int n)
+{
+    return __ring_do_enqueue(r, objs, n, false);
+}
+
+static inline unsigned int ring_dequeue_bulk(ring_t *r, void **objs, unsigned int n)
+{
+    return __ring_do_dequeue(r, objs, n, true);
+}
+
+static inline unsigned int ring_dequeue_burst(ring_t *r, void **objs, unsigned int n)
+{
+    return __ring_do_dequeue(r, objs, n, false);
 }
 
 static inline bool ring_enqueue(ring_t *r, void *data)
 {
-    if(unlikely(((r->head + 1) & r->mask) == r->tail))
-        return false;
+    return __ring_do_enqueue(r, &data, 1, true) == 1;
+}
+
+static inline bool ring_dequeue(ring_t *r, void **data)
+{
+    return __ring_do_dequeue(r, data, 1, true) == 1;
+}
+
+/* single consumer only, the oldest object without removing it */
+static inline void *ring_peek(ring_t *r)
+{
+    void *data;
+
+    if(unlikely(ring_empty(r)))
+        return NULL;
 
-    r->ring[r->head] = data;
-    // stolen from kernel.
-    r->head = (r->head + 1) & r->mask;
+    __ring_copy_out(r, atomic_load_explicit(&r->cons.head, memory_order_relaxed),
+            &data, 1);
 
-    return true;
+    return data;
 }
 
 #endif
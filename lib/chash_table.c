@@ -0,0 +1,259 @@
+#include "chash_table.h"
+
+#include <string.h>
+#include <syslog.h>
+
+#define CHTABLE_BULK        16      // keys hashed and prefetched together
+#define CHTABLE_RETIRED     8
+
+
+static inline chtable_shard_t *shard_of(chtable_t *t, uint32_t hash)
+{
+    /* the low bits pick the slot inside the shard, mix before using the high ones */
+    if(t->shard_bits == 0)
+        return t->shards;
+
+    return &t->shards[(hash * 0x9e3779b9U) >> (32 - t->shard_bits)];
+}
+
+static inline uint32_t read_begin(chtable_shard_t *s)
+{
+    uint32_t seq;
+
+    while((seq = atomic_load_explicit(&s->seq, memory_order_acquire)) & 1)
+        cpu_relax();
+
+    return seq;
+}
+
+static inline bool read_retry(chtable_shard_t *s, uint32_t seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&s->seq, memory_order_relaxed) != seq;
+}
+
+static void write_lock(chtable_shard_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    atomic_store_explicit(&s->seq, s->seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_unlock(chtable_shard_t *s)
+{
+    atomic_store_explicit(&s->seq, s->seq + 1, memory_order_release);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * slot arrays go to the retired list instead of free(), see chash_table.h.
+ * the arrays handed out are zeroed: a reader probing a retired one while
+ * it is reused finds NULL slots or the entries it had, never garbage.
+ */
+static void *shard_alloc(void *arg, size_t len)
+{
+    chtable_shard_t *s = arg;
+    void *mem = NULL;
+    int i;
+
+    for(i = 0; i < s->nr_retired; i++) {
+        if(s->retired[i].len == len) {
+            mem = s->retired[i].mem;
+            s->retired[i] = s->retired[--s->nr_retired];
+            break;
+        }
+    }
+
+    if(!mem)
+        mem = aligned_alloc(CACHE_LINE_SIZE, len);
+    if(mem)
+        memset(mem, 0, len);
+
+    return mem;
+}
+
+static void shard_free(void *arg, void *mem, size_t len)
+{
+    chtable_shard_t *s = arg;
+    int max;
+    void *p;
+
+    if(s->nr_retired == s->max_retired) {
+        max = s->max_retired ? s->max_retired * 2 : CHTABLE_RETIRED;
+        p = realloc(s->retired, max * sizeof(s->retired[0]));
+        if(!p) {
+            syslog(LOG_ERR, "%s: no memory to retire %zu bytes, leaked", __func__, len);
+            return;
+        }
+        s->retired = p;
+        s->max_retired = max;
+    }
+
+    s->retired[s->nr_retired].mem = mem;
+    s->retired[s->nr_retired].len = len;
+    s->nr_retired++;
+}
+
+static list_head_t *shard_find(chtable_shard_t *s, uint32_t hash, htable_key_t key)
+{
+    htable_slots_t cur, old;
+    list_head_t **slot, *node;
+    uint32_t seq;
+
+    for(;;) {
+        seq = read_begin(s);
+        cur = s->ht.cur;
+        old = s->ht.old;
+
+        /* a torn copy could point past the end of its arrays */
+        if(read_retry(s, seq))
+            continue;
+
+        slot = __htable_probe(&cur, hash, key, s->ht.cmp);
+        if(!slot && old.capacity)
+            slot = __htable_probe(&old, hash, key, s->ht.cmp);
+        node = slot ? *slot : NULL;
+
+        if(!read_retry(s, seq))
+            return node;
+    }
+}
+
+
+static void destroy_shards(chtable_t *t, int n)
+{
+    chtable_shard_t *s;
+    int i, j;
+
+    for(i = 0; i < n; i++) {
+        s = &t->shards[i];
+
+        /* the last two arrays land in retired as well */
+        htable_fini(&s->ht);
+        for(j = 0; j < s->nr_retired; j++)
+            free(s->retired[j].mem);
+        free(s->retired);
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    free(t->shards);
+}
+
+chtable_t *chtable_create(int shards, int size, htable_cmp_t cmp, htable_hash_t hash)
+{
+    chtable_t *t;
+    chtable_shard_t *s;
+    int i, n;
+
+    t = calloc(1, sizeof(chtable_t));
+    if(!t)
+        return NULL;
+
+    while((1 << t->shard_bits) < shards && t->shard_bits < 16)
+        t->shard_bits++;
+    n = 1 << t->shard_bits;
+
+    t->hash = hash;
+    t->shards = aligned_alloc(CACHE_LINE_SIZE, n * sizeof(chtable_shard_t));
+    if(!t->shards) {
+        free(t);
+        return NULL;
+    }
+    memset(t->shards, 0, n * sizeof(chtable_shard_t));
+
+    for(i = 0; i < n; i++) {
+        s = &t->shards[i];
+        s->mem.alloc = shard_alloc;
+        s->mem.free = shard_free;
+        s->mem.arg = s;
+
+        if(htable_init(&s->ht, DIV_ROUND_UP(size, n), cmp, hash, &s->mem) != 0) {
+            destroy_shards(t, i);
+            free(t);
+            return NULL;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+    }
+
+    return t;
+}
+
+void chtable_destroy(chtable_t *t)
+{
+    destroy_shards(t, 1 << t->shard_bits);
+    free(t);
+}
+
+list_head_t *chtable_find(chtable_t *t, htable_key_t key)
+{
+    uint32_t hash = t->hash(key);
+
+    return shard_find(shard_of(t, hash), hash, key);
+}
+
+int chtable_find_bulk(chtable_t *t, htable_key_t *keys, int n, list_head_t **nodes)
+{
+    uint32_t hashes[CHTABLE_BULK], g;
+    chtable_shard_t *s;
+    int i, j, batch, hits = 0;
+
+    for(i = 0; i < n; i += batch) {
+        batch = n - i < CHTABLE_BULK ? n - i : CHTABLE_BULK;
+
+        /*
+         * hash the whole batch and prefetch the first group of each key,
+         * the cache misses then overlap instead of coming one by one.
+         * the racy reads are harmless, a prefetch never faults.
+         */
+        for(j = 0; j < batch; j++) {
+            hashes[j] = t->hash(keys[i + j]);
+            s = shard_of(t, hashes[j]);
+            g = HTABLE_H1(hashes[j]) & s->ht.cur.group_mask;
+            __builtin_prefetch(s->ht.cur.ctrl + g * HTABLE_GROUP);
+            __builtin_prefetch(s->ht.cur.slots + g * HTABLE_GROUP);
+        }
+
+        for(j = 0; j < batch; j++) {
+            nodes[i + j] = shard_find(shard_of(t, hashes[j]), hashes[j], keys[i + j]);
+            hits += nodes[i + j] != NULL;
+        }
+    }
+
+    return hits;
+}
+
+int chtable_add(chtable_t *t, htable_key_t key, list_head_t *data)
+{
+    chtable_shard_t *s = shard_of(t, t->hash(key));
+    int ret;
+
+    write_lock(s);
+    ret = htable_add(&s->ht, key, data);
+    write_unlock(s);
+
+    return ret;
+}
+
+list_head_t *chtable_delete(chtable_t *t, htable_key_t key)
+{
+    chtable_shard_t *s = shard_of(t, t->hash(key));
+    list_head_t *node;
+
+    write_lock(s);
+    node = htable_delete(&s->ht, key);
+    write_unlock(s);
+
+    return node;
+}
+
+/* a sum of per shard sizes read without the locks, exact only when idle */
+uint32_t chtable_size(chtable_t *t)
+{
+    uint32_t size = 0;
+    int i;
+
+    for(i = 0; i < 1 << t->shard_bits; i++)
+        size += htable_size(&t->shards[i].ht);
+
+    return size;
+}
@@ -1,12 +1,31 @@
 #include "event.h"
+#include "event_backend.h"
 
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
 
 #define DEFAULT_EPOLL_TIMEOUT   1000    /* 1 sec */
 
+/* the spin window never shrinks below busy_poll_max_ns / 16 */
+#define BUSY_POLL_MIN_SHIFT     4
+
+/* linux 6.9, not in older uapi headers */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS    _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
 static inline uint64_t get_current_msec()
 {
     struct timespec     ts;
@@ -16,36 +35,308 @@ static inline uint64_t get_current_msec()
     return ts.tv_sec * 1000 + ts.tv_nsec / 1000 / 1000;
 }
 
-static inline int64_t run_timers(list_head_t *timer_list)
+static void wheel_init(ev_timer_wheel_t *w, uint64_t now)
+{
+    int i, j;
+
+    w->clock = now;
+    w->count = 0;
+    memset(w->tv1_map, 0, sizeof(w->tv1_map));
+
+    for(i = 0; i < EV_TVR_SIZE; i++)
+        INIT_LIST_HEAD(&w->tv1[i]);
+
+    for(i = 0; i < EV_TVN_LEVELS; i++)
+        for(j = 0; j < EV_TVN_SIZE; j++)
+            INIT_LIST_HEAD(&w->tvn[i][j]);
+}
+
+static inline int tvn_index(uint64_t ticks, int level)
 {
-    ev_timer_t  *timer;
-    int64_t timeout = DEFAULT_EPOLL_TIMEOUT;
+    return (ticks >> (EV_TVR_BITS + level * EV_TVN_BITS)) & EV_TVN_MASK;
+}
 
-    while(!list_empty(timer_list) &&
-            (timer = list_first_entry(timer_list, ev_timer_t, list)))  {
-        timeout = timer->abs_msec - get_current_msec();
+/* O(1): pick the slot by the distance between expiry and wheel clock */
+static void wheel_add(ev_timer_wheel_t *w, ev_timer_t *timer)
+{
+    uint64_t expires = timer->abs_msec / EV_TIMER_RESOLUTION;
+    uint64_t idx;
+    list_head_t *slot;
+    int level, i;
+
+    if((int64_t)(expires - w->clock) < 0) {
+        /* already expired, run at the next tick */
+        expires = w->clock;
+    } else if(expires - w->clock > EV_TIMER_MAX_TICKS) {
+        expires = w->clock + EV_TIMER_MAX_TICKS;
+    }
 
-        if(timeout <= 0) {
-            timer->callback(timer);
-            list_del(&timer->list);
-            timeout = DEFAULT_EPOLL_TIMEOUT;
+    idx = expires - w->clock;
+    if(idx < EV_TVR_SIZE) {
+        i = expires & EV_TVR_MASK;
+        slot = &w->tv1[i];
+        w->tv1_map[i >> 6] |= 1ULL << (i & 63);
+    } else {
+        for(level = 0; level < EV_TVN_LEVELS - 1; level++) {
+            if(idx < 1ULL << (EV_TVR_BITS + (level + 1) * EV_TVN_BITS))
+                break;
         }
-        else
-            break;
+        slot = &w->tvn[level][tvn_index(expires, level)];
     }
 
-    return timeout > DEFAULT_EPOLL_TIMEOUT ? DEFAULT_EPOLL_TIMEOUT : timeout;
+    list_add_tail(&timer->list, slot);
+    w->count++;
 }
 
+/* move all timers of one upper slot down to the levels below */
+static int wheel_cascade(ev_timer_wheel_t *w, int level, int index)
+{
+    ev_timer_t *timer, *n;
+    LIST_HEAD(work);
+
+    list_splice_init(&w->tvn[level][index], &work);
+    list_for_each_entry_safe(timer, n, &work, list) {
+        w->count--;
+        wheel_add(w, timer);
+    }
 
-void ev_destroy_context(ev_context_t *c)
+    return index;
+}
+
+/*
+ * next non-empty tv1 slot in [from, EV_TVR_SIZE), clears the stale bits
+ * left by cancelled timers on the way. return EV_TVR_SIZE if none.
+ */
+static int wheel_next_slot(ev_timer_wheel_t *w, int from)
+{
+    int word = from >> 6;
+    uint64_t bits;
+    int i;
+
+    bits = w->tv1_map[word] & (~0ULL << (from & 63));
+    for(;;) {
+        while(bits) {
+            i = (word << 6) + __builtin_ctzll(bits);
+            if(!list_empty(&w->tv1[i]))
+                return i;
+
+            w->tv1_map[word] &= ~(1ULL << (i & 63));
+            bits &= bits - 1;
+        }
+
+        if(++word == EV_TVR_SIZE / 64)
+            return EV_TVR_SIZE;
+        bits = w->tv1_map[word];
+    }
+}
+
+static inline void run_timer_callback(ev_context_t *c, ev_timer_t *timer)
+{
+    uint64_t start;
+
+    if(likely(!c->latency_on)) {
+        timer->callback(timer);
+        return;
+    }
+
+    start = hist_now();
+    timer->callback(timer);
+    hist_record(c->latency[EV_LAT_TIMER], hist_elapsed_ns(start, hist_now()));
+}
+
+/*
+ * expire all timers up to now. every expired slot is spliced out as a
+ * whole and run as one batch, callbacks may start or cancel any timer.
+ * return the epoll timeout until the next timer.
+ */
+static int64_t run_timers(ev_context_t *c)
+{
+    ev_timer_wheel_t *w = &c->timers;
+    uint64_t now = get_current_msec() / EV_TIMER_RESOLUTION;
+    ev_timer_t *timer;
+    int index, next, level;
+    LIST_HEAD(work);
+
+    c->loop_msec = now * EV_TIMER_RESOLUTION;
+
+    if(w->count == 0) {
+        w->clock = now + 1;
+        return DEFAULT_EPOLL_TIMEOUT;
+    }
+
+    while((int64_t)(now - w->clock) >= 0) {
+        index = w->clock & EV_TVR_MASK;
+
+        if(index == 0) {
+            for(level = 0; level < EV_TVN_LEVELS; level++) {
+                if(wheel_cascade(w, level, tvn_index(w->clock, level)) != 0)
+                    break;
+            }
+        }
+
+        /* jump over empty slots, never across a cascade boundary */
+        next = wheel_next_slot(w, index);
+        if(next != index) {
+            if((int64_t)(now - (w->clock - index + next)) < 0) {
+                w->clock = now + 1;
+                break;
+            }
+            w->clock += next - index;
+            if(next == EV_TVR_SIZE)
+                continue;
+            index = next;
+        }
+
+        w->clock++;
+        w->tv1_map[index >> 6] &= ~(1ULL << (index & 63));
+        list_splice_init(&w->tv1[index], &work);
+
+        while(!list_empty(&work)) {
+            timer = list_first_entry(&work, ev_timer_t, list);
+            list_del_init(&timer->list);
+            w->count--;
+            c->stats.timers++;
+            run_timer_callback(c, timer);
+        }
+    }
+
+    if(w->count == 0)
+        return DEFAULT_EPOLL_TIMEOUT;
+
+    /* the upper levels are not cascaded yet, wake up at the next tick */
+    index = w->clock & EV_TVR_MASK;
+    if(index == 0)
+        return EV_TIMER_RESOLUTION;
+
+    /* w->clock is now + 1, the slot of tick t fires after t - now msec */
+    next = wheel_next_slot(w, index);
+    return (next - index + 1) * EV_TIMER_RESOLUTION > DEFAULT_EPOLL_TIMEOUT ?
+        DEFAULT_EPOLL_TIMEOUT : (next - index + 1) * EV_TIMER_RESOLUTION;
+}
+
+
+/* epoll backend */
+
+static int epoll_backend_init(ev_context_t *c, unsigned int flags)
+{
+    UNUSED(flags);
+
+    c->efd = epoll_create(c->max_events);
+    return c->efd == -1 ? -1 : 0;
+}
+
+static void epoll_backend_destroy(ev_context_t *c)
 {
     close(c->efd);
+}
+
+static int epoll_backend_ctl(ev_context_t *c, int op, ev_event_t *event)
+{
+    struct epoll_event ev;
+
+    ev.data.ptr = (void *)event;
+    ev.events = event->events;
+
+    return epoll_ctl(c->efd, op, event->fd, &ev);
+}
+
+static int epoll_backend_add(ev_context_t *c, ev_event_t *event)
+{
+    return epoll_backend_ctl(c, EPOLL_CTL_ADD, event);
+}
+
+static int epoll_backend_mod(ev_context_t *c, ev_event_t *event)
+{
+    return epoll_backend_ctl(c, EPOLL_CTL_MOD, event);
+}
+
+static void epoll_backend_del(ev_context_t *c, ev_event_t *event)
+{
+    epoll_ctl(c->efd, EPOLL_CTL_DEL, event->fd, NULL);
+}
+
+static int epoll_backend_poll(ev_context_t *c, int timeout)
+{
+    int nfds;
+    struct epoll_event *ev;
+    ev_event_t *event;
+    int i;
+
+    nfds = epoll_wait(c->efd, c->events, c->max_events, timeout);
+    ev_backend_woken(c);
+    if(nfds == -1)
+        return errno == EINTR ? 0 : -1;
+
+    c->stats.events += nfds;
+    for(i = 0; i < nfds; i++) {
+        ev = &c->events[i];
+        event = (ev_event_t *)(ev->data.ptr);
+        event->revents = ev->events;
+        ev_run_callback(c, event);
+    }
+
+    return nfds;
+}
+
+const ev_backend_t ev_epoll_backend = {
+    .type       = EV_BACKEND_EPOLL,
+    .name       = "epoll",
+    .init       = epoll_backend_init,
+    .destroy    = epoll_backend_destroy,
+    .add        = epoll_backend_add,
+    .mod        = epoll_backend_mod,
+    .del        = epoll_backend_del,
+    .poll       = epoll_backend_poll,
+};
+
+
+static void post_callback(ev_event_t *event);
+
+static int post_init(ev_context_t *c)
+{
+    c->posts = ring_create_elem(EV_POST_RING_SIZE, sizeof(ev_post_t), RING_F_MPSC);
+    if(!c->posts)
+        return -1;
+
+    c->post_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(c->post_fd == -1)
+        return -1;
+
+    c->post_event.fd = c->post_fd;
+    c->post_event.events = EV_READ_EVENT;
+    c->post_event.callback = post_callback;
+    c->post_event.lat_type = EV_LAT_POST;
+
+    return ev_register_event(c, &c->post_event);
+}
+
+static void post_destroy(ev_context_t *c)
+{
+    if(c->post_fd != -1)
+        close(c->post_fd);
+    if(c->posts)
+        ring_destroy(c->posts);
+}
+
+/* tasks still queued are dropped, see ev_take_posts() */
+void ev_destroy_context(ev_context_t *c)
+{
+    int i;
+
+    c->backend->destroy(c);
+    post_destroy(c);
+    for(i = 0; i < EV_LAT_TYPES; i++)
+        hist_destroy(c->latency[i]);
     free(c);
 }
 
 
-ev_context_t *ev_create_context(int max_events)
+/*
+ * create a context polled by the backend of type, io_uring falls back
+ * to epoll at runtime if the kernel cannot run it.
+ */
+ev_context_t *ev_create_context_ex(int max_events, ev_backend_type_t type,
+        unsigned int flags)
 {
     size_t size;
     ev_context_t *c;
@@ -58,42 +349,214 @@ ev_context_t *ev_create_context(int max_events)
         return NULL;
     c->max_events = max_events;
     c->stopped = 0;
-    INIT_LIST_HEAD(&c->timer_list);
+    c->efd = -1;
+    c->post_fd = -1;
+    c->loop_msec = get_current_msec();
+    wheel_init(&c->timers, c->loop_msec / EV_TIMER_RESOLUTION);
+    INIT_LIST_HEAD(&c->pending);
+
+    if(type == EV_BACKEND_IO_URING) {
+        c->backend = &ev_uring_backend;
+        if(c->backend->init(c, flags) == 0)
+            goto backend_ready;
+
+        syslog(LOG_WARNING, "io_uring unavailable (%d), fall back to epoll", errno);
+    }
 
-    c->efd = epoll_create(max_events);
-    if(c->efd == -1) {
+    c->backend = &ev_epoll_backend;
+    if(c->backend->init(c, flags) != 0) {
         free(c);
         return NULL;
     }
 
+backend_ready:
+    if(post_init(c) != 0) {
+        ev_destroy_context(c);
+        return NULL;
+    }
+
     return c;
 }
 
+ev_context_t *ev_create_context(int max_events)
+{
+    return ev_create_context_ex(max_events, EV_BACKEND_EPOLL, 0);
+}
 
-int ev_run(ev_context_t *c)
+/* a copy readable from any thread while the loop runs */
+void ev_get_stats(ev_context_t *c, ev_stats_t *stats)
 {
-    int nfds;
-    int64_t timeout;
-    struct epoll_event *ev;
-    ev_event_t *event;
-    int i;
+    const uint64_t *src = (const uint64_t *)&c->stats;
+    uint64_t *dst = (uint64_t *)stats;
+    size_t i;
 
-    while(!c->stopped) {
-        timeout = run_timers(&c->timer_list);
+    for(i = 0; i < sizeof(ev_stats_t) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
 
-        nfds = epoll_wait(c->efd, c->events, c->max_events, timeout);
-        if(nfds == -1) {
-            if(errno == EINTR)
-                continue;
+/*
+ * keep polling without sleeping for up to usecs after the last event,
+ * 0 turns busy polling off. call it before ev_run() or from the loop's
+ * own thread.
+ */
+void ev_set_busy_poll(ev_context_t *c, uint32_t usecs)
+{
+    c->busy_poll_max_ns = (uint64_t)usecs * 1000;
+    c->busy_poll_ns = c->busy_poll_max_ns;
+    c->last_active_ns = 0;
+}
+
+/*
+ * let epoll_wait() itself poll the NIC queues of the registered sockets
+ * (epoll busy poll, linux 6.9). usecs above net.core.busy_poll needs
+ * CAP_NET_ADMIN. only the epoll backend supports it.
+ */
+int ev_set_napi_busy_poll(ev_context_t *c, uint32_t usecs, uint16_t budget,
+        bool prefer)
+{
+    struct epoll_params params;
+
+    if(c->backend->type != EV_BACKEND_EPOLL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = usecs;
+    params.busy_poll_budget = budget;
+    params.prefer_busy_poll = prefer;
+
+    return ioctl(c->efd, EPIOCSPARAMS, &params);
+}
+
+/*
+ * time every event and timer callback into per type histograms, costs
+ * two clock reads per callback. call it before ev_run() or from the
+ * loop's own thread.
+ */
+int ev_enable_latency(ev_context_t *c)
+{
+    int i;
+
+    hist_clock_init();
 
+    for(i = 0; i < EV_LAT_TYPES; i++) {
+        if(c->latency[i])
+            continue;
+        c->latency[i] = hist_create();
+        if(!c->latency[i])
             return -1;
+    }
+
+    c->latency_on = true;
+    return 0;
+}
+
+/* copy the histogram of type, from any thread */
+int ev_get_latency(ev_context_t *c, int type, hist_t *hist)
+{
+    if(!c->latency_on || type < 0 || type >= EV_LAT_TYPES)
+        return -1;
+
+    hist_snapshot(hist, c->latency[type]);
+    return 0;
+}
+
+ev_backend_type_t ev_backend_type(ev_context_t *c)
+{
+    return c->backend->type;
+}
+
+
+/*
+ * run the events pended in the last round once, events pended again by
+ * their callbacks wait for the next round, after other ready events.
+ */
+static void run_pending(ev_context_t *c)
+{
+    ev_event_t *event;
+    LIST_HEAD(work);
+
+    list_splice_init(&c->pending, &work);
+    while(!list_empty(&work)) {
+        event = list_first_entry(&work, ev_event_t, pending);
+        list_del_init(&event->pending);
+        event->revents = event->pending_revents;
+        c->stats.pending++;
+        ev_run_callback(c, event);
+    }
+}
+
+/*
+ * spin with zero timeouts for busy_poll_ns after the last round which
+ * found events, then block again. a spin that finds events doubles the
+ * window up to busy_poll_max_ns, a window that runs out empty halves it,
+ * so sparse traffic stops burning the cpu.
+ */
+static int busy_poll_round(ev_context_t *c, int64_t timeout)
+{
+    uint64_t start, end;
+    bool spinning;
+    int n;
+
+    start = ev_now_ns();
+    spinning = start - c->last_active_ns < c->busy_poll_ns;
+    if(spinning)
+        timeout = 0;
+
+    c->wake_ns = start;
+    c->stats.polls++;
+    n = c->backend->poll(c, timeout);
+    if(n == -1)
+        return -1;
+
+    if(n == 0 && list_empty(&c->pending)) {
+        end = ev_now_ns();
+        if(spinning) {
+            c->stats.spin_ns += end - start;
+            c->stats.spins++;
+            if(end - c->last_active_ns >= c->busy_poll_ns &&
+                    c->busy_poll_ns > c->busy_poll_max_ns >> BUSY_POLL_MIN_SHIFT)
+                c->busy_poll_ns >>= 1;
         }
+        return 0;
+    }
 
-        for(i = 0; i < nfds; i++) {
-            ev = &c->events[i];
-            event = (ev_event_t *)(ev->data.ptr);
-            event->callback(event);
+    run_pending(c);
+    end = ev_now_ns();
+    c->stats.work_ns += end - c->wake_ns;
+    c->last_active_ns = end;
+
+    if(spinning) {
+        c->stats.spin_hits++;
+        c->busy_poll_ns <<= 1;
+        if(c->busy_poll_ns > c->busy_poll_max_ns)
+            c->busy_poll_ns = c->busy_poll_max_ns;
+    }
+
+    return 0;
+}
+
+int ev_run(ev_context_t *c)
+{
+    int64_t timeout;
+
+    while(!c->stopped) {
+        timeout = run_timers(c);
+        if(!list_empty(&c->pending))
+            timeout = 0;
+
+        if(c->busy_poll_max_ns) {
+            if(busy_poll_round(c, timeout) == -1)
+                return -1;
+            continue;
         }
+
+        c->stats.polls++;
+        if(c->backend->poll(c, timeout) == -1)
+            return -1;
+
+        run_pending(c);
     }
 
     return 0;
@@ -101,17 +564,233 @@ int ev_run(ev_context_t *c)
 
 int ev_register_event(ev_context_t *c, ev_event_t *event)
 {
-    struct epoll_event ev;
+    INIT_LIST_HEAD(&event->pending);
 
-    ev.data.ptr = (void *)event;
-    ev.events = event->events;
+    return c->backend->add(c, event);
+}
 
-    return epoll_ctl(c->efd, EPOLL_CTL_ADD, event->fd, &ev);
+/* apply a change of event->events to a registered event */
+int ev_modify_event(ev_context_t *c, ev_event_t *event)
+{
+    return c->backend->mod(c, event);
 }
 
 void ev_unregister_event(ev_context_t *c, ev_event_t *event)
 {
-    epoll_ctl(c->efd, EPOLL_CTL_DEL, event->fd, NULL);
+    ev_unpend_event(c, event);
+    c->backend->del(c, event);
+}
+
+/*
+ * run the callback of a registered event in the next loop round without
+ * waiting for the kernel, e.g. for an edge triggered socket that still
+ * has data after its read budget ran out. pending events make the poll
+ * return at once.
+ *
+ * the event may also never be registered, to run deferred work right
+ * after the ready events of a round. its pending list must be
+ * initialized then, and ev_unpend_event() takes it back.
+ */
+void ev_pend_event(ev_context_t *c, ev_event_t *event, int revents)
+{
+    event->pending_revents |= revents;
+    if(list_empty(&event->pending)) {
+        event->pending_revents = revents;
+        list_add_tail(&event->pending, &c->pending);
+    }
+}
+
+void ev_unpend_event(ev_context_t *c, ev_event_t *event)
+{
+    UNUSED(c);
+    list_del_init(&event->pending);
+}
+
+
+/*
+ * completion based i/o of the io_uring backend. an ev_io_t takes a
+ * backend slot with its first operation and keeps it until
+ * ev_io_cancel(), completions of a cancelled ev_io_t are dropped.
+ */
+bool ev_has_completions(ev_context_t *c)
+{
+    return c->completions;
+}
+
+/*
+ * set up a ring of entries (a power of 2) buffer ids [0, entries) that
+ * ev_io_recv() picks from. no buffer is in it until ev_io_provide().
+ */
+int ev_io_buffers(ev_context_t *c, unsigned int entries)
+{
+    if(!c->completions) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return c->backend->io_buffers(c, entries);
+}
+
+/*
+ * put a buffer into the ring under bid. a completion that carries a
+ * buffer (io->bid >= 0) takes it out of the ring until it is provided
+ * again, with the same or another addr.
+ */
+void ev_io_provide(ev_context_t *c, int bid, void *addr, uint32_t len)
+{
+    c->backend->io_provide(c, bid, addr, len);
+}
+
+/* multishot accept on the listener io->fd, io->res is the new socket */
+int ev_io_accept(ev_context_t *c, ev_io_t *io)
+{
+    if(!c->completions) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return c->backend->io_accept(c, io);
+}
+
+/*
+ * multishot recv on io->fd into buffers of the ring. io->res is the
+ * length, 0 at eof, -ENOBUFS if the ring ran empty. without io->more
+ * the operation ended and must be started again.
+ */
+int ev_io_recv(ev_context_t *c, ev_io_t *io)
+{
+    if(!c->completions) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return c->backend->io_recv(c, io);
+}
+
+/*
+ * send n messages on io->fd in order, linked: each one is sent in full
+ * or fails, and a failure fails the rest with -ECANCELED. one completion
+ * per message. msgs, their iovecs and data must stay untouched until
+ * the last completion, which ev_io_cancel() does not wait for.
+ */
+int ev_io_sendmsg(ev_context_t *c, ev_io_t *io, struct msghdr *msgs, int n)
+{
+    if(!c->completions) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return c->backend->io_sendmsg(c, io, msgs, n);
+}
+
+/*
+ * cancel what io has in flight and release its slot, its callback is
+ * not called any more. buffers of dropped completions go back to the
+ * ring.
+ */
+void ev_io_cancel(ev_context_t *c, ev_io_t *io)
+{
+    if(c->completions)
+        c->backend->io_cancel(c, io);
+}
+
+
+
+/*
+ * wake the loop unless a wakeup is already on its way. the tasks were
+ * published by a release store and post_callback() reads them with an
+ * acquire load, neither orders a store before a later load: without the
+ * full fences on both sides, on aarch64 the loop could clear post_wake
+ * and find the ring empty while a poster still sees post_wake set, and
+ * the wakeup would be lost.
+ */
+static void post_wakeup(ev_context_t *c)
+{
+    uint64_t one = 1;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_exchange_explicit(&c->post_wake, true, memory_order_relaxed))
+        return;
+
+    if(write(c->post_fd, &one, sizeof(one)) != sizeof(one))
+        syslog(LOG_ERR, "wake up event loop failed: %d", errno);
+}
+
+/*
+ * run up to EV_POST_BUDGET tasks. post_wake is cleared and fenced before
+ * the ring is read, so a task queued after the last read always sees it
+ * clear and signals again, see post_wakeup(). leftovers are pended, the
+ * next round runs them right after its ready events.
+ */
+static void post_callback(ev_event_t *event)
+{
+    ev_context_t *c = container_of(event, ev_context_t, post_event);
+    ev_post_t tasks[32];
+    uint64_t val;
+    int n, i, budget = EV_POST_BUDGET;
+
+    /* a pended round finds the counter empty */
+    if(read(c->post_fd, &val, sizeof(val)) == sizeof(val))
+        c->stats.post_wakeups++;
+    else if(errno != EAGAIN)
+        syslog(LOG_ERR, "read eventfd failed: %d", errno);
+    atomic_store_explicit(&c->post_wake, false, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    while(budget > 0) {
+        n = ring_dequeue_elem_burst(c->posts, tasks,
+                budget < 32 ? budget : 32);
+        if(n == 0)
+            return;
+
+        for(i = 0; i < n; i++)
+            tasks[i].fn(tasks[i].arg);
+        c->stats.posts += n;
+        budget -= n;
+    }
+
+    if(!ring_empty(c->posts)) {
+        atomic_store(&c->post_wake, true);
+        ev_pend_event(c, event, EV_READ_EVENT);
+    }
+}
+
+/*
+ * run fn(arg) in the loop's thread at its next round, callable from any
+ * thread, the loop's own included. tasks posted by one thread run in
+ * order. return 0, or -1 with errno EAGAIN if the queue is full.
+ */
+int ev_post(ev_context_t *c, ev_post_callback_t fn, void *arg)
+{
+    ev_post_t task = { fn, arg };
+
+    if(!ring_enqueue_elem(c->posts, &task)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    post_wakeup(c);
+    return 0;
+}
+
+/* post as many of tasks as fit with one wakeup, return how many */
+int ev_post_bulk(ev_context_t *c, const ev_post_t *tasks, int n)
+{
+    n = ring_enqueue_elem_burst(c->posts, tasks, n);
+    if(n > 0)
+        post_wakeup(c);
+
+    return n;
+}
+
+/*
+ * remove up to n queued tasks without running them, e.g. to release
+ * their args before ev_destroy_context(). only from the loop's thread or
+ * once the loop stopped. return how many were taken.
+ */
+int ev_take_posts(ev_context_t *c, ev_post_t *tasks, int n)
+{
+    return ring_dequeue_elem_burst(c->posts, tasks, n);
 }
 
 
@@ -122,23 +801,24 @@ void ev_init_timer(ev_timer_t *timer, uint64_t msec, ev_timer_callback_t callbac
     timer->msec = msec;
 }
 
+/*
+ * O(1), starting a pending timer re-arms it with timer->msec from now.
+ */
 void ev_start_timer(ev_context_t *c, ev_timer_t *timer)
 {
-    ev_timer_t *t;
+    if(ev_timer_pending(timer))
+        ev_cancel_timer(c, timer);
 
     timer->abs_msec = get_current_msec() + timer->msec;
-    list_for_each_entry(t, &c->timer_list, list) {
-        if(t->abs_msec > timer->abs_msec) {
-            __list_add(&timer->list, t->list.prev, &t->list);
-            run_timers(&c->timer_list);
-            return;
-        }
-    }
+    wheel_add(&c->timers, timer);
 }
 
 
 void ev_cancel_timer(ev_context_t *c, ev_timer_t *timer)
 {
-    UNUSED(c);
-    list_del(&timer->list);
+    if(!ev_timer_pending(timer))
+        return;
+
+    list_del_init(&timer->list);
+    c->timers.count--;
 }
@@ -0,0 +1,837 @@
+#include "event.h"
+#include "event_backend.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+
+/*
+ * io_uring backend, talks to the kernel with raw syscalls.
+ *
+ * readiness is delivered by IORING_OP_POLL_ADD, so event callbacks see
+ * the same revents as with epoll. level triggered events are armed as
+ * one-shot polls and re-armed after their callback (the kernel checks
+ * the current state on arming, which gives level semantics), edge
+ * triggered ones use multishot polls. registration changes are queued
+ * as SQEs and submitted together with the wait, in a single
+ * io_uring_enter per loop round, or without any syscall under SQPOLL.
+ *
+ * user_data never points at the event. it is the index of a slot owned
+ * by the backend with the slot's generation in the high 32 bits. a
+ * registration takes a slot, every change of it bumps the generation,
+ * so a late completion of an earlier one is recognized and dropped by
+ * the slot alone, and the event may be freed right after
+ * ev_unregister_event() as with epoll.
+ *
+ * an ev_io_t takes a slot the same way for its accept, recv and sendmsg
+ * operations. recv picks buffers from a ring registered with
+ * IORING_REGISTER_PBUF_RING, the backend remembers every buffer id it
+ * was given, so the buffer of a dropped completion goes back to the
+ * ring without its owner.
+ */
+
+#define URING_MAX_ENTRIES   4096
+#define URING_GEN_SHIFT     32
+#define URING_SLOT_MASK     ((1ULL << URING_GEN_SHIFT) - 1)
+#define URING_MIN_SLOTS     64
+#define URING_MAX_SLOTS     (1U << 24)
+
+#define URING_ARMED         0x01    // ev_event_t.bk_flags
+
+#define URING_SLOT_EVENT    0
+#define URING_SLOT_IO       1
+
+#define URING_MAX_BUFS      32768
+#define URING_NO_USER_DATA  URING_SLOT_MASK     // slot never allocated
+
+/* multishot poll (5.13) is the newest feature used, RSRC_TAGS came with it */
+#define URING_REQUIRED_FEATS \
+    (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS)
+
+typedef struct uring_slot {
+    void                *owner;     // NULL while free
+    uint32_t            gen;
+    union {
+        uint32_t        next;       // free list
+        uint32_t        kind;       // URING_SLOT_*, while in use
+    };
+} uring_slot_t;
+
+typedef struct uring_buf {
+    void                *addr;
+    uint32_t            len;
+} uring_buf_t;
+
+typedef struct ev_uring {
+    int                 fd;
+    unsigned int        setup_flags;
+
+    unsigned int        sq_mask;
+    unsigned int        sq_entries;
+    unsigned int        sq_tail;        // local, published on submit
+    unsigned int        *ksq_head;
+    unsigned int        *ksq_tail;
+    unsigned int        *ksq_flags;
+    struct io_uring_sqe *sqes;
+
+    unsigned int        cq_mask;
+    unsigned int        *kcq_head;
+    unsigned int        *kcq_tail;
+    struct io_uring_cqe *cqes;
+
+    /* completions moved off the ring to let a submission through */
+    struct io_uring_cqe *stash;
+    unsigned int        stash_head;
+    unsigned int        nr_stash;
+    unsigned int        max_stash;
+
+    void                *sq_ring;
+    size_t              sq_ring_size;
+    void                *cq_ring;
+    size_t              cq_ring_size;
+    size_t              sqes_size;
+
+    /* slot 0 is never used, user_data 0 marks completions to ignore */
+    uring_slot_t        *slots;
+    uint32_t            nr_slots;
+    uint32_t            free_slot;  // 0 if none
+
+    /* buffer group 0 of ev_io_recv(), bufs is indexed by buffer id */
+    struct io_uring_buf_ring *br;
+    size_t              br_size;
+    unsigned int        br_mask;
+    uint16_t            br_tail;
+    uring_buf_t         *bufs;
+} ev_uring_t;
+
+
+static inline int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+        unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+        unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t uring_user_data(ev_uring_t *u, uint32_t slot)
+{
+    return (uint64_t)u->slots[slot].gen << URING_GEN_SHIFT | slot;
+}
+
+/* double the table, the new slots go on the free list */
+static int uring_grow_slots(ev_uring_t *u)
+{
+    uint32_t n = u->nr_slots ? u->nr_slots * 2 : URING_MIN_SLOTS;
+    uring_slot_t *slots;
+    uint32_t i;
+
+    if(n > URING_MAX_SLOTS) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    slots = realloc(u->slots, n * sizeof(uring_slot_t));
+    if(!slots)
+        return -1;
+
+    for(i = u->nr_slots; i < n; i++) {
+        slots[i].owner = NULL;
+        slots[i].gen = 0;
+        slots[i].next = i + 1 < n ? i + 1 : u->free_slot;
+    }
+    u->free_slot = u->nr_slots ? u->nr_slots : 1;
+    u->slots = slots;
+    u->nr_slots = n;
+
+    return 0;
+}
+
+/* return the slot, 0 on failure */
+static uint32_t uring_alloc_slot(ev_uring_t *u, void *owner, uint32_t kind)
+{
+    uint32_t slot;
+
+    if(!u->free_slot && uring_grow_slots(u) != 0)
+        return 0;
+
+    slot = u->free_slot;
+    u->free_slot = u->slots[slot].next;
+    u->slots[slot].owner = owner;
+    u->slots[slot].kind = kind;
+
+    return slot;
+}
+
+/* completions still in flight for the slot carry an older generation */
+static void uring_free_slot(ev_uring_t *u, uint32_t slot)
+{
+    u->slots[slot].gen++;
+    u->slots[slot].owner = NULL;
+    u->slots[slot].next = u->free_slot;
+    u->free_slot = slot;
+}
+
+
+static void uring_unmap(ev_uring_t *u)
+{
+    if(u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if(u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if(u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+}
+
+/*
+ * linux 6.0 brought multishot recv and IORING_REGISTER_SYNC_CANCEL
+ * together, a sync cancel of a user_data never used tells them apart
+ * from older kernels.
+ */
+static bool uring_has_recv_multishot(ev_uring_t *u)
+{
+    struct io_uring_sync_cancel_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = URING_NO_USER_DATA;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+
+    return sys_io_uring_register(u->fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0 &&
+        errno == ENOENT;
+}
+
+static int uring_backend_init(ev_context_t *c, unsigned int flags)
+{
+    struct io_uring_params p;
+    ev_uring_t *u;
+    unsigned int entries, i, *array;
+    int saved;
+
+    u = calloc(1, sizeof(ev_uring_t));
+    if(!u)
+        return -1;
+
+    entries = c->max_events < URING_MAX_ENTRIES ? c->max_events : URING_MAX_ENTRIES;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    if(flags & EV_F_SQPOLL) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;    // msec before the kernel thread sleeps
+    }
+
+    u->fd = sys_io_uring_setup(entries, &p);
+    if(u->fd < 0) {
+        free(u);
+        return -1;
+    }
+
+    if((p.features & URING_REQUIRED_FEATS) != URING_REQUIRED_FEATS) {
+        errno = ENOTSUP;
+        goto failed;
+    }
+
+    u->setup_flags = p.flags;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto failed;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if(u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto failed;
+        }
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto failed;
+    }
+
+    u->sq_entries = p.sq_entries;
+    u->sq_mask = *(unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->ksq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+    u->ksq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+    u->ksq_flags = (unsigned int *)((char *)u->sq_ring + p.sq_off.flags);
+    u->sq_tail = *u->ksq_tail;
+
+    /* sqes are used in ring order, the index array never changes */
+    array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+    for(i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    u->cq_mask = *(unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->kcq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+    u->kcq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+    c->completions = uring_has_recv_multishot(u);
+    c->backend_data = u;
+    return 0;
+
+failed:
+    saved = errno;
+    uring_unmap(u);
+    close(u->fd);
+    free(u);
+    errno = saved;
+    return -1;
+}
+
+static void uring_backend_destroy(ev_context_t *c)
+{
+    ev_uring_t *u = c->backend_data;
+
+    uring_unmap(u);
+    close(u->fd);
+    if(u->br)
+        munmap(u->br, u->br_size);
+    free(u->bufs);
+    free(u->stash);
+    free(u->slots);
+    free(u);
+}
+
+/*
+ * the kernel refuses submissions with EBUSY while it holds completions
+ * the ring had no room for. move the ring's completions aside, the poll
+ * runs them ahead of the ring. return how many were moved, -1 on error.
+ */
+static int uring_stash_cqes(ev_uring_t *u)
+{
+    struct io_uring_cqe *stash;
+    unsigned int head, tail, n, max;
+
+    head = *u->kcq_head;
+    tail = __atomic_load_n(u->kcq_tail, __ATOMIC_ACQUIRE);
+    n = tail - head;
+
+    if(u->nr_stash + n > u->max_stash) {
+        max = u->max_stash ? u->max_stash * 2 : u->cq_mask + 1;
+        while(max < u->nr_stash + n)
+            max *= 2;
+
+        stash = realloc(u->stash, max * sizeof(*stash));
+        if(!stash)
+            return -1;
+        u->stash = stash;
+        u->max_stash = max;
+    }
+
+    for(; head != tail; head++)
+        u->stash[u->nr_stash++] = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->kcq_head, tail, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/* sqes queued but not consumed by the kernel, which moves the head */
+static inline unsigned int uring_unsubmitted(ev_uring_t *u)
+{
+    return u->sq_tail - __atomic_load_n(u->ksq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * hand the queued sqes to the kernel and wait up to timeout msec for at
+ * least wait_nr completions.
+ */
+static int uring_enter(ev_uring_t *u, unsigned int wait_nr, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = 0, sq_flags, to_submit;
+    int ret;
+
+    __atomic_store_n(u->ksq_tail, u->sq_tail, __ATOMIC_RELEASE);
+    sq_flags = __atomic_load_n(u->ksq_flags, __ATOMIC_ACQUIRE);
+    to_submit = uring_unsubmitted(u);
+
+    if(u->setup_flags & IORING_SETUP_SQPOLL) {
+        to_submit = 0;
+        if(sq_flags & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+
+    /* overflowed completions only reach the ring through GETEVENTS */
+    if(wait_nr || (sq_flags & IORING_SQ_CQ_OVERFLOW))
+        flags |= IORING_ENTER_GETEVENTS;
+    else if(to_submit == 0 && !(flags & IORING_ENTER_SQ_WAKEUP))
+        return 0;
+
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000LL;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+again:
+    ret = sys_io_uring_enter(u->fd, to_submit, wait_nr,
+            flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    /* the kernel may take fewer sqes than offered, the rest go next time */
+    if(ret > 0)
+        return 0;
+
+    if(ret < 0 && errno == EBUSY) {
+        ret = uring_stash_cqes(u);
+        if(ret <= 0) {
+            errno = ret == 0 ? EBUSY : ENOMEM;
+            return -1;
+        }
+
+        /* the stash is to run now, flush the overflow but do not wait */
+        to_submit = uring_unsubmitted(u);
+        wait_nr = 0;
+        flags |= IORING_ENTER_GETEVENTS;
+        goto again;
+    }
+
+    if(ret < 0 && errno != ETIME && errno != EINTR)
+        return -1;
+
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(ev_uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+
+    while(u->sq_tail - __atomic_load_n(u->ksq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if(uring_enter(u, 0, 0) != 0)
+            return NULL;
+        if(u->setup_flags & IORING_SETUP_SQPOLL)
+            cpu_relax();
+    }
+
+    sqe = &u->sqes[u->sq_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_tail++;
+
+    return sqe;
+}
+
+/*
+ * make room for n sqes that must reach the kernel in one submission,
+ * a link chain split over two of them would be cut.
+ */
+static int uring_reserve_sqes(ev_uring_t *u, unsigned int n)
+{
+    while(u->sq_tail + n - __atomic_load_n(u->ksq_head, __ATOMIC_ACQUIRE) > u->sq_entries) {
+        if(uring_enter(u, 0, 0) != 0)
+            return -1;
+        if(u->setup_flags & IORING_SETUP_SQPOLL)
+            cpu_relax();
+    }
+
+    return 0;
+}
+
+static int uring_arm(ev_uring_t *u, ev_event_t *event)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(u);
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = event->fd;
+    sqe->poll32_events = event->events & ~(EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE);
+    if(event->events & EPOLLET)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_user_data(u, event->bk_slot);
+
+    event->bk_flags |= URING_ARMED;
+    return 0;
+}
+
+/* cancel the armed poll, the caller moves the slot to a new generation */
+static int uring_disarm(ev_uring_t *u, ev_event_t *event)
+{
+    struct io_uring_sqe *sqe;
+
+    if(event->bk_flags & URING_ARMED) {
+        sqe = uring_get_sqe(u);
+        if(!sqe)
+            return -1;
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = uring_user_data(u, event->bk_slot);
+        sqe->user_data = 0;
+        event->bk_flags &= ~URING_ARMED;
+    }
+
+    return 0;
+}
+
+static int uring_backend_add(ev_context_t *c, ev_event_t *event)
+{
+    ev_uring_t *u = c->backend_data;
+
+    event->bk_slot = uring_alloc_slot(u, event, URING_SLOT_EVENT);
+    if(!event->bk_slot)
+        return -1;
+    event->bk_flags = 0;
+
+    if(uring_arm(u, event) != 0) {
+        uring_free_slot(u, event->bk_slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int uring_backend_mod(ev_context_t *c, ev_event_t *event)
+{
+    ev_uring_t *u = c->backend_data;
+
+    /* a one-shot poll inside its own callback is re-armed afterwards */
+    if(!(event->bk_flags & URING_ARMED))
+        return 0;
+
+    if(uring_disarm(u, event) != 0)
+        return -1;
+    u->slots[event->bk_slot].gen++;
+
+    return uring_arm(u, event);
+}
+
+static void uring_backend_del(ev_context_t *c, ev_event_t *event)
+{
+    ev_uring_t *u = c->backend_data;
+
+    uring_disarm(u, event);
+    uring_free_slot(u, event->bk_slot);
+}
+
+static int uring_backend_io_buffers(ev_context_t *c, unsigned int entries)
+{
+    ev_uring_t *u = c->backend_data;
+    struct io_uring_buf_reg reg;
+    int saved;
+
+    if(u->br || entries == 0 || entries > URING_MAX_BUFS || (entries & (entries - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    u->bufs = calloc(entries, sizeof(uring_buf_t));
+    if(!u->bufs)
+        return -1;
+
+    u->br_size = entries * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(u->br == MAP_FAILED) {
+        u->br = NULL;
+        goto failed;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = entries;
+    reg.bgid = 0;
+    if(sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        goto failed;
+
+    u->br_mask = entries - 1;
+    u->br_tail = 0;
+    return 0;
+
+failed:
+    saved = errno;
+    if(u->br)
+        munmap(u->br, u->br_size);
+    u->br = NULL;
+    free(u->bufs);
+    u->bufs = NULL;
+    errno = saved;
+    return -1;
+}
+
+/* the kernel reads the tail when it picks a buffer, publish at once */
+static void uring_backend_io_provide(ev_context_t *c, int bid, void *addr, uint32_t len)
+{
+    ev_uring_t *u = c->backend_data;
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & u->br_mask];
+
+    b->addr = (uint64_t)(uintptr_t)addr;
+    b->len = len;
+    b->bid = bid;
+    u->bufs[bid].addr = addr;
+    u->bufs[bid].len = len;
+
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/* an sqe of io, the first operation takes its slot */
+static struct io_uring_sqe *uring_io_sqe(ev_uring_t *u, ev_io_t *io, int opcode)
+{
+    struct io_uring_sqe *sqe;
+
+    if(!io->bk_slot) {
+        io->bk_slot = uring_alloc_slot(u, io, URING_SLOT_IO);
+        if(!io->bk_slot)
+            return NULL;
+        io->bk_inflight = 0;
+    }
+
+    sqe = uring_get_sqe(u);
+    if(!sqe)
+        return NULL;
+
+    sqe->opcode = opcode;
+    sqe->fd = io->fd;
+    sqe->user_data = uring_user_data(u, io->bk_slot);
+    io->bk_inflight++;
+
+    return sqe;
+}
+
+static int uring_backend_io_accept(ev_context_t *c, ev_io_t *io)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_io_sqe(c->backend_data, io, IORING_OP_ACCEPT);
+    if(!sqe)
+        return -1;
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    return 0;
+}
+
+static int uring_backend_io_recv(ev_context_t *c, ev_io_t *io)
+{
+    ev_uring_t *u = c->backend_data;
+    struct io_uring_sqe *sqe;
+
+    if(!u->br) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sqe = uring_io_sqe(u, io, IORING_OP_RECV);
+    if(!sqe)
+        return -1;
+
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    return 0;
+}
+
+/*
+ * MSG_WAITALL makes the kernel retry short sends, only a failure breaks
+ * the link.
+ */
+static int uring_backend_io_sendmsg(ev_context_t *c, ev_io_t *io,
+        struct msghdr *msgs, int n)
+{
+    ev_uring_t *u = c->backend_data;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if(n <= 0 || (unsigned int)n > u->sq_entries) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(uring_reserve_sqes(u, n) != 0)
+        return -1;
+
+    for(i = 0; i < n; i++) {
+        sqe = uring_io_sqe(u, io, IORING_OP_SENDMSG);
+        if(!sqe)
+            return -1;
+
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[i];
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if(i < n - 1)
+            sqe->flags = IOSQE_IO_LINK;
+    }
+
+    return 0;
+}
+
+static void uring_backend_io_cancel(ev_context_t *c, ev_io_t *io)
+{
+    ev_uring_t *u = c->backend_data;
+    struct io_uring_sqe *sqe;
+
+    if(!io->bk_slot)
+        return;
+
+    if(io->bk_inflight) {
+        sqe = uring_get_sqe(u);
+        if(sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uring_user_data(u, io->bk_slot);
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = 0;
+        }
+    }
+
+    uring_free_slot(u, io->bk_slot);
+    io->bk_slot = 0;
+    io->bk_inflight = 0;
+}
+
+/* the next completion, stashed ones first as they are older than the ring */
+static bool uring_next_cqe(ev_uring_t *u, struct io_uring_cqe *cqe)
+{
+    unsigned int head, tail;
+
+    if(u->stash_head < u->nr_stash) {
+        *cqe = u->stash[u->stash_head++];
+        if(u->stash_head == u->nr_stash) {
+            u->stash_head = 0;
+            u->nr_stash = 0;
+        }
+        return true;
+    }
+
+    head = *u->kcq_head;
+    tail = __atomic_load_n(u->kcq_tail, __ATOMIC_ACQUIRE);
+    if(head == tail)
+        return false;
+
+    /* release the entry first, callbacks may queue new sqes */
+    *cqe = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->kcq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static int uring_backend_poll(ev_context_t *c, int timeout)
+{
+    ev_uring_t *u = c->backend_data;
+    struct io_uring_cqe cqe;
+    ev_event_t *event;
+    ev_io_t *io;
+    unsigned int head, tail, budget;
+    uint32_t slot, gen;
+    int bid, n = 0;
+    bool more, wait;
+
+    head = *u->kcq_head;
+    tail = __atomic_load_n(u->kcq_tail, __ATOMIC_ACQUIRE);
+    wait = head == tail && u->nr_stash == 0 && timeout != 0;
+
+    if(uring_enter(u, wait, timeout) != 0)
+        return -1;
+    ev_backend_woken(c);
+
+    /*
+     * run what completed up to now, callbacks keep queueing sqes that
+     * complete at once and may get stashed, those wait for the next poll.
+     */
+    head = *u->kcq_head;
+    tail = __atomic_load_n(u->kcq_tail, __ATOMIC_ACQUIRE);
+    budget = u->nr_stash - u->stash_head + (tail - head);
+
+    while(budget-- > 0 && uring_next_cqe(u, &cqe)) {
+        if(cqe.user_data == 0)
+            continue;
+
+        more = cqe.flags & IORING_CQE_F_MORE;
+        bid = cqe.flags & IORING_CQE_F_BUFFER ?
+            (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+        /* nothing of a stale registration is touched but its slot */
+        slot = cqe.user_data & URING_SLOT_MASK;
+        gen = cqe.user_data >> URING_GEN_SHIFT;
+        if(gen != u->slots[slot].gen) {
+            if(bid >= 0)
+                uring_backend_io_provide(c, bid, u->bufs[bid].addr, u->bufs[bid].len);
+            continue;
+        }
+
+        if(u->slots[slot].kind == URING_SLOT_IO) {
+            io = u->slots[slot].owner;
+            if(!more)
+                io->bk_inflight--;
+
+            io->res = cqe.res;
+            io->bid = bid;
+            io->more = more;
+            ev_run_io_callback(c, io);
+            n++;
+            continue;
+        }
+
+        event = u->slots[slot].owner;
+        if(!more)
+            event->bk_flags &= ~URING_ARMED;
+
+        /*
+         * a poll we remove moves its slot to a new generation first, a
+         * current one was cancelled by the kernel and is armed again.
+         */
+        if(cqe.res != -ECANCELED) {
+            event->revents = cqe.res < 0 ? EPOLLERR : cqe.res;
+            ev_run_callback(c, event);
+            n++;
+        }
+
+        /* still registered and not armed: level triggered or multishot ended */
+        if(gen == u->slots[slot].gen && !(event->bk_flags & URING_ARMED)) {
+            if(uring_arm(u, event) != 0)
+                return -1;
+        }
+    }
+
+    c->stats.events += n;
+    return n;
+}
+
+const ev_backend_t ev_uring_backend = {
+    .type       = EV_BACKEND_IO_URING,
+    .name       = "io_uring",
+    .init       = uring_backend_init,
+    .destroy    = uring_backend_destroy,
+    .add        = uring_backend_add,
+    .mod        = uring_backend_mod,
+    .del        = uring_backend_del,
+    .poll       = uring_backend_poll,
+
+    .io_buffers = uring_backend_io_buffers,
+    .io_provide = uring_backend_io_provide,
+    .io_accept  = uring_backend_io_accept,
+    .io_recv    = uring_backend_io_recv,
+    .io_sendmsg = uring_backend_io_sendmsg,
+    .io_cancel  = uring_backend_io_cancel,
+};
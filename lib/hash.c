@@ -0,0 +1,192 @@
+#include "hash.h"
+
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY     0x82f63b78      // reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static bool crc32c_sse42;
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+/*
+ * MurmurHash2 by Austin Appleby, public domain. the key is read a
+ * uint32_t at a time in host order, like the reference code.
+ */
+uint32_t hash_murmur2(const void *key, size_t len, uint32_t seed)
+{
+    const uint32_t m = 0x5bd1e995;
+    const uint8_t *data = key;
+    uint32_t h = seed ^ (uint32_t)len, k;
+
+    while(len >= 4) {
+        k = read32(data);
+
+        k *= m;
+        k ^= k >> 24;
+        k *= m;
+
+        h *= m;
+        h ^= k;
+
+        data += 4;
+        len -= 4;
+    }
+
+    switch(len) {
+    case 3:
+        h ^= data[2] << 16;
+        /* fall through */
+    case 2:
+        h ^= data[1] << 8;
+        /* fall through */
+    case 1:
+        h ^= data[0];
+        h *= m;
+    }
+
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+
+    return h;
+}
+
+
+/*
+ * the wyhash construction of Wang Yi: 16 bytes at a time are mixed by a
+ * 128 bit multiply, three independent lanes above 48 bytes. short keys
+ * are read with overlapping loads instead of a byte loop.
+ */
+uint64_t hash64(const void *key, size_t len, uint64_t seed)
+{
+    const uint8_t *p = key;
+    uint64_t a, b, see1, see2;
+    size_t i = len;
+
+    seed ^= hash_mix(seed ^ HASH_P0, HASH_P1);
+
+    if(likely(len <= 16)) {
+        if(likely(len >= 4)) {
+            a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+        } else if(len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if(unlikely(i >= 48)) {
+            see1 = see2 = seed;
+            do {
+                seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+                see1 = hash_mix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ see1);
+                see2 = hash_mix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(likely(i >= 48));
+            seed ^= see1 ^ see2;
+        }
+
+        while(unlikely(i > 16)) {
+            seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    return hash_mix(hash_mix(a ^ HASH_P1, b ^ seed) ^ HASH_P0 ^ len, HASH_P1);
+}
+
+
+static void crc32c_init(void)
+{
+    uint32_t crc, i, j;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while(len--)
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+
+    while(len >= 8) {
+        c = _mm_crc32_u64(c, read64(p));
+        p += 8;
+        len -= 8;
+    }
+
+    crc = c;
+    if(len >= 4) {
+        crc = _mm_crc32_u32(crc, read32(p));
+        p += 4;
+        len -= 4;
+    }
+    while(len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#endif
+
+uint32_t hash_crc32c(const void *key, size_t len, uint32_t seed)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+
+#if defined(__x86_64__)
+    if(likely(crc32c_sse42))
+        return ~crc32c_hw(~seed, key, len);
+#endif
+
+    return ~crc32c_sw(~seed, key, len);
+}
+
+bool hash_crc32c_hw(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_sse42;
+}
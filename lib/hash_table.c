@@ -1,108 +1,301 @@
 #include "hash_table.h"
+#include "hash.h"
 
 #include <assert.h>
+#include <string.h>
 
-htable_t *htable_create(int size, htable_cmp_t cmp, htable_hash_t hash)
+
+/* keep 1/8 of the slots EMPTY so every lookup ends */
+static uint32_t max_load(uint32_t capacity)
 {
-    int i;
-    htable_t *t;
+    return capacity - capacity / 8;
+}
+
+static uint32_t capacity_for(uint32_t size)
+{
+    uint32_t capacity = HTABLE_GROUP;
+
+    while(max_load(capacity) < size && capacity < HTABLE_MAX_SLOTS)
+        capacity <<= 1;
+
+    return capacity;
+}
+
+static size_t slots_len(uint32_t capacity)
+{
+    return CACHE_LINE_ROUNDUP(capacity *
+            (sizeof(uint8_t) + sizeof(list_head_t *) + sizeof(uint32_t)));
+}
+
+/* ctrl, slots and hashes share one block, ctrl first so it is aligned */
+static int alloc_slots(htable_t *t, htable_slots_t *s, uint32_t capacity)
+{
+    uint8_t *mem;
+
+    if(t->mem)
+        mem = t->mem->alloc(t->mem->arg, slots_len(capacity));
+    else
+        mem = aligned_alloc(CACHE_LINE_SIZE, slots_len(capacity));
+    if(!mem)
+        return -1;
+
+    memset(mem, HTABLE_EMPTY, capacity);
+    s->ctrl = mem;
+    s->slots = (list_head_t **)(mem + capacity);
+    s->hashes = (uint32_t *)(mem + capacity + capacity * sizeof(list_head_t *));
+    s->capacity = capacity;
+    s->group_mask = capacity / HTABLE_GROUP - 1;
+    s->size = 0;
+    s->growth_left = max_load(capacity);
+
+    return 0;
+}
+
+static void free_slots(htable_t *t, htable_slots_t *s)
+{
+    if(!s->ctrl)
+        return;
+
+    if(t->mem)
+        t->mem->free(t->mem->arg, s->ctrl, slots_len(s->capacity));
+    else
+        free(s->ctrl);
+}
+
+/* first EMPTY or DELETED slot on the probe sequence of hash */
+static uint32_t find_free(htable_slots_t *s, uint32_t hash)
+{
+    uint32_t g = HTABLE_H1(hash) & s->group_mask, step = 0, mask;
+
+    for(;;) {
+        mask = __htable_match_free(s->ctrl + g * HTABLE_GROUP);
+        if(mask)
+            return g * HTABLE_GROUP + __builtin_ctz(mask);
+
+        step++;
+        g = (g + step) & s->group_mask;
+    }
+}
+
+/* ctrl goes last, a lock-free reader that matches it must find the entry */
+static void insert_slot(htable_slots_t *s, uint32_t hash, list_head_t *data)
+{
+    uint32_t idx = find_free(s, hash);
+
+    if(s->ctrl[idx] == HTABLE_EMPTY)
+        s->growth_left--;
+
+    s->slots[idx] = data;
+    s->hashes[idx] = hash;
+    __atomic_store_n(&s->ctrl[idx], HTABLE_H2(hash), __ATOMIC_RELEASE);
+    s->size++;
+}
+
+/*
+ * start moving everything to new slots of the given capacity. cur has
+ * room for twice the entries, so it keeps at least old.size EMPTY slots
+ * for the ones still to move.
+ */
+static int rehash_start(htable_t *t, uint32_t capacity)
+{
+    t->old = t->cur;
+    if(alloc_slots(t, &t->cur, capacity) != 0) {
+        t->cur = t->old;
+        memset(&t->old, 0, sizeof(t->old));
+        return -1;
+    }
+
+    t->rehash_idx = 0;
+    return 0;
+}
+
+/* out of EMPTY slots: double, or just drop the DELETED ones if that frees half */
+static int grow(htable_t *t)
+{
+    uint32_t capacity;
+
+    while(htable_rehashing(t))
+        __htable_rehash_step(t);
+
+    if(t->cur.growth_left)
+        return 0;
+
+    capacity = t->cur.capacity;
+    if(t->cur.size > max_load(capacity) / 2) {
+        if(capacity >= HTABLE_MAX_SLOTS)
+            return -1;
+        capacity <<= 1;
+    }
+
+    return rehash_start(t, capacity);
+}
+
+static void shrink(htable_t *t)
+{
+    uint32_t capacity = capacity_for(t->cur.size * 2);
+
+    if(capacity < t->min_capacity)
+        capacity = t->min_capacity;
+
+    rehash_start(t, capacity);
+}
 
+
+int htable_init(htable_t *t, int size, htable_cmp_t cmp, htable_hash_t hash,
+        htable_mem_t *mem)
+{
     assert(cmp);
     assert(hash);
 
-    t = calloc(1, sizeof(htable_t) + sizeof(list_head_t) * size);
-    if(!t)
-        return NULL;
-
-    t->size = size;
+    memset(t, 0, sizeof(*t));
     t->cmp = cmp;
     t->hash = hash;
+    t->mem = mem;
+    t->min_capacity = capacity_for(size > 0 ? size : 0);
+
+    return alloc_slots(t, &t->cur, t->min_capacity);
+}
 
-    for(i = 0; i < size; i++)
-        INIT_LIST_HEAD(&t->bucket[i]);
+void htable_fini(htable_t *t)
+{
+    free_slots(t, &t->old);
+    free_slots(t, &t->cur);
+}
+
+htable_t *htable_create(int size, htable_cmp_t cmp, htable_hash_t hash)
+{
+    htable_t *t;
+
+    t = malloc(sizeof(htable_t));
+    if(!t)
+        return NULL;
+
+    if(htable_init(t, size, cmp, hash, NULL) != 0) {
+        free(t);
+        return NULL;
+    }
 
     return t;
 }
 
 void htable_destroy(htable_t *t)
 {
+    htable_fini(t);
     free(t);
 }
 
-list_head_t *htable_find(htable_t *t, htable_key_t key)
+void __htable_rehash_step(htable_t *t)
 {
-    int pos = t->hash(key) % t->size;
+    htable_slots_t *old = &t->old;
+    uint8_t *group, freed;
+    uint32_t n, i;
+
+    for(n = 0; n < HTABLE_REHASH_STEP && t->rehash_idx <= old->group_mask; n++) {
+        group = old->ctrl + t->rehash_idx++ * HTABLE_GROUP;
 
-    list_head_t *node;
+        /*
+         * lookups in old only stop at a group with an EMPTY slot. one
+         * that had none must keep looking taken for the entries behind.
+         */
+        freed = __htable_match(group, HTABLE_EMPTY) ? HTABLE_EMPTY : HTABLE_DELETED;
 
-    list_for_each(node, &t->bucket[pos]) {
-        if(t->cmp(key, node))
-            return node;
+        for(i = 0; i < HTABLE_GROUP; i++) {
+            if(!htable_ctrl_full(group[i]))
+                continue;
+
+            insert_slot(&t->cur, old->hashes[group - old->ctrl + i],
+                    old->slots[group - old->ctrl + i]);
+            group[i] = freed;
+            old->size--;
+        }
     }
 
-    return NULL;
+    if(t->rehash_idx > old->group_mask) {
+        free_slots(t, old);
+        memset(old, 0, sizeof(*old));
+    }
 }
 
-void htable_add(htable_t *t, htable_key_t key, list_head_t *data)
+int __htable_insert(htable_t *t, uint32_t hash, list_head_t *data)
 {
-    int pos;
-
-    list_head_t *node = htable_find(t, key);
-    if(node)
-        return;
+    /* keep room for the entries old still has to move */
+    if(unlikely(t->cur.growth_left <= t->old.size) && grow(t) != 0)
+        return -1;
 
-    pos = t->hash(key) % t->size;
-    list_add_tail(data, &t->bucket[pos]);
+    insert_slot(&t->cur, hash, data);
+    return 0;
 }
 
-void htable_del(htable_t *t, htable_key_t key)
+void __htable_erase(htable_t *t, list_head_t **slot)
 {
-    list_head_t *node = htable_find(t, key);
-    if(node)
-        list_del(node);
+    htable_slots_t *s = &t->cur;
+    uint32_t idx;
+    const uint8_t *group;
+
+    if(slot >= t->old.slots && slot < t->old.slots + t->old.capacity)
+        s = &t->old;
+
+    idx = slot - s->slots;
+    group = s->ctrl + (idx & ~(HTABLE_GROUP - 1));
+
+    /*
+     * a group that still has an EMPTY slot stops every lookup reaching
+     * it, nothing behind it depends on this slot being taken.
+     */
+    if(__htable_match(group, HTABLE_EMPTY)) {
+        s->ctrl[idx] = HTABLE_EMPTY;
+        s->growth_left++;
+    } else {
+        s->ctrl[idx] = HTABLE_DELETED;
+    }
+    s->size--;
+
+    if(unlikely(t->cur.size < max_load(t->cur.capacity) / 8) &&
+            t->cur.capacity > t->min_capacity && !htable_rehashing(t))
+        shrink(t);
 }
 
-/*
- * use the murmurhash2 from Google Code
- */
+list_head_t *htable_find(htable_t *t, htable_key_t key)
+{
+    list_head_t **slot;
 
-uint32_t htable_default_hash(htable_key_t key, size_t len)
+    if(unlikely(htable_rehashing(t)))
+        __htable_rehash_step(t);
+
+    slot = __htable_lookup(t, t->hash(key), key, t->cmp);
+    return slot ? *slot : NULL;
+}
+
+int htable_add(htable_t *t, htable_key_t key, list_head_t *data)
 {
-    uint32_t h, k;
-    uint32_t *data = key;
+    uint32_t hash = t->hash(key);
 
-    h = 0^len;
+    if(unlikely(htable_rehashing(t)))
+        __htable_rehash_step(t);
 
-    while(len >= 4) {
-        k = data[0];
-        k |= data[1] << 8;
-        k |= data[2] << 16;
-        k |= data[3] << 24;
+    if(__htable_lookup(t, hash, key, t->cmp))
+        return -1;
 
-        k *= 0x5bd1e995;
-        k ^= k >> 24;
-        k *= 0x5bd1e995;
+    return __htable_insert(t, hash, data);
+}
 
-        h *= 0x5bd1e995;
-        h ^= k;
+list_head_t *htable_delete(htable_t *t, htable_key_t key)
+{
+    list_head_t **slot, *node;
 
-        data += 4;
-        len -= 4;
-    }
+    if(unlikely(htable_rehashing(t)))
+        __htable_rehash_step(t);
 
-    switch(len) {
-        case 3:
-            h ^= data[2] << 16;
-        case 2:
-            h ^= data[1] << 8;
-        case 1:
-            h ^= data[0];
-            h *= 0x5bd1e995;
-    }
+    slot = __htable_lookup(t, t->hash(key), key, t->cmp);
+    if(!slot)
+        return NULL;
 
-    h ^= h >> 13;
-    h *= 0x5bd1e995;
-    h ^= h >> 15;
+    node = *slot;
+    __htable_erase(t, slot);
+    return node;
+}
 
-    return h;
+uint32_t htable_default_hash(htable_key_t key, size_t len)
+{
+    return hash_murmur2(key, len, 0);
 }
@@ -0,0 +1,145 @@
+#include "histogram.h"
+
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#define HIST_CALIBRATE_NSEC     (10 * 1000 * 1000)
+
+uint64_t hist_tsc_mult;
+
+static pthread_once_t hist_clock_once = PTHREAD_ONCE_INIT;
+
+
+hist_t *hist_create(void)
+{
+    return (hist_t *)calloc(1, sizeof(hist_t));
+}
+
+void hist_destroy(hist_t *h)
+{
+    free(h);
+}
+
+void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(hist_t));
+}
+
+/* all fields are uint64_t, each one is read atomically */
+void hist_snapshot(hist_t *dst, const hist_t *src)
+{
+    const uint64_t *s = (const uint64_t *)src;
+    uint64_t *d = (uint64_t *)dst;
+    size_t i;
+
+    for(i = 0; i < sizeof(hist_t) / sizeof(uint64_t); i++)
+        d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+    int i;
+
+    for(i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if(src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* the largest value falling into bucket idx */
+static uint64_t bucket_upper(unsigned int idx)
+{
+    unsigned int shift;
+
+    if(idx < HIST_SUB_COUNT)
+        return idx;
+
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    return (((uint64_t)(HIST_SUB_COUNT | (idx & (HIST_SUB_COUNT - 1))) + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const hist_t *h, double p)
+{
+    uint64_t rank, seen = 0, v;
+    int i;
+
+    if(h->count == 0)
+        return 0;
+
+    if(p >= 100.0)
+        return h->max;
+
+    rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if(rank == 0)
+        rank = 1;
+
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if(seen >= rank) {
+            v = bucket_upper(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+#if defined(__x86_64__)
+static bool tsc_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    return edx & (1 << 8);
+}
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* measure the tsc rate against CLOCK_MONOTONIC over ~10 msec */
+static void tsc_calibrate(void)
+{
+    struct timespec ts = {0, HIST_CALIBRATE_NSEC};
+    uint64_t ns0, ns1, tsc0, tsc1;
+
+    if(!tsc_invariant())
+        return;
+
+    ns0 = clock_ns();
+    tsc0 = __builtin_ia32_rdtsc();
+    nanosleep(&ts, NULL);
+    ns1 = clock_ns();
+    tsc1 = __builtin_ia32_rdtsc();
+
+    if(tsc1 <= tsc0 || ns1 <= ns0)
+        return;
+
+    hist_tsc_mult = ((unsigned __int128)(ns1 - ns0) << 32) / (tsc1 - tsc0);
+}
+#endif
+
+static void clock_init_once(void)
+{
+#if defined(__x86_64__)
+    tsc_calibrate();
+#endif
+}
+
+void hist_clock_init(void)
+{
+    pthread_once(&hist_clock_once, clock_init_once);
+}
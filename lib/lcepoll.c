@@ -1,142 +1,1687 @@
+#define _GNU_SOURCE     /* accept4, cpu_set_t */
+
 #include "lcepoll.h"
 
 #include <unistd.h>
 #include <errno.h>
 #include <syslog.h>
 #include <assert.h>
-#include <sys/select.h>
+#include <string.h>
+
+
+#define LCS_INVALID_IDX     -1
+
+#define LCS_HANDOFF_BATCH   32
+
+#define LCS_OUTBUF_SIZE     (16 * 1024 - sizeof(lcs_outbuf_t))
+#define LCS_OUT_IOV_MAX     64
+
+/*
+ * one chunk of a connection's output queue, base[start, end) is unsent.
+ * base is either the inline data or a slice of a referenced input buffer.
+ */
+typedef struct lcs_outbuf {
+    list_head_t     list;
+    uint32_t        size;
+    uint32_t        start;
+    uint32_t        end;
+    char            *base;
+    lcs_buf_t       *ref;
+    char            data[0];
+} lcs_outbuf_t;
+
+#define LCS_SEND_CHAIN      4       // linked sendmsg operations per flush
+#define LCS_RECV_RING_MAX   1024    // input buffers lent to the kernel
+#define LCS_RING_RETRY_MS   1
+
+/*
+ * the output queue of a completion mode connection being sent: its
+ * buffers are moved off out_queue into bufs and sent by a chain of
+ * nr_msgs linked sendmsg operations. msgs and iov stay put until the
+ * last one completes, even if the connection is closed meanwhile.
+ */
+typedef struct lcs_sending {
+    ev_io_t         io;
+    lcs_worker_t    *worker;
+    lcs_conn_t      *conn;          // NULL once closed, an orphan
+    list_head_t     list;           // worker->orphans
+    list_head_t     bufs;
+    int             nr_msgs;        // completions still to come
+    size_t          bytes;
+    bool            failed;
+    struct msghdr   msgs[LCS_SEND_CHAIN];
+    struct iovec    iov[LCS_SEND_CHAIN * LCS_OUT_IOV_MAX];
+} lcs_sending_t;
+
+#define LCS_MASTER_MAX_EVENTS   16
+
+#define LCS_LAG_QUANTUM_US      100
+
+/*
+ * out of fds the listener stays readable, it is paused for a while
+ * instead of being polled in a loop. logged once per LCS_ACCEPT_LOG_MS.
+ */
+#define LCS_ACCEPT_BACKOFF_MS   100
+#define LCS_ACCEPT_LOG_MS       10000
+
+/* an lcs_send_by_handle() payload on its way to the owning worker */
+typedef struct lcs_mail {
+    lcs_worker_t    *worker;
+    lcs_handle_t    handle;
+    size_t          len;
+    char            data[0];
+} lcs_mail_t;
+
+/* connections accepted by the master and not yet pushed to a slave */
+typedef struct lcs_handoff {
+    int             count;
+    lcs_conn_t      *conns[LCS_HANDOFF_BATCH];
+} lcs_handoff_t;
+
+/*
+ * every worker keeps a small magazine of free connections in front of
+ * conn_pool. only the owning thread touches it, conn_pool_lock is taken
+ * once per LCS_CONN_CACHE_BATCH objects when the magazine runs empty or
+ * full. conn_pool is larger than max_conns by the magazines, nr_conns
+ * is what enforces the limit.
+ */
+static inline lcs_conn_t *get_conn(lcs_worker_t *w)
+{
+    lcs_conn_cache_t *cache = w->conn_cache;
+    lcserver_t *server = w->server;
+    lcs_conn_t *conn;
+
+    if(atomic_fetch_add_explicit(&server->nr_conns, 1,
+                memory_order_relaxed) >= server->max_conns) {
+        atomic_fetch_sub_explicit(&server->nr_conns, 1, memory_order_relaxed);
+        w->stats.conn_pool_empty++;
+        return NULL;
+    }
+
+    if(unlikely(cache->count == 0)) {
+        pthread_spin_lock(&server->conn_pool_lock);
+        cache->count = pool_alloc_bulk(server->conn_pool,
+                (void **)cache->conns, LCS_CONN_CACHE_BATCH);
+        pthread_spin_unlock(&server->conn_pool_lock);
+
+        w->stats.conn_cache_refills++;
+        if(cache->count == 0) {
+            atomic_fetch_sub_explicit(&server->nr_conns, 1, memory_order_relaxed);
+            w->stats.conn_pool_empty++;
+            return NULL;
+        }
+    }
+
+    conn = cache->conns[--cache->count];
+    if(unlikely(conn->gen == 0))
+        __atomic_store_n(&conn->gen, 1, __ATOMIC_RELAXED);
+
+    return conn;
+}
+
+static inline void free_conn(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    lcs_conn_cache_t *cache = w->conn_cache;
+    lcserver_t *server = w->server;
+
+    uint32_t gen = conn->gen + 1;
+
+    /* every handle of this connection goes stale */
+    __atomic_store_n(&conn->gen, gen ? gen : 1, __ATOMIC_RELEASE);
+    conn->idx = LCS_INVALID_IDX;
+    conn->flags = 0;
+    atomic_fetch_sub_explicit(&server->nr_conns, 1, memory_order_relaxed);
+
+    if(unlikely(cache->count == LCS_CONN_CACHE_SIZE)) {
+        cache->count -= LCS_CONN_CACHE_BATCH;
+
+        pthread_spin_lock(&server->conn_pool_lock);
+        pool_free_bulk(server->conn_pool,
+                (void **)&cache->conns[cache->count], LCS_CONN_CACHE_BATCH);
+        pthread_spin_unlock(&server->conn_pool_lock);
+
+        w->stats.conn_cache_drains++;
+    }
+
+    cache->conns[cache->count++] = conn;
+}
+
+/* single writer per counter, a plain load and store is enough */
+static inline void count_inc(_Atomic uint64_t *counter, int64_t delta)
+{
+    atomic_store_explicit(counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + delta,
+            memory_order_relaxed);
+}
+
+static lcs_buf_t *get_buf(lcs_worker_t *w)
+{
+    lcs_buf_t *buf;
+
+    buf = (lcs_buf_t *)pool_alloc_obj(w->buf_pool);
+    if(unlikely(!buf)) {
+        w->stats.buf_pool_empty++;
+        return NULL;
+    }
+
+    buf->refcnt = 1;
+    buf->size = w->server->in_buf_size;
+    buf->worker = w;
+
+    return buf;
+}
+
+static inline void put_buf(lcs_buf_t *buf)
+{
+    if(--buf->refcnt == 0)
+        pool_free_obj(buf->worker->buf_pool, buf);
+}
+
+void lcs_slice_retain(const lcs_slice_t *s, size_t off, size_t len, lcs_slice_t *out)
+{
+    assert(off + len <= s->len);
+
+    s->buf->refcnt++;
+    out->buf = s->buf;
+    out->data = s->data + off;
+    out->len = len;
+}
+
+void lcs_slice_release(lcs_slice_t *s)
+{
+    put_buf(s->buf);
+    s->buf = NULL;
+    s->data = NULL;
+    s->len = 0;
+}
+
+static void free_outbuf(lcs_outbuf_t *b)
+{
+    if(b->ref)
+        put_buf(b->ref);
+    free(b);
+}
+
+static void free_out_queue(lcs_conn_t *conn)
+{
+    lcs_outbuf_t *b, *n;
+
+    list_for_each_entry_safe(b, n, &conn->out_queue, list) {
+        list_del(&b->list);
+        free_outbuf(b);
+    }
+    conn->out_bytes = 0;
+}
+
+static void free_sending_bufs(lcs_sending_t *s)
+{
+    lcs_outbuf_t *b, *n;
+
+    list_for_each_entry_safe(b, n, &s->bufs, list) {
+        list_del(&b->list);
+        free_outbuf(b);
+    }
+}
+
+/*
+ * sends still in flight keep their buffers until they complete: the
+ * socket is shut down so they fail fast, and the orphan frees itself
+ * on the last completion.
+ */
+static void release_sending(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    lcs_sending_t *s = conn->sending;
+
+    conn->sending = NULL;
+    if(s->nr_msgs) {
+        shutdown(conn->s, SHUT_RDWR);
+        s->conn = NULL;
+        list_add_tail(&s->list, &w->orphans);
+        return;
+    }
+
+    ev_io_cancel(w->event_context, &s->io);
+    free(s);
+}
+
+static void close_conn(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    ev_cancel_timer(w->event_context, &conn->timer);
+    if(w->completions) {
+        ev_io_cancel(w->event_context, &conn->recv_io);
+        ev_unpend_event(w->event_context, &conn->event);
+        list_del_init(&conn->starved);
+        if(conn->sending)
+            release_sending(w, conn);
+    } else {
+        ev_unregister_event(w->event_context, &conn->event);
+    }
+    close(conn->s);
+    free_out_queue(conn);
+    if(conn->in_buf) {
+        put_buf(conn->in_buf);
+        conn->in_buf = NULL;
+    }
+    free_conn(w, conn);
+    count_inc(&w->nr_closed, 1);
+}
+
+/* a connection handed to w that failed to register */
+static void drop_conn(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    if(w->completions) {
+        ev_io_cancel(w->event_context, &conn->recv_io);
+        ev_unpend_event(w->event_context, &conn->event);
+        list_del_init(&conn->starved);
+    }
+    close(conn->s);
+    free_out_queue(conn);
+    free_conn(w, conn);
+    count_inc(&w->nr_closed, 1);
+}
+
+static int set_conn_events(lcs_conn_t *conn, int events)
+{
+    if(conn->event.events == events)
+        return 0;
+
+    conn->event.events = events;
+    return ev_modify_event(conn->worker->event_context, &conn->event);
+}
+
+static void update_out_bytes(lcs_conn_t *conn, ssize_t delta)
+{
+    lcserver_t *server = conn->worker->server;
+
+    conn->out_bytes += delta;
+
+    if(!(conn->flags & LCS_CONN_WRITE_HIGH)) {
+        if(conn->out_bytes > server->out_high_wm) {
+            conn->flags |= LCS_CONN_WRITE_HIGH;
+            if(server->write_high)
+                server->write_high(conn);
+        }
+    } else if(conn->out_bytes <= server->out_low_wm) {
+        conn->flags &= ~LCS_CONN_WRITE_HIGH;
+        if(server->write_low)
+            server->write_low(conn);
+    }
+}
+
+/*
+ * write as much of the output queue as the socket takes with one
+ * sendmsg(). return 0 when the queue is empty, 1 if the socket is full,
+ * -1 on error.
+ */
+static int flush_out_queue(lcs_conn_t *conn)
+{
+    struct iovec iov[LCS_OUT_IOV_MAX];
+    struct msghdr msg;
+    lcs_outbuf_t *b, *n;
+    ssize_t ret;
+    size_t sent;
+    int cnt;
+
+    while(!list_empty(&conn->out_queue)) {
+        cnt = 0;
+        list_for_each_entry(b, &conn->out_queue, list) {
+            iov[cnt].iov_base = b->base + b->start;
+            iov[cnt].iov_len = b->end - b->start;
+            if(++cnt == LCS_OUT_IOV_MAX)
+                break;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        ret = sendmsg(conn->s, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        conn->worker->stats.writes++;
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        sent = ret;
+        conn->worker->stats.bytes_out += ret;
+        list_for_each_entry_safe(b, n, &conn->out_queue, list) {
+            if(sent < b->end - b->start) {
+                b->start += sent;
+                break;
+            }
+
+            sent -= b->end - b->start;
+            list_del(&b->list);
+            free_outbuf(b);
+        }
+        update_out_bytes(conn, -ret);
+    }
+
+    return 0;
+}
+
+static void send_complete_callback(ev_io_t *io);
+
+/*
+ * completion mode: send out_queue by one chain of linked sendmsg
+ * operations, unless one is still in flight. its last completion
+ * submits what was queued meanwhile.
+ */
+static int submit_out_queue(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    lcs_sending_t *s = conn->sending;
+    struct msghdr *msg = NULL;
+    lcs_outbuf_t *b, *n;
+    int cnt = 0;
+
+    if(list_empty(&conn->out_queue) || (s && s->nr_msgs))
+        return 0;
+
+    if(!s) {
+        s = malloc(sizeof(lcs_sending_t));
+        if(!s) {
+            syslog(LOG_ERR, "no enough memory for output queue");
+            return -1;
+        }
+        memset(&s->io, 0, sizeof(s->io));
+        s->io.fd = conn->s;
+        s->io.callback = send_complete_callback;
+        s->io.lat_type = LCS_LAT_CONN;
+        s->worker = w;
+        s->conn = conn;
+        INIT_LIST_HEAD(&s->bufs);
+        conn->sending = s;
+    }
+
+    s->nr_msgs = 0;
+    s->bytes = 0;
+    s->failed = false;
+    list_for_each_entry_safe(b, n, &conn->out_queue, list) {
+        if(cnt % LCS_OUT_IOV_MAX == 0) {
+            if(s->nr_msgs == LCS_SEND_CHAIN)
+                break;
+            msg = &s->msgs[s->nr_msgs++];
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_iov = &s->iov[cnt];
+        }
+
+        s->iov[cnt].iov_base = b->base + b->start;
+        s->iov[cnt].iov_len = b->end - b->start;
+        s->bytes += b->end - b->start;
+        msg->msg_iovlen++;
+        cnt++;
+        list_move_tail(&b->list, &s->bufs);
+    }
+
+    if(ev_io_sendmsg(w->event_context, &s->io, s->msgs, s->nr_msgs) != 0) {
+        syslog(LOG_ERR, "ev_io_sendmsg failed: %d", errno);
+        list_splice_init(&s->bufs, &conn->out_queue);
+        s->nr_msgs = 0;
+        return -1;
+    }
+    w->stats.writes += s->nr_msgs;
+
+    return 0;
+}
+
+/* a failed send fails the rest of the chain and closes the connection */
+static void send_complete_callback(ev_io_t *io)
+{
+    lcs_sending_t *s = container_of(io, lcs_sending_t, io);
+    lcs_worker_t *w = s->worker;
+    lcs_conn_t *conn = s->conn;
+
+    if(io->res < 0)
+        s->failed = true;
+    if(--s->nr_msgs > 0)
+        return;
+
+    free_sending_bufs(s);
+    if(!conn) {
+        list_del(&s->list);
+        ev_io_cancel(w->event_context, io);
+        free(s);
+        return;
+    }
+
+    if(s->failed) {
+        close_conn(w, conn);
+        return;
+    }
+
+    w->stats.bytes_out += s->bytes;
+    update_out_bytes(conn, -(ssize_t)s->bytes);
+
+    if(!list_empty(&conn->out_queue)) {
+        if(submit_out_queue(w, conn) != 0)
+            close_conn(w, conn);
+    } else if(w->server->drain) {
+        w->server->drain(conn);
+    }
+}
+
+/* pended by lcs_conn_send*() in completion mode, runs once per round */
+static void conn_flush_callback(ev_event_t *event)
+{
+    lcs_conn_t *conn = (lcs_conn_t *)event;
+
+    if(submit_out_queue(conn->worker, conn) != 0)
+        close_conn(conn->worker, conn);
+}
+
+/* nothing queued or in flight, the socket may be written directly */
+static inline bool conn_out_idle(lcs_conn_t *conn)
+{
+    return list_empty(&conn->out_queue) && (!conn->sending || !conn->sending->nr_msgs);
+}
+
+/* have the loop write what was queued */
+static int conn_out_queued(lcs_conn_t *conn)
+{
+    lcs_worker_t *w = conn->worker;
+
+    if(w->completions) {
+        ev_pend_event(w->event_context, &conn->event, EV_WRITE_EVENT);
+        return 0;
+    }
+
+    return set_conn_events(conn, w->server->conn_events | EV_WRITE_EVENT);
+}
+
+/* append to the tail buffer if it has room, allocate a new one else */
+static int queue_out_data(lcs_conn_t *conn, const char *data, size_t len)
+{
+    lcs_outbuf_t *b = NULL;
+    size_t room, size;
+
+    if(!list_empty(&conn->out_queue)) {
+        b = list_entry(conn->out_queue.prev, lcs_outbuf_t, list);
+        room = b->size - b->end;
+        if(room > len)
+            room = len;
+
+        memcpy(b->base + b->end, data, room);
+        b->end += room;
+        data += room;
+        len -= room;
+        update_out_bytes(conn, room);
+    }
+
+    if(len == 0)
+        return 0;
+
+    size = len > LCS_OUTBUF_SIZE ? len : LCS_OUTBUF_SIZE;
+    b = malloc(sizeof(lcs_outbuf_t) + size);
+    if(!b)
+        return -1;
+
+    b->size = size;
+    b->start = 0;
+    b->end = len;
+    b->base = b->data;
+    b->ref = NULL;
+    memcpy(b->data, data, len);
+    list_add_tail(&b->list, &conn->out_queue);
+    update_out_bytes(conn, len);
+
+    return 0;
+}
+
+int lcs_conn_send(lcs_conn_t *conn, const void *data, size_t len)
+{
+    ssize_t ret = 0;
+
+    conn->last_active_ms = ev_loop_msec(conn->worker->event_context);
+
+    /* nothing queued, try the socket directly first */
+    if(conn_out_idle(conn)) {
+        do {
+            ret = send(conn->s, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            conn->worker->stats.writes++;
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            ret = 0;
+        }
+        conn->worker->stats.bytes_out += ret;
+
+        if((size_t)ret == len)
+            return 0;
+    }
+
+    if(queue_out_data(conn, (const char *)data + ret, len - ret) != 0) {
+        syslog(LOG_ERR, "no enough memory for output queue");
+        return -1;
+    }
+
+    return conn_out_queued(conn);
+}
+
+int lcs_conn_send_slice(lcs_conn_t *conn, const lcs_slice_t *slice)
+{
+    lcs_outbuf_t *b;
+    ssize_t ret = 0;
+
+    conn->last_active_ms = ev_loop_msec(conn->worker->event_context);
+
+    if(conn_out_idle(conn)) {
+        do {
+            ret = send(conn->s, slice->data, slice->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            conn->worker->stats.writes++;
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            ret = 0;
+        }
+        conn->worker->stats.bytes_out += ret;
+
+        if((size_t)ret == slice->len)
+            return 0;
+    }
+
+    /* queue a reference to the rest instead of copying it */
+    b = malloc(sizeof(lcs_outbuf_t));
+    if(!b) {
+        syslog(LOG_ERR, "no enough memory for output queue");
+        return -1;
+    }
+
+    slice->buf->refcnt++;
+    b->ref = slice->buf;
+    b->base = slice->data;
+    b->start = ret;
+    b->end = slice->len;
+    b->size = b->end;   // never appended to
+    list_add_tail(&b->list, &conn->out_queue);
+    update_out_bytes(conn, slice->len - ret);
+
+    return conn_out_queued(conn);
+}
+
+/*
+ * make room at the tail once less than need bytes are left there, keep
+ * the buffer if nobody else refers it.
+ */
+static int compact_in_buf(lcs_worker_t *w, lcs_conn_t *conn, uint32_t need)
+{
+    lcs_buf_t *buf = conn->in_buf;
+    lcs_buf_t *nbuf;
+    uint32_t len;
+
+    if(conn->in_start == 0 || buf->size - conn->in_end >= need)
+        return 0;
+
+    len = conn->in_end - conn->in_start;
+    if(buf->refcnt == 1) {
+        memmove(buf->data, buf->data + conn->in_start, len);
+    } else {
+        nbuf = get_buf(w);
+        if(!nbuf) {
+            syslog(LOG_ERR, "worker %d runs out of input buffers", w->worker_id);
+            return -1;
+        }
+        memcpy(nbuf->data, buf->data + conn->in_start, len);
+        put_buf(buf);
+        conn->in_buf = nbuf;
+    }
+    conn->in_start = 0;
+    conn->in_end = len;
+
+    return 0;
+}
+
+/*
+ * hand the unconsumed input to the data callback, give the buffer back
+ * once everything is consumed. false to close the connection.
+ */
+static bool conn_deliver(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    lcs_buf_t *buf = conn->in_buf;
+    lcs_slice_t slice;
+    bool ok;
+
+    slice.buf = buf;
+    slice.data = buf->data + conn->in_start;
+    slice.len = conn->in_end - conn->in_start;
+
+    ok = w->server->data(conn, &slice);
+
+    conn->in_start = slice.data - buf->data;
+    if(conn->in_start == conn->in_end) {
+        put_buf(buf);
+        conn->in_buf = NULL;
+    }
+
+    return ok;
+}
+
+/*
+ * read once into the connection's input buffer and hand the unconsumed
+ * bytes to the data callback. the buffer is taken from the worker's
+ * buf_pool on demand and given back as soon as everything is consumed,
+ * so idle connections hold no buffer.
+ *
+ * return -1 to close the connection, 0 if the socket is drained, 1 if
+ * it may have more data. *nread is the number of bytes read.
+ */
+static int conn_read_once(lcs_worker_t *w, lcs_conn_t *conn, size_t *nread)
+{
+    lcs_buf_t *buf = conn->in_buf;
+    uint32_t room;
+    ssize_t ret;
+
+    *nread = 0;
+    if(!buf) {
+        buf = get_buf(w);
+        if(!buf) {
+            syslog(LOG_ERR, "worker %d runs out of input buffers", w->worker_id);
+            return -1;
+        }
+        conn->in_buf = buf;
+        conn->in_start = conn->in_end = 0;
+    }
+
+    if(compact_in_buf(w, conn, buf->size / 4) != 0)
+        return -1;
+    buf = conn->in_buf;
+
+    if(conn->in_end == buf->size) {
+        syslog(LOG_ERR, "message exceeds input buffer size %u", buf->size);
+        return -1;
+    }
+
+    room = buf->size - conn->in_end;
+    do {
+        ret = recv(conn->s, buf->data + conn->in_end, room, MSG_DONTWAIT);
+        w->stats.reads++;
+    } while(ret < 0 && errno == EINTR);
+
+    if(ret == 0)
+        return -1;
+    if(ret < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+        /* nothing came and nothing is left, do not keep the buffer */
+        if(conn->in_start == conn->in_end) {
+            put_buf(buf);
+            conn->in_buf = NULL;
+        }
+        return 0;
+    }
+
+    *nread = ret;
+    w->stats.bytes_in += ret;
+    conn->in_end += ret;
+
+    if(!conn_deliver(w, conn))
+        return -1;
+
+    /* a short read means the socket queue is empty for now */
+    return (uint32_t)ret < room ? 0 : 1;
+}
+
+/*
+ * level triggered connections read once per wakeup. edge triggered ones
+ * read until the socket is drained, but at most read_budget_iters times
+ * or read_budget_bytes bytes per round. a connection with data left is
+ * pended on the loop and continues after the other ready events, so one
+ * flooding peer cannot starve the rest.
+ */
+static bool conn_read_data(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    lcserver_t *server = w->server;
+    uint32_t iters = 0;
+    size_t bytes = 0, n;
+    int ret;
+
+    if(!server->edge_triggered)
+        return conn_read_once(w, conn, &n) >= 0;
+
+    do {
+        ret = conn_read_once(w, conn, &n);
+        if(ret < 0)
+            return false;
+        bytes += n;
+    } while(ret > 0 && ++iters < server->read_budget_iters &&
+            bytes < server->read_budget_bytes);
+
+    if(ret > 0)
+        ev_pend_event(w->event_context, &conn->event, EV_READ_EVENT);
+
+    return true;
+}
+
+/* lend a fresh input buffer to the kernel under bid, or park bid */
+static void ring_refill_bid(lcs_worker_t *w, uint32_t bid)
+{
+    lcs_buf_t *buf = get_buf(w);
+
+    w->ring_bufs[bid] = buf;
+    if(!buf) {
+        w->empty_bids[w->nr_empty_bids++] = bid;
+        return;
+    }
+
+    ev_io_provide(w->event_context, bid, buf->data, buf->size);
+}
+
+/* parked bids get buffers again as buf_pool has some */
+static void ring_refill(lcs_worker_t *w)
+{
+    lcs_buf_t *buf;
+    uint32_t bid;
+
+    while(w->nr_empty_bids) {
+        buf = get_buf(w);
+        if(!buf)
+            return;
+
+        bid = w->empty_bids[--w->nr_empty_bids];
+        w->ring_bufs[bid] = buf;
+        ev_io_provide(w->event_context, bid, buf->data, buf->size);
+    }
+}
+
+/*
+ * the kernel received len bytes into the ring buffer of bid, hand them
+ * to the data callback. unconsumed input is topped up from it, what is
+ * left once nothing is pending stays in the ring buffer: the connection
+ * takes it as its input buffer and bid gets a fresh one. false to close
+ * the connection.
+ */
+static bool conn_recv_buf(lcs_worker_t *w, lcs_conn_t *conn, int bid, uint32_t len)
+{
+    lcs_buf_t *buf = w->ring_bufs[bid];
+    lcs_buf_t *in;
+    uint32_t off = 0, n;
+
+    while((in = conn->in_buf) != NULL) {
+        /*
+         * no room in an input buffer still referred by slices: move its
+         * partial message in front of the received data rather than
+         * into a new buffer, which queued output may have used up.
+         */
+        n = conn->in_end - conn->in_start;
+        if(in->refcnt > 1 && in->size - conn->in_end < len - off &&
+                n + len - off <= buf->size) {
+            memmove(buf->data + n, buf->data + off, len - off);
+            memcpy(buf->data, in->data + conn->in_start, n);
+            put_buf(in);
+            conn->in_buf = NULL;
+            len = n + len - off;
+            off = 0;
+            break;
+        }
+
+        if(compact_in_buf(w, conn, len - off) != 0)
+            goto failed;
+
+        n = conn->in_buf->size - conn->in_end;
+        if(n == 0) {
+            syslog(LOG_ERR, "message exceeds input buffer size %u", buf->size);
+            goto failed;
+        }
+        if(n > len - off)
+            n = len - off;
+
+        memcpy(conn->in_buf->data + conn->in_end, buf->data + off, n);
+        conn->in_end += n;
+        off += n;
+
+        if(off == len) {
+            ev_io_provide(w->event_context, bid, buf->data, buf->size);
+            return conn_deliver(w, conn);
+        }
+        if(!conn_deliver(w, conn))
+            goto failed;
+    }
+
+    conn->in_buf = buf;
+    conn->in_start = off;
+    conn->in_end = len;
+    ring_refill_bid(w, bid);
+    return conn_deliver(w, conn);
+
+failed:
+    ev_io_provide(w->event_context, bid, buf->data, buf->size);
+    return false;
+}
+
+/*
+ * the input buffers are held by unconsumed input and queued output,
+ * they come back as the peers read. restart the starved recvs once the
+ * ring has some again, meanwhile the socket buffers fill up and the
+ * peers are throttled by tcp.
+ */
+static void ring_timer_callback(ev_timer_t *timer)
+{
+    lcs_worker_t *w = (lcs_worker_t *)timer->data;
+    lcs_conn_t *conn, *n;
+
+    ring_refill(w);
+    if(w->nr_empty_bids == w->nr_ring_bufs) {
+        ev_start_timer(w->event_context, timer);
+        return;
+    }
+
+    list_for_each_entry_safe(conn, n, &w->starved, starved) {
+        list_del_init(&conn->starved);
+        if(ev_io_recv(w->event_context, &conn->recv_io) != 0)
+            close_conn(w, conn);
+    }
+}
+
+/*
+ * completion mode: one completion per chunk the multishot recv took
+ * off the socket. it stops when the ring runs empty or the kernel ends
+ * it, and is started again, by ring_timer if no buffer is left at all.
+ */
+static void conn_recv_callback(ev_io_t *io)
+{
+    lcs_conn_t *conn = container_of(io, lcs_conn_t, recv_io);
+    lcs_worker_t *w = conn->worker;
+
+    conn->last_active_ms = ev_loop_msec(w->event_context);
+    conn->last_read_ms = conn->last_active_ms;
+    if(w->nr_empty_bids)
+        ring_refill(w);
+
+    if(io->res == -ENOBUFS) {
+        w->stats.ring_empty++;
+        if(io->more)
+            return;
+
+        if(w->nr_empty_bids == w->nr_ring_bufs) {
+            list_add_tail(&conn->starved, &w->starved);
+            if(!ev_timer_pending(&w->ring_timer))
+                ev_start_timer(w->event_context, &w->ring_timer);
+        } else if(ev_io_recv(w->event_context, io) != 0) {
+            close_conn(w, conn);
+        }
+        return;
+    }
+
+    /* eof or error */
+    if(io->res <= 0 || io->bid < 0) {
+        close_conn(w, conn);
+        return;
+    }
+
+    w->stats.reads++;
+    w->stats.bytes_in += io->res;
+    if(!conn_recv_buf(w, conn, io->bid, io->res)) {
+        close_conn(w, conn);
+        return;
+    }
+
+    if(!io->more && ev_io_recv(w->event_context, io) != 0)
+        close_conn(w, conn);
+}
+
+static void conn_event_callback(ev_event_t *event)
+{
+    lcs_conn_t *conn = (lcs_conn_t *)event;
+    lcs_worker_t *worker = conn->worker;
+    lcserver_t *server = worker->server;
+    int ret;
+    bool ok;
+
+    conn->last_active_ms = ev_loop_msec(worker->event_context);
+    if(event->revents & EV_READ_EVENT)
+        conn->last_read_ms = conn->last_active_ms;
+
+    if((event->revents & EV_WRITE_EVENT) && !list_empty(&conn->out_queue)) {
+        ret = flush_out_queue(conn);
+        if(ret < 0) {
+            close_conn(worker, conn);
+            return;
+        }
+
+        if(ret == 0) {
+            if(set_conn_events(conn, server->conn_events) != 0) {
+                close_conn(worker, conn);
+                return;
+            }
+            if(server->drain)
+                server->drain(conn);
+        }
+    }
+
+    if(event->revents & (EV_READ_EVENT | EPOLLERR | EPOLLHUP)) {
+        if(server->data)
+            ok = conn_read_data(worker, conn);
+        else
+            ok = server->read(conn);
+
+        if(!ok)
+            close_conn(worker, conn);
+    }
+}
+
+/* the earliest of the enabled timeouts */
+static uint64_t conn_deadline(lcserver_t *server, lcs_conn_t *conn)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    if(server->idle_timeout_ms)
+        deadline = conn->last_active_ms + server->idle_timeout_ms;
+    if(server->read_timeout_ms && conn->last_read_ms + server->read_timeout_ms < deadline)
+        deadline = conn->last_read_ms + server->read_timeout_ms;
+
+    return deadline;
+}
+
+/*
+ * the timer is armed for the deadline at the time it was started, any
+ * activity since then only moved the deadline later. re-arm for what is
+ * left, or close. expired connections of one tick go in one wheel batch.
+ */
+static void conn_timeout_callback(ev_timer_t *timer)
+{
+    lcs_conn_t *conn = (lcs_conn_t *)timer->data;
+    lcs_worker_t *w = conn->worker;
+    lcserver_t *server = w->server;
+    uint64_t now = ev_loop_msec(w->event_context);
+    uint64_t deadline = conn_deadline(server, conn);
+
+    if(now < deadline) {
+        timer->msec = deadline - now;
+        ev_start_timer(w->event_context, timer);
+        return;
+    }
+
+    if(server->idle_timeout_ms && now >= conn->last_active_ms + server->idle_timeout_ms)
+        w->stats.idle_timeouts++;
+    else
+        w->stats.read_timeouts++;
+
+    if(server->timeout)
+        server->timeout(conn);
+    close_conn(w, conn);
+}
+
+static int register_conn(lcs_worker_t *w, lcs_conn_t *conn)
+{
+    lcserver_t *server = w->server;
+    uint64_t now = ev_loop_msec(w->event_context);
+
+    __atomic_store_n(&conn->worker, w, __ATOMIC_RELEASE);
+    conn->event.fd = conn->s;
+    conn->event.events = w->server->conn_events;
+    conn->event.callback = w->completions ? conn_flush_callback : conn_event_callback;
+    conn->event.lat_type = LCS_LAT_CONN;
+    INIT_LIST_HEAD(&conn->event.pending);
+
+    memset(&conn->recv_io, 0, sizeof(conn->recv_io));
+    conn->recv_io.fd = conn->s;
+    conn->recv_io.callback = conn_recv_callback;
+    conn->recv_io.lat_type = LCS_LAT_CONN;
+    conn->sending = NULL;
+    INIT_LIST_HEAD(&conn->starved);
+
+    INIT_LIST_HEAD(&conn->out_queue);
+    conn->out_bytes = 0;
+    conn->flags = 0;
+    conn->in_buf = NULL;
+
+    ev_init_timer(&conn->timer, 0, conn_timeout_callback);
+    conn->timer.data = conn;
+    conn->last_active_ms = conn->last_read_ms = now;
+
+    /* best effort, above net.core.busy_read it needs CAP_NET_ADMIN */
+    if(server->cfg.busy_poll_us)
+        set_sockopt_busy_poll(conn->s, server->cfg.busy_poll_us);
+
+    if(w->server->setup && !w->server->setup(conn))
+        return -1;
+
+    if(w->completions) {
+        if(ev_io_recv(w->event_context, &conn->recv_io) != 0) {
+            syslog(LOG_ERR, "ev_io_recv failed: %d", errno);
+            return -1;
+        }
+    } else if(ev_register_event(w->event_context, &conn->event) != 0) {
+        syslog(LOG_ERR, "ev_register_event failed: %d", errno);
+        return -1;
+    }
+    conn->flags |= LCS_CONN_REGISTERED;
+
+    if(server->idle_timeout_ms || server->read_timeout_ms) {
+        conn->timer.msec = conn_deadline(server, conn) - now;
+        ev_start_timer(w->event_context, &conn->timer);
+    }
+
+    return 0;
+}
+
+lcs_handle_t lcs_conn_handle(lcs_conn_t *conn)
+{
+    return (uint64_t)conn->gen << 32 |
+        pool_obj_index(conn->worker->server->conn_pool, conn);
+}
+
+lcs_conn_t *lcs_handle_conn(lcserver_t *server, lcs_handle_t h)
+{
+    lcs_conn_t *conn = pool_index_obj(server->conn_pool, (uint32_t)h);
+
+    if(!conn || __atomic_load_n(&conn->gen, __ATOMIC_ACQUIRE) != h >> 32)
+        return NULL;
+    if(!(conn->flags & LCS_CONN_REGISTERED))
+        return NULL;
+
+    return conn;
+}
+
+/* a posted task, runs in the thread of m->worker */
+static void deliver_mail(void *arg)
+{
+    lcs_mail_t *m = arg;
+    lcs_worker_t *w = m->worker;
+    lcs_conn_t *conn = pool_index_obj(w->server->conn_pool, (uint32_t)m->handle);
+
+    /* the connection may have been closed, or belong to another worker now */
+    if(__atomic_load_n(&conn->worker, __ATOMIC_ACQUIRE) != w ||
+            !(conn = lcs_handle_conn(w->server, m->handle))) {
+        w->stats.handle_stale++;
+        free(m);
+        return;
+    }
+
+    w->stats.handle_sends++;
+    if(lcs_conn_send(conn, m->data, m->len) != 0)
+        close_conn(w, conn);
+    free(m);
+}
+
+/*
+ * the worker is read before the generation: a worker stored for a later
+ * connection is published after that connection's generation, so the
+ * generation check then fails. a stale worker that passes is caught by
+ * the owner check when the mail is delivered.
+ */
+int lcs_send_by_handle(lcserver_t *server, lcs_handle_t h, const void *data, size_t len)
+{
+    lcs_conn_t *conn = pool_index_obj(server->conn_pool, (uint32_t)h);
+    lcs_worker_t *w;
+    lcs_mail_t *m;
+
+    if(!conn)
+        return -1;
+
+    w = __atomic_load_n(&conn->worker, __ATOMIC_ACQUIRE);
+    if(!w || __atomic_load_n(&conn->gen, __ATOMIC_ACQUIRE) != h >> 32)
+        return -1;
+
+    m = malloc(sizeof(lcs_mail_t) + len);
+    if(!m) {
+        syslog(LOG_ERR, "no enough memory for handle send");
+        return -1;
+    }
+    m->worker = w;
+    m->handle = h;
+    m->len = len;
+    memcpy(m->data, data, len);
+
+    if(ev_post(w->event_context, deliver_mail, m) != 0) {
+        free(m);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a posted task, runs in the thread of conn->worker */
+static void handoff_conn(void *arg)
+{
+    lcs_conn_t *conn = arg;
+
+    if(register_conn(conn->worker, conn) != 0)
+        drop_conn(conn->worker, conn);
+}
+
+/*
+ * the master never touches a slave's epoll instance, accepted connections
+ * are staged per slave and posted to its loop in batches, one wakeup per
+ * batch. the slave registers them in its own thread.
+ */
+static void flush_handoff(lcserver_t *server, lcs_handoff_t *staged, int idx)
+{
+    lcs_handoff_t *h = &staged[idx];
+    lcs_worker_t *w = &server->slave[idx];
+    ev_post_t tasks[LCS_HANDOFF_BATCH];
+    int n, i;
+
+    if(h->count == 0)
+        return;
+
+    for(i = 0; i < h->count; i++) {
+        tasks[i].fn = handoff_conn;
+        tasks[i].arg = h->conns[i];
+    }
+
+    n = ev_post_bulk(w->event_context, tasks, h->count);
+    for(i = n; i < h->count; i++) {
+        syslog(LOG_ERR, "post queue of worker %d is full", idx);
+        close(h->conns[i]->s);
+        free_conn(&server->master, h->conns[i]);
+        count_inc(&w->nr_assigned, -1);
+    }
+    h->count = 0;
+}
+
+/* splitmix64 finalizer */
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+ * Lamping & Veach jump consistent hash: growing the number of buckets
+ * from n to n + 1 only moves 1 / (n + 1) of the keys.
+ */
+static int jump_consistent_hash(uint64_t key, int buckets)
+{
+    int64_t b = -1, j = 0;
+
+    while(j < buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+
+    return b;
+}
+
+static int least_conn_slave(lcserver_t *server)
+{
+    uint64_t active, best_active = UINT64_MAX;
+    int i, best = 0;
+
+    for(i = 0; i < server->slave_num; i++) {
+        active = lcs_worker_active_conns(&server->slave[i]);
+        if(active < best_active) {
+            best_active = active;
+            best = i;
+        }
+    }
+
+    return best;
+}
 
+/* lags closer than LCS_LAG_QUANTUM_US count as equal, it's mostly jitter */
+static int least_latency_slave(lcserver_t *server)
+{
+    uint64_t active, best_active = UINT64_MAX;
+    uint32_t lag, best_lag = UINT32_MAX;
+    int i, best = 0;
 
-#define LCS_INVALID_IDX     -1
+    for(i = 0; i < server->slave_num; i++) {
+        lag = lcs_worker_loop_lag(&server->slave[i]) / LCS_LAG_QUANTUM_US;
+        active = lcs_worker_active_conns(&server->slave[i]);
+        if(lag < best_lag || (lag == best_lag && active < best_active)) {
+            best_lag = lag;
+            best_active = active;
+            best = i;
+        }
+    }
+
+    return best;
+}
 
-static inline lcs_conn_t *get_conn(lcserver_t *server)
+/* the less loaded of two distinct random slaves */
+static int p2c_slave(lcserver_t *server)
 {
-    lcs_conn_t *conn;
+    uint64_t r = mix64(server->dispatch_seed++);
+    int a, b;
 
-    pthread_spin_lock(&server->conn_pool_lock);
+    if(server->slave_num == 1)
+        return 0;
 
-    conn = (lcs_conn_t *) pool_alloc_obj(server->conn_pool);
+    a = (uint32_t)r % server->slave_num;
+    b = (uint32_t)(r >> 32) % (server->slave_num - 1);
+    if(b >= a)
+        b++;
 
-    pthread_spin_unlock(&server->conn_pool_lock);
+    return lcs_worker_active_conns(&server->slave[b]) <
+        lcs_worker_active_conns(&server->slave[a]) ? b : a;
+}
 
-    return conn;
+/* runs in the master thread only */
+static int dispatch_conn(lcserver_t *server, lcs_conn_t *conn)
+{
+    int idx;
+
+    if(server->dispatch_cb) {
+        idx = server->dispatch_cb(server, conn);
+        if(idx >= 0 && idx < server->slave_num)
+            return idx;
+        syslog(LOG_ERR, "dispatch returned invalid worker %d", idx);
+    }
+
+    switch(server->dispatch) {
+    case LCS_DISPATCH_LEAST_CONN:
+        return least_conn_slave(server);
+    case LCS_DISPATCH_LEAST_LATENCY:
+        return least_latency_slave(server);
+    case LCS_DISPATCH_P2C:
+        return p2c_slave(server);
+    case LCS_DISPATCH_HASH:
+        return jump_consistent_hash(mix64((uint64_t)conn->peer_ip << 16 | conn->peer_port),
+                server->slave_num);
+    case LCS_DISPATCH_HASH_IP:
+        return jump_consistent_hash(mix64(conn->peer_ip), server->slave_num);
+    case LCS_DISPATCH_RR:
+    default:
+        idx = server->next_slave;
+        if(++server->next_slave == server->slave_num)
+            server->next_slave = 0;
+        return idx;
+    }
 }
 
-static inline void free_conn(lcserver_t *server, lcs_conn_t *conn)
+static void assign_conn_to_worker(lcserver_t *server, lcs_handoff_t *staged,
+        lcs_conn_t *conn)
 {
-    pthread_spin_lock(&server->conn_pool_lock);
+    lcs_handoff_t *h;
 
-    conn->idx = LCS_INVALID_IDX;
-    pool_free_obj(server->conn_pool, conn);
+    /* the accept callback may have picked one */
+    if(conn->idx < 0 || conn->idx >= server->slave_num)
+        conn->idx = dispatch_conn(server, conn);
+    __atomic_store_n(&conn->worker, &server->slave[conn->idx], __ATOMIC_RELEASE);
+
+    count_inc(&server->slave[conn->idx].nr_assigned, 1);
 
-    pthread_spin_unlock(&server->conn_pool_lock);
+    h = &staged[conn->idx];
+    h->conns[h->count++] = conn;
+    if(h->count == LCS_HANDOFF_BATCH)
+        flush_handoff(server, staged, conn->idx);
 }
 
-static void conn_read_callback(ev_event_t *event)
+/* poll the listener, or arm its multishot accept in completion mode */
+static int resume_listen(lcs_worker_t *w)
 {
-    lcs_conn_t *conn = (lcs_conn_t *)event;
-    lcs_worker_t *worker = conn->worker;
-    lcserver_t *server = worker->server;
+    if(ev_has_completions(w->event_context))
+        return ev_io_accept(w->event_context, &w->accept_io);
+
+    return ev_register_event(w->event_context, &w->listen_event);
+}
+
+static void accept_resume_callback(ev_timer_t *timer)
+{
+    lcs_worker_t *w = (lcs_worker_t *)timer->data;
 
-    if(!server->read(conn)) {
-        ev_unregister_event(worker->event_context, event);
-        close(conn->s);
-        free_conn(server, conn);
+    if(resume_listen(w) != 0) {
+        syslog(LOG_ERR, "resume listener failed: %d", errno);
+        ev_start_timer(w->event_context, timer);
     }
 }
 
-static void assign_conn_to_worker(lcserver_t *server, lcs_conn_t *conn)
+/* stop polling the listener until fds may have been closed meanwhile */
+static void pause_listen(lcs_worker_t *w, int err)
 {
-    lcs_worker_t *w;
-    bool selected_by_user = false;
+    uint64_t now = ev_loop_msec(w->event_context);
 
-    if(conn->idx >= 0) {
-        selected_by_user = true;
-    } else {
-        /* default RR policy */
-        conn->idx = server->next_slave;
+    w->stats.accept_backoffs++;
+    if(!w->accept_log_ms || now - w->accept_log_ms >= LCS_ACCEPT_LOG_MS) {
+        syslog(LOG_ERR, "accept failed: %d, listener paused %d ms, %lu pauses",
+                err, LCS_ACCEPT_BACKOFF_MS, (unsigned long)w->stats.accept_backoffs);
+        w->accept_log_ms = now;
     }
 
-    w = &server->slave[conn->idx];
+    if(ev_has_completions(w->event_context))
+        ev_io_cancel(w->event_context, &w->accept_io);
+    else
+        ev_unregister_event(w->event_context, &w->listen_event);
+    ev_start_timer(w->event_context, &w->accept_timer);
+}
 
-    conn->event.fd = conn->s;
-    conn->event.events = EV_READ_EVENT;
-    conn->event.callback = conn_read_callback;
+/*
+ * a connection for the accepted socket sockfd from peer addr, run
+ * through the user accept callback. NULL if it is refused.
+ */
+static lcs_conn_t *new_conn(lcs_worker_t *w, socket_t sockfd, struct sockaddr_in *addr)
+{
+    lcserver_t *server = w->server;
+    lcs_conn_t *conn;
 
-    if(ev_register_event(w->event_context, &conn->event) != 0) {
-        syslog(LOG_ERR, "ev_register_event failed: %d", errno);
-        close(conn->s);
-        free_conn(server, conn);
+    w->stats.accepted++;
+
+    conn = get_conn(w);
+    if(!conn) {
+        syslog(LOG_ERR,  "up to max connections");
+        close(sockfd);
+        w->stats.refused++;
+        return NULL;
     }
+    conn->peer_ip = addr->sin_addr.s_addr;
+    conn->peer_port = addr->sin_port;
+    conn->s = sockfd;
+    conn->idx = LCS_INVALID_IDX;
+    __atomic_store_n(&conn->worker, NULL, __ATOMIC_RELAXED);
 
-    /* trans to next worker only on success */
-    if(!selected_by_user)
-        if(++server->next_slave == server->slave_num)
-            server->next_slave = 0;
+    if(!server->accept(conn)) {
+        close(sockfd);
+        free_conn(w, conn);
+        w->stats.refused++;
+        return NULL;
+    }
+
+    return conn;
 }
 
-static void *master_worker_thread(void *arg)
+/*
+ * accept one connection from listenfd and run the user accept callback.
+ * return -1 when the backlog is empty (or accept fails), 0 otherwise,
+ * *pconn is NULL if the connection is refused.
+ */
+static int accept_conn(lcs_worker_t *w, socket_t listenfd, lcs_conn_t **pconn)
 {
     struct sockaddr_in cliaddr;
+    socklen_t socklen = sizeof(cliaddr);
     socket_t sockfd;
-    socklen_t socklen;
-    int     ret;
-    fd_set  set;
-    struct timeval select_timeout;
-    lcs_conn_t *conn;
 
-    lcs_worker_t *worker = (lcs_worker_t *)arg;
+    *pconn = NULL;
+    sockfd = accept4(listenfd, (struct sockaddr *)&cliaddr, &socklen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(sockfd == -1) {
+        if(errno == EINTR || errno == ECONNABORTED)
+            return 0;
+        if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            pause_listen(w, errno);
+        else if(errno != EAGAIN && errno != EWOULDBLOCK)
+            syslog(LOG_ERR, "accept4 failed: %d", errno);
+        return -1;
+    }
+
+    *pconn = new_conn(w, sockfd, &cliaddr);
+    return 0;
+}
+
+/*
+ * the master hands an accepted connection over to the slaves, a
+ * reuseport slave registers it in its own loop.
+ */
+static void take_conn(lcs_worker_t *worker, lcs_conn_t *conn)
+{
+    if(worker->worker_id == LCS_INVALID_IDX) {
+        assign_conn_to_worker(worker->server, worker->staged, conn);
+        return;
+    }
+
+    conn->idx = worker->worker_id;
+    count_inc(&worker->nr_assigned, 1);
+    if(register_conn(worker, conn) != 0)
+        drop_conn(worker, conn);
+}
+
+/* n connections were accepted in one go, push the staged ones */
+static void accept_batch_done(lcs_worker_t *worker, uint32_t n)
+{
     lcserver_t *server = worker->server;
-    socket_t listenfd = server->listen_sock;
+    int i;
+
+    if(worker->worker_id == LCS_INVALID_IDX) {
+        for(i = 0; i < server->slave_num; i++)
+            flush_handoff(server, worker->staged, i);
+    }
 
-    while(!server->stopped) {
-        socklen = sizeof(cliaddr);
+    worker->stats.accept_wakeups++;
+    if(n > worker->stats.accept_batch_max)
+        worker->stats.accept_batch_max = n;
+    if(n == server->accept_batch)
+        worker->stats.accept_batch_full++;
+}
 
-        // use select first, I will replace it with epoll later
-        FD_ZERO(&set);
-        FD_SET(listenfd, &set);
+/* drain up to accept_batch connections from the backlog per wakeup */
+static void listen_callback(ev_event_t *event)
+{
+    lcs_worker_t *worker = container_of(event, lcs_worker_t, listen_event);
+    lcs_conn_t *conn;
+    uint32_t n;
 
-        select_timeout.tv_sec = 1;
-        select_timeout.tv_usec = 0;
-        ret = select(listenfd + 1, &set, NULL, NULL, &select_timeout);
-        if(ret == -1) {
-            syslog(LOG_ERR, "select return error %d", errno);
+    for(n = 0; n < worker->server->accept_batch; n++) {
+        if(accept_conn(worker, worker->listen_sock, &conn) != 0)
             break;
-        }
-        if(ret == 0)
-            continue;
-
-        sockfd = accept(listenfd, (struct sockaddr *)&cliaddr, &socklen);
-        if(sockfd != -1) {
-            conn = get_conn(server);
-            if(!conn) {
-                syslog(LOG_ERR,  "up to max connections");
-                close(sockfd);
-                continue;
-            }
-            conn->peer_ip = cliaddr.sin_addr.s_addr;
-            conn->peer_port = cliaddr.sin_port;
-            conn->s = sockfd;
-            conn->idx = LCS_INVALID_IDX;
-
-            if(!server->accept(conn)) {
-                close(sockfd);
-                free_conn(server, conn);
-                continue;
-            }
+        if(conn)
+            take_conn(worker, conn);
+    }
+
+    accept_batch_done(worker, n);
+}
 
-            assign_conn_to_worker(server, conn);
+/*
+ * completion mode: every accepted socket completes on its own, without
+ * the peer address. listen_event is pended to push the handoffs of a
+ * loop round at once, after its completions.
+ */
+static void accept_io_callback(ev_io_t *io)
+{
+    lcs_worker_t *w = container_of(io, lcs_worker_t, accept_io);
+    struct sockaddr_in cliaddr;
+    socklen_t socklen = sizeof(cliaddr);
+    lcs_conn_t *conn;
+    int err = -io->res;
+
+    if(io->res >= 0) {
+        /* reset before its turn, like ECONNABORTED */
+        if(getpeername(io->res, (struct sockaddr *)&cliaddr, &socklen) != 0) {
+            close(io->res);
+        } else if((conn = new_conn(w, io->res, &cliaddr)) != NULL) {
+            take_conn(w, conn);
         }
+        w->accept_round++;
+        ev_pend_event(w->event_context, &w->listen_event, EV_READ_EVENT);
+    } else if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+        pause_listen(w, err);
+        return;
+    } else if(err != EINTR && err != ECONNABORTED && err != EAGAIN) {
+        syslog(LOG_ERR, "accept failed: %d", err);
     }
 
-    pthread_exit(NULL);
-    return NULL;
+    if(!io->more && ev_io_accept(w->event_context, io) != 0)
+        pause_listen(w, errno);
+}
+
+static void accept_round_callback(ev_event_t *event)
+{
+    lcs_worker_t *worker = container_of(event, lcs_worker_t, listen_event);
+
+    accept_batch_done(worker, worker->accept_round);
+    worker->accept_round = 0;
+}
+
+static int worker_create_listen(lcs_worker_t *w, int flags)
+{
+    lcserver_t *server = w->server;
+
+    w->listen_sock = sock_create_listen(server->port, server->ip,
+            server->backlog, flags | SOCK_LISTEN_NONBLOCK);
+    if(w->listen_sock == INVALID_SOCK)
+        return -1;
+
+    w->listen_event.fd = w->listen_sock;
+    w->listen_event.events = EV_READ_EVENT;
+    w->listen_event.callback = listen_callback;
+    w->listen_event.lat_type = LCS_LAT_LISTEN;
+
+    if(ev_has_completions(w->event_context)) {
+        INIT_LIST_HEAD(&w->listen_event.pending);
+        w->listen_event.callback = accept_round_callback;
+        w->accept_io.fd = w->listen_sock;
+        w->accept_io.callback = accept_io_callback;
+        w->accept_io.lat_type = LCS_LAT_LISTEN;
+    }
+
+    ev_init_timer(&w->accept_timer, LCS_ACCEPT_BACKOFF_MS, accept_resume_callback);
+    w->accept_timer.data = w;
+
+    if(resume_listen(w) != 0) {
+        close(w->listen_sock);
+        w->listen_sock = INVALID_SOCK;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * how late the periodic timer fires is the time ready events wait for
+ * the loop, kept as a moving average of 1/8 weight. lateness within one
+ * tick is only the timer granularity.
+ */
+static void load_timer_callback(ev_timer_t *timer)
+{
+    lcs_worker_t *w = (lcs_worker_t *)timer->data;
+    uint64_t now = ev_now_ns();
+    uint64_t due = (timer->abs_msec + EV_TIMER_RESOLUTION) * 1000000;
+    uint32_t lag = now > due ? (now - due) / 1000 : 0;
+    uint32_t avg = lcs_worker_loop_lag(w);
+
+    atomic_store_explicit(&w->loop_lag_us, avg - (avg >> 3) + (lag >> 3),
+            memory_order_relaxed);
+    ev_start_timer(w->event_context, timer);
+}
+
+/*
+ * completion mode needs a data callback and a backend able to run it.
+ * a quarter of the input buffers, up to LCS_RECV_RING_MAX, are lent to
+ * the kernel's buffer ring, readiness polling is kept if it cannot be
+ * set up.
+ */
+static int worker_init_ring(lcs_worker_t *w)
+{
+    lcserver_t *server = w->server;
+    uint32_t entries = 1, bid;
+
+    if(!server->data || !ev_has_completions(w->event_context) || server->in_buf_num < 4)
+        return 0;
+
+    while(entries * 2 <= server->in_buf_num / 4 && entries * 2 <= LCS_RECV_RING_MAX)
+        entries <<= 1;
+
+    w->ring_bufs = calloc(entries, sizeof(lcs_buf_t *));
+    w->empty_bids = malloc(entries * sizeof(uint32_t));
+    if(!w->ring_bufs || !w->empty_bids)
+        return -1;
+
+    if(ev_io_buffers(w->event_context, entries) != 0) {
+        syslog(LOG_WARNING, "io_uring buffer ring unavailable: %d", errno);
+        return 0;
+    }
+
+    w->nr_ring_bufs = entries;
+    for(bid = 0; bid < entries; bid++)
+        ring_refill_bid(w, bid);
+    ev_init_timer(&w->ring_timer, LCS_RING_RETRY_MS, ring_timer_callback);
+    w->ring_timer.data = w;
+    w->completions = true;
+
+    return 0;
+}
+
+/*
+ * runs in the worker's own thread, already pinned to w->cpu, so the
+ * first touch places everything the loop uses on the local node.
+ */
+static int worker_init(lcs_worker_t *w)
+{
+    lcserver_t *server = w->server;
+    const lcs_config_t *cfg = &server->cfg;
+
+    w->conn_cache = aligned_alloc(CACHE_LINE_SIZE,
+            CACHE_LINE_ROUNDUP(sizeof(lcs_conn_cache_t)));
+    if(!w->conn_cache)
+        return -1;
+    memset(w->conn_cache, 0, sizeof(lcs_conn_cache_t));
+
+    if(w->worker_id == LCS_INVALID_IDX) {
+        /* the master only polls its listener */
+        w->event_context = ev_create_context_ex(LCS_MASTER_MAX_EVENTS, cfg->backend, 0);
+        if(!w->event_context)
+            return -1;
+        if(cfg->latency && ev_enable_latency(w->event_context) != 0)
+            return -1;
+
+        w->staged = calloc(server->slave_num, sizeof(lcs_handoff_t));
+        if(!w->staged)
+            return -1;
+
+        return worker_create_listen(w, 0);
+    }
+
+    w->event_context = ev_create_context_ex(server->max_conns << 1,
+            cfg->backend, cfg->sqpoll ? EV_F_SQPOLL : 0);
+    if(!w->event_context)
+        return -1;
+    if(cfg->latency && ev_enable_latency(w->event_context) != 0)
+        return -1;
+
+    if(cfg->busy_poll_us) {
+        ev_set_busy_poll(w->event_context, cfg->busy_poll_us);
+        if(cfg->napi_busy_poll && ev_set_napi_busy_poll(w->event_context,
+                    cfg->busy_poll_us, 0, true) != 0)
+            syslog(LOG_WARNING, "epoll busy poll unavailable: %d", errno);
+    }
+
+    /* free buffer chunks go back to the os after a burst */
+    w->buf_pool = pool_create_ex(sizeof(lcs_buf_t) + server->in_buf_size,
+            server->in_buf_num, LCS_BUF_CHUNK,
+            POOL_F_RELEASE | (cfg->hugepages ? POOL_F_HUGEPAGE : 0));
+    if(!w->buf_pool)
+        return -1;
+
+    if(worker_init_ring(w) != 0)
+        return -1;
+
+    if(server->dispatch == LCS_DISPATCH_LEAST_LATENCY) {
+        ev_init_timer(&w->load_timer, LCS_LOAD_SAMPLE_MS, load_timer_callback);
+        w->load_timer.data = w;
+        ev_start_timer(w->event_context, &w->load_timer);
+    }
+
+    if(server->reuseport)
+        return worker_create_listen(w, SOCK_LISTEN_REUSEPORT);
+
+    return 0;
 }
 
-// ??
-static void *slave_worker_thread(void *arg)
+/*
+ * the master and every slave run their own event loop. lcserver_start()
+ * waits until all workers are initialized, then opens the start gate,
+ * with stopped set if any of them failed.
+ */
+static void *worker_thread(void *arg)
 {
     lcs_worker_t *worker = (lcs_worker_t *)arg;
+    lcserver_t *server = worker->server;
+
+    if(worker_init(worker) != 0) {
+        syslog(LOG_ERR, "worker %d init failed: %d", worker->worker_id, errno);
+        worker->init_failed = true;
+    }
+
+    pthread_mutex_lock(&server->start_lock);
+    server->nr_ready++;
+    pthread_cond_broadcast(&server->start_cond);
+    while(!server->start_go)
+        pthread_cond_wait(&server->start_cond, &server->start_lock);
+    pthread_mutex_unlock(&server->start_lock);
+
+    if(server->stopped)
+        return NULL;
 
     if(ev_run(worker->event_context) == -1) {
         syslog(LOG_ERR, "ev_run failed: %d", errno);
@@ -147,6 +1692,76 @@ static void *slave_worker_thread(void *arg)
     return NULL;
 }
 
+static int worker_start(lcs_worker_t *w)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int ret;
+
+    if(pthread_attr_init(&attr) != 0)
+        return -1;
+
+    /* pinned before the first instruction, the stack is local as well */
+    if(w->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        if(pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0) {
+            syslog(LOG_ERR, "invalid cpu %d", w->cpu);
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+
+    ret = pthread_create(&w->tid, &attr, worker_thread, w);
+    pthread_attr_destroy(&attr);
+
+    return ret == 0 ? 0 : -1;
+}
+
+/* handoffs and mails posted to a worker that never ran them */
+static void worker_drop_posts(lcs_worker_t *w)
+{
+    ev_post_t tasks[LCS_HANDOFF_BATCH];
+    lcs_conn_t *conn;
+    int n, i;
+
+    while((n = ev_take_posts(w->event_context, tasks, LCS_HANDOFF_BATCH)) > 0) {
+        for(i = 0; i < n; i++) {
+            if(tasks[i].fn == handoff_conn) {
+                conn = tasks[i].arg;
+                close(conn->s);
+            } else if(tasks[i].fn == deliver_mail) {
+                free(tasks[i].arg);
+            }
+        }
+    }
+}
+
+static void worker_destroy(lcs_worker_t *w)
+{
+    lcs_sending_t *s, *n;
+
+    if(w->event_context) {
+        worker_drop_posts(w);
+        ev_destroy_context(w->event_context);
+    }
+    list_for_each_entry_safe(s, n, &w->orphans, list) {
+        free_sending_bufs(s);
+        free(s);
+    }
+    free(w->ring_bufs);
+    free(w->empty_bids);
+    if(w->buf_pool)
+        pool_destroy(w->buf_pool);
+    /* a multishot accept holds the listener until the ring is torn down */
+    if(w->listen_sock != INVALID_SOCK) {
+        shutdown(w->listen_sock, SHUT_RDWR);
+        close(w->listen_sock);
+    }
+    free(w->staged);
+    free(w->conn_cache);
+}
+
 void lcserver_destroy(lcserver_t *server)
 {
     int i;
@@ -155,29 +1770,50 @@ void lcserver_destroy(lcserver_t *server)
         return;
 
     if(server->slave) {
-        for(i = 0; i < server->slave_num; i++) {
-            ev_destroy_context(server->slave[i].event_context);
-        }
+        for(i = 0; i < server->slave_num; i++)
+            worker_destroy(&server->slave[i]);
 
         free(server->slave);
     }
+    worker_destroy(&server->master);
 
     pthread_spin_destroy(&server->conn_pool_lock);
+    pthread_mutex_destroy(&server->start_lock);
+    pthread_cond_destroy(&server->start_cond);
 
     if(server->conn_pool)
         pool_destroy(server->conn_pool);
-    close(server->listen_sock);
+    free(server->cfg.slave_cpus);
     free(server);
 }
 
+static void worker_setup(lcserver_t *server, lcs_worker_t *w, int id, int cpu)
+{
+    w->server = server;
+    w->worker_id = id;
+    w->tid = 0;
+    w->cpu = cpu;
+    w->listen_sock = INVALID_SOCK;
+    INIT_LIST_HEAD(&w->starved);
+    INIT_LIST_HEAD(&w->orphans);
+}
+
 lcserver_t *lcserver_create(lcs_config_t *cfg)
 {
     lcserver_t *lcs;
     int i;
 
-    lcs = (lcserver_t *)calloc(1, sizeof(lcserver_t));
+    lcs = (lcserver_t *)aligned_alloc(CACHE_LINE_SIZE, sizeof(lcserver_t));
     if(!lcs)
         return NULL;
+    memset(lcs, 0, sizeof(lcserver_t));
+    worker_setup(lcs, &lcs->master, LCS_INVALID_IDX,
+            cfg->pin_master ? cfg->master_cpu : -1);
+
+    /* keep a private copy, workers read it when they start */
+    lcs->cfg = *cfg;
+    lcs->cfg.ip = NULL;
+    lcs->cfg.slave_cpus = NULL;
 
     if(cfg->ip) {
         inet_aton(cfg->ip, (struct in_addr *)&lcs->ip);
@@ -189,7 +1825,42 @@ lcserver_t *lcserver_create(lcs_config_t *cfg)
     lcs->port = cfg->port;
     lcs->slave_num = cfg->slave_num;
     lcs->max_conns = cfg->max_conns;
-    lcs->conn_pool = pool_create(sizeof(lcs_conn_t), lcs->max_conns);
+    lcs->reuseport = cfg->reuseport;
+    lcs->out_high_wm = cfg->out_high_wm ? cfg->out_high_wm : LCS_DEFAULT_OUT_HIGH_WM;
+    lcs->out_low_wm = cfg->out_low_wm ? cfg->out_low_wm : LCS_DEFAULT_OUT_LOW_WM;
+    if(lcs->out_low_wm > lcs->out_high_wm)
+        lcs->out_low_wm = lcs->out_high_wm;
+    lcs->in_buf_size = cfg->in_buf_size ? cfg->in_buf_size : LCS_DEFAULT_IN_BUF_SIZE;
+    lcs->in_buf_num = cfg->in_buf_num ? cfg->in_buf_num : LCS_DEFAULT_IN_BUF_NUM;
+    lcs->edge_triggered = cfg->edge_triggered;
+    lcs->read_budget_bytes = cfg->read_budget_bytes ?
+        cfg->read_budget_bytes : LCS_DEFAULT_READ_BUDGET_BYTES;
+    lcs->read_budget_iters = cfg->read_budget_iters ?
+        cfg->read_budget_iters : LCS_DEFAULT_READ_BUDGET_ITERS;
+    lcs->backlog = cfg->backlog;
+    lcs->accept_batch = cfg->accept_batch ? cfg->accept_batch : LCS_DEFAULT_ACCEPT_BATCH;
+    lcs->dispatch = cfg->dispatch;
+    lcs->idle_timeout_ms = cfg->idle_timeout_ms;
+    lcs->read_timeout_ms = cfg->read_timeout_ms;
+    lcs->dispatch_seed = (uintptr_t)lcs ^ ev_now_ns();
+
+    if(cfg->slave_cpus) {
+        lcs->cfg.slave_cpus = malloc(lcs->slave_num * sizeof(int));
+        if(!lcs->cfg.slave_cpus)
+            goto no_memory;
+        memcpy(lcs->cfg.slave_cpus, cfg->slave_cpus, lcs->slave_num * sizeof(int));
+    }
+
+    /*
+     * shared by all workers, a chunk lands on the node of the worker
+     * which needed it first. the magazines may hold up to
+     * LCS_CONN_CACHE_SIZE free objects each. chunks are never released:
+     * lcs_send_by_handle() looks connections up from any thread and the
+     * generations must outlive the connections.
+     */
+    lcs->conn_pool = pool_create_ex(sizeof(lcs_conn_t),
+            lcs->max_conns + (lcs->slave_num + 1) * LCS_CONN_CACHE_SIZE,
+            LCS_CONN_CHUNK, cfg->hugepages ? POOL_F_HUGEPAGE : 0);
     if(!lcs->conn_pool)
         goto no_memory;
 
@@ -199,24 +1870,20 @@ lcserver_t *lcserver_create(lcs_config_t *cfg)
         return NULL;
     }
 
-    lcs->slave = (lcs_worker_t *)calloc(lcs->slave_num, sizeof(lcs_worker_t));
+    pthread_mutex_init(&lcs->start_lock, NULL);
+    pthread_cond_init(&lcs->start_cond, NULL);
+
+    /* the load counters are cache line aligned */
+    lcs->slave = (lcs_worker_t *)aligned_alloc(CACHE_LINE_SIZE,
+            lcs->slave_num * sizeof(lcs_worker_t));
     if(!lcs->slave)
         goto no_memory;
+    memset(lcs->slave, 0, lcs->slave_num * sizeof(lcs_worker_t));
 
-    for(i = 0; i < lcs->slave_num; i++) {
-        lcs->slave[i].event_context = ev_create_context(cfg->max_conns << 1);
-        if(!lcs->slave[i].event_context)
-            goto no_memory;
-
-        lcs->slave[i].worker_id = i; /* slave varies from 0 to slave_num -1 */
-        lcs->slave[i].tid = 0;
-        lcs->slave[i].server = lcs;
-    }
-
-    lcs->master.event_context = NULL;
-    lcs->master.server = lcs;
-    lcs->master.tid = 0;
-    lcs->master.worker_id = LCS_INVALID_IDX;
+    /* slave varies from 0 to slave_num -1 */
+    for(i = 0; i < lcs->slave_num; i++)
+        worker_setup(lcs, &lcs->slave[i], i,
+                cfg->slave_cpus ? cfg->slave_cpus[i] : -1);
 
     return lcs;
 
@@ -231,48 +1898,180 @@ void lcserver_stop(lcserver_t *server)
     int     i;
 
     server->stopped = 1;
-    if(server->master.tid > 0)
+    if(server->master.tid > 0) {
+        if(server->master.event_context)
+            server->master.event_context->stopped = 1;
         pthread_join(server->master.tid, NULL);
+        server->master.tid = 0;
+    }
 
     for(i = 0; i < server->slave_num; i++) {
         if(server->slave[i].tid > 0) {
-            server->slave[i].event_context->stopped = 1;
+            if(server->slave[i].event_context)
+                server->slave[i].event_context->stopped = 1;
             pthread_join(server->slave[i].tid, NULL);
+            server->slave[i].tid = 0;
         }
     }
 }
 
 int lcserver_start(lcserver_t *server)
 {
-    int     i;
+    int     i, nr_workers, started = 0;
+    bool    failed = false;
 
     server->stopped = 0;
-    if(!server->accept || !server->read) {
+    if(!server->accept || (!server->read && !server->data)) {
         syslog(LOG_ERR, "server has not accept and read callback");
         return -1;
     }
 
-    server->listen_sock = sock_create_listen(server->port, server->ip);
-    if(server->listen_sock == -1) {
-        syslog(LOG_ERR, "sock_create_listen failed: %d", errno);
-        return -1;
+    if(sock_listen_overflows(&server->listen_overflows_base,
+                &server->listen_drops_base) != 0) {
+        server->listen_overflows_base = 0;
+        server->listen_drops_base = 0;
+    }
+
+    /* only the framework's own reads can drain an edge triggered socket */
+    server->conn_events = EV_READ_EVENT;
+    if(server->edge_triggered && server->data)
+        server->conn_events |= EV_EDGE_TRIGGERED;
+
+    server->nr_ready = 0;
+    server->start_go = false;
+
+    for(i = 0; i < server->slave_num; i++) {
+        if(worker_start(&server->slave[i]) != 0)
+            break;
+        started++;
+    }
+    if(started == server->slave_num && !server->reuseport) {
+        if(worker_start(&server->master) == 0)
+            started++;
+    }
+
+    nr_workers = server->slave_num + (server->reuseport ? 0 : 1);
+    if(started < nr_workers) {
+        syslog(LOG_ERR, "create worker failed: %d", errno);
+        failed = true;
     }
 
-    if(pthread_create(&server->master.tid, NULL, master_worker_thread, &server->master) != 0) {
-        syslog(LOG_ERR, "create master worker failed: %d", errno);
+    /* the workers started so far wait for the gate */
+    pthread_mutex_lock(&server->start_lock);
+    while(server->nr_ready < started)
+        pthread_cond_wait(&server->start_cond, &server->start_lock);
+
+    for(i = 0; i < server->slave_num; i++)
+        failed |= server->slave[i].init_failed;
+    failed |= server->master.init_failed;
+    if(failed)
+        server->stopped = 1;
+
+    server->start_go = true;
+    pthread_cond_broadcast(&server->start_cond);
+    pthread_mutex_unlock(&server->start_lock);
+
+    if(failed) {
         lcserver_stop(server);
         return -1;
     }
 
-    for(i = 0; i < server->slave_num; i++) {
-        if(pthread_create(&server->slave[i].tid, NULL, slave_worker_thread,
-                    &server->master) != 0) {
-            syslog(LOG_ERR, "create slave worker failed: %d", errno);
-            lcserver_stop(server);
-            return -1;
-        }
+    return 0;
+}
+
+/*
+ * SYNs or completed connections dropped because a listen queue was full
+ * since lcserver_start(). the kernel counts them per network namespace,
+ * other listeners of the same host are included.
+ */
+int lcserver_get_listen_drops(lcserver_t *server, uint64_t *overflows, uint64_t *drops)
+{
+    if(sock_listen_overflows(overflows, drops) != 0)
+        return -1;
+
+    *overflows -= server->listen_overflows_base;
+    *drops -= server->listen_drops_base;
+    return 0;
+}
+
+static void read_counters(uint64_t *dst, const uint64_t *src, size_t size)
+{
+    size_t i;
+
+    for(i = 0; i < size / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* a snapshot taken while the workers run, each counter is consistent by itself */
+void lcserver_get_worker_stats(lcserver_t *server, int idx, lcs_stats_t *stats)
+{
+    lcs_worker_t *w = idx < 0 ? &server->master : &server->slave[idx];
+    ev_context_t *c = __atomic_load_n(&w->event_context, __ATOMIC_ACQUIRE);
+    ev_stats_t ev;
+
+    read_counters((uint64_t *)stats, (const uint64_t *)&w->stats, sizeof(lcs_stats_t));
+
+    stats->closed = atomic_load_explicit(&w->nr_closed, memory_order_relaxed);
+    stats->active_conns = lcs_worker_active_conns(w);
+
+    memset(&ev, 0, sizeof(ev));
+    if(c)
+        ev_get_stats(c, &ev);
+    stats->wakeups = ev.polls;
+    stats->events = ev.events;
+    stats->callbacks = ev.events + ev.pending + ev.timers;
+    stats->timers = ev.timers;
+    stats->posts = ev.posts;
+    stats->spin_ns = ev.spin_ns;
+    stats->work_ns = ev.work_ns;
+}
+
+void lcserver_get_stats(lcserver_t *server, lcs_stats_t *stats)
+{
+    lcs_stats_t ws;
+    uint64_t *dst = (uint64_t *)stats;
+    const uint64_t *src = (const uint64_t *)&ws;
+    uint64_t batch_max = 0;
+    size_t n;
+    int i;
+
+    memset(stats, 0, sizeof(lcs_stats_t));
+    for(i = -1; i < server->slave_num; i++) {
+        lcserver_get_worker_stats(server, i, &ws);
+        for(n = 0; n < sizeof(lcs_stats_t) / sizeof(uint64_t); n++)
+            dst[n] += src[n];
+
+        if(ws.accept_batch_max > batch_max)
+            batch_max = ws.accept_batch_max;
+    }
+    stats->accept_batch_max = batch_max;
+}
+
+int lcserver_get_latency(lcserver_t *server, int idx, int type, lcs_latency_t *lat)
+{
+    lcs_worker_t *w = idx < 0 ? &server->master : &server->slave[idx];
+    ev_context_t *c = __atomic_load_n(&w->event_context, __ATOMIC_ACQUIRE);
+    hist_t *h;
+
+    if(!c)
+        return -1;
+
+    h = hist_create();
+    if(!h)
+        return -1;
+
+    if(ev_get_latency(c, type, h) != 0) {
+        hist_destroy(h);
+        return -1;
     }
 
+    lat->count = h->count;
+    lat->p50 = hist_percentile(h, 50.0);
+    lat->p99 = hist_percentile(h, 99.0);
+    lat->p999 = hist_percentile(h, 99.9);
+    lat->max = h->max;
+
+    hist_destroy(h);
     return 0;
 }
 
@@ -282,8 +2081,42 @@ void lcserver_register_accept(lcserver_t *server, lcs_callback_t accept)
     server->accept = accept;
 }
 
+void lcserver_register_setup(lcserver_t *server, lcs_callback_t setup)
+{
+    server->setup = setup;
+}
+
+void lcserver_register_drain(lcserver_t *server, lcs_notify_t drain)
+{
+    server->drain = drain;
+}
+
+void lcserver_register_watermark(lcserver_t *server, lcs_notify_t write_high,
+        lcs_notify_t write_low)
+{
+    server->write_high = write_high;
+    server->write_low = write_low;
+}
+
+/* custom slave selection, NULL falls back to lcs_config_t.dispatch */
+void lcserver_register_dispatch(lcserver_t *server, lcs_dispatch_callback_t dispatch)
+{
+    server->dispatch_cb = dispatch;
+}
+
 void lcserver_register_read(lcserver_t *server, lcs_callback_t read)
 {
-    assert(accept);
+    assert(read);
     server->read = read;
 }
+
+void lcserver_register_data(lcserver_t *server, lcs_data_callback_t data)
+{
+    assert(data);
+    server->data = data;
+}
+
+void lcserver_register_timeout(lcserver_t *server, lcs_notify_t timeout)
+{
+    server->timeout = timeout;
+}
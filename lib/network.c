@@ -1,6 +1,3 @@
-#ifndef LC_NETWORK_H
-#define LC_NETWORK_H
-
 #include "network.h"
 #include "common.h"
 
@@ -15,6 +12,7 @@
 #include <unistd.h>
 #include <strings.h>
 #include <string.h>
+#include <stdio.h>
 
 
 int set_sockopt_nonblock(socket_t fd)
@@ -24,7 +22,7 @@ int set_sockopt_nonblock(socket_t fd)
     if(flags < 0)
         return flags;
     flags |= O_NONBLOCK;
-    if(fcntl(fd, F_SETFL, &flags) < 0)
+    if(fcntl(fd, F_SETFL, flags) < 0)
         return -1;
     return 0;
 }
@@ -36,7 +34,7 @@ int unset_sockopt_nonblock(socket_t fd)
     if(flags < 0)
         return flags;
     flags &= ~O_NONBLOCK;
-    if(fcntl(fd, F_SETFL, &flags) < 0)
+    if(fcntl(fd, F_SETFL, flags) < 0)
         return -1;
     return 0;
 }
@@ -101,6 +99,15 @@ int set_sockopt_keepalive(socket_t fd, int timeout)
     return 0;
 }
 
+/*
+ * busy poll the device queue for up to usec on blocking reads of fd,
+ * values above net.core.busy_read need CAP_NET_ADMIN.
+ */
+int set_sockopt_busy_poll(socket_t fd, int usec)
+{
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+}
+
 static void forward_iov(struct msghdr *msg, size_t size)
 {
     while(msg->msg_iov->iov_len <= size) {
@@ -171,16 +178,29 @@ reread:
 }
 
 /*
- * set default listen backlog to 20
+ * a listener bound to ip:port (ip in network order, INADDR_ANY for all).
+ * backlog is the length of the accept queue, <= 0 picks SOMAXCONN, the
+ * kernel caps it at net.core.somaxconn either way.
+ *
+ * flags:
+ *      SOCK_LISTEN_REUSEPORT: set SO_REUSEPORT, so every worker can bind
+ *                             its own listener to the same ip:port and the
+ *                             kernel balances incoming connections.
+ *      SOCK_LISTEN_NONBLOCK:  create the listener non-blocking, needed when
+ *                             it is driven by epoll.
  */
 
-socket_t sock_create_listen(port_t port, ip_addr_t ip)
+socket_t sock_create_listen(port_t port, ip_addr_t ip, int backlog, int flags)
 {
     int fd;
     int optval;
+    int type = SOCK_STREAM;
     struct sockaddr_in servaddr;
 
-    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if(flags & SOCK_LISTEN_NONBLOCK)
+        type |= SOCK_NONBLOCK;
+
+    if((fd = socket(AF_INET, type, 0)) < 0)
         return -1;
 
     memset(&servaddr, 0, sizeof(servaddr));
@@ -190,17 +210,67 @@ socket_t sock_create_listen(port_t port, ip_addr_t ip)
 
     optval = 1;
     if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
-       return -1;
+        goto failed;
+
+    if(flags & SOCK_LISTEN_REUSEPORT) {
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+            goto failed;
+    }
 
     if((bind(fd, (struct sockaddr *)&servaddr, sizeof(servaddr))) < 0)
-        return -1;
+        goto failed;
 
-    if(listen(fd, 20) < 0)
-        return -1;
+    /* the kernel clamps it to net.core.somaxconn */
+    if(backlog <= 0)
+        backlog = SOMAXCONN;
+    if(listen(fd, backlog) < 0)
+        goto failed;
 
     return fd;
+
+failed:
+    close(fd);
+    return -1;
 }
 
+/*
+ * TcpExt ListenOverflows and ListenDrops of /proc/net/netstat: the first
+ * line holds the field names, the next one their values.
+ */
+int sock_listen_overflows(uint64_t *overflows, uint64_t *drops)
+{
+    FILE *fp;
+    char names[4096], values[4096];
+    char *n, *v, *nsave, *vsave;
+    int found = 0;
+
+    fp = fopen("/proc/net/netstat", "r");
+    if(!fp)
+        return -1;
+
+    while(fgets(names, sizeof(names), fp) && fgets(values, sizeof(values), fp)) {
+        if(strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+
+        n = strtok_r(names, " \n", &nsave);
+        v = strtok_r(values, " \n", &vsave);
+        while(n && v) {
+            if(strcmp(n, "ListenOverflows") == 0) {
+                *overflows = strtoull(v, NULL, 10);
+                found++;
+            } else if(strcmp(n, "ListenDrops") == 0) {
+                *drops = strtoull(v, NULL, 10);
+                found++;
+            }
+            n = strtok_r(NULL, " \n", &nsave);
+            v = strtok_r(NULL, " \n", &vsave);
+        }
+        break;
+    }
+
+    fclose(fp);
+    return found == 2 ? 0 : -1;
+}
 
 static inline unsigned long time_diff_sec(struct timespec *ts1, struct timespec *ts2)
 {
@@ -230,5 +300,3 @@ socket_t sock_connect_to(ip_addr_t ip, port_t port, int sec)
 
    return fd;
 }
-
-#endif
@@ -2,6 +2,10 @@
 #include "common.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
 
 
 static inline void *objmem_to_obj(void *objmem)
@@ -14,14 +18,125 @@ static inline void *obj_to_objmem(void *obj)
     return (obj - sizeof(pool_obj_head_t));
 }
 
-static inline void *idx_to_objmem(pool_t *p, pool_size_t idx)
+static inline void *idx_to_objmem(pool_t *p, pool_chunk_t *c, pool_size_t idx)
 {
-    return p->obj + idx * (p->objmemsize);
+    return c->mem + (size_t)(idx & ((1U << p->chunk_shift) - 1)) * p->objmemsize;
 }
 
-static inline pool_size_t objmem_to_idx(pool_t *p, void *obj)
+/* 0 for an unused chunk, 1 to POOL_GROUPS - 1 by quarters of fullness */
+static inline int chunk_group(pool_t *p, pool_chunk_t *c)
 {
-    return (obj - p->obj)/(p->objmemsize);
+    if(c->nr_used == 0)
+        return 0;
+
+    return 1 + (((uint64_t)c->nr_used * (POOL_GROUPS - 1)) >> p->chunk_shift);
+}
+
+static inline size_t roundup(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * MAP_HUGETLB needs pages reserved in vm.nr_hugepages, without them a
+ * 2MB aligned range is asked to be backed by transparent hugepages.
+ */
+static void *map_huge(size_t len)
+{
+    char *base, *mem;
+    size_t head;
+
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(mem != MAP_FAILED)
+        return mem;
+
+    base = mmap(NULL, len + POOL_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return NULL;
+
+    mem = (char *)roundup((uintptr_t)base, POOL_HUGE_PAGE_SIZE);
+    head = mem - base;
+    if(head)
+        munmap(base, head);
+    munmap(mem + len, POOL_HUGE_PAGE_SIZE - head);
+
+    if(madvise(mem, len, MADV_HUGEPAGE) != 0)
+        syslog(LOG_WARNING, "madvise MADV_HUGEPAGE failed: %d", errno);
+
+    return mem;
+}
+
+/* map the chunk and thread all its objects on its free list */
+static int chunk_map(pool_t *p, pool_size_t k)
+{
+    pool_chunk_t *c = &p->chunks[k];
+    pool_size_t base = k << p->chunk_shift;
+    pool_obj_head_t *head;
+    pool_size_t i;
+    char *mem;
+
+    c->nr_objs = p->num - base < (1U << p->chunk_shift) ?
+        p->num - base : 1U << p->chunk_shift;
+
+    if(p->flags & POOL_F_HUGEPAGE) {
+        c->len = roundup((size_t)c->nr_objs * p->objmemsize, POOL_HUGE_PAGE_SIZE);
+        mem = map_huge(c->len);
+    } else {
+        c->len = roundup((size_t)c->nr_objs * p->objmemsize, sysconf(_SC_PAGESIZE));
+        mem = mmap(NULL, c->len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED)
+            mem = NULL;
+    }
+    if(!mem)
+        return -1;
+
+    for(i = 0; i < c->nr_objs; i++) {
+        head = (pool_obj_head_t *)(mem + (size_t)i * p->objmemsize);
+        head->head = p;
+        head->idx = base + i;
+        p->freeobj[base + i] = base + i + 1;
+    }
+    p->freeobj[base + c->nr_objs - 1] = POOL_IDX_NONE;
+
+    c->free_idx = base;
+    c->nr_used = 0;
+    list_add_tail(&c->list, &p->partial[0]);
+    p->nr_mapped++;
+    if(p->flags & POOL_F_RELEASE)
+        p->nr_empty++;
+
+    /* pool_index_obj() may look at it from now on */
+    __atomic_store_n(&c->mem, mem, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void chunk_unmap(pool_t *p, pool_chunk_t *c)
+{
+    char *mem = c->mem;
+
+    list_del_init(&c->list);
+    __atomic_store_n(&c->mem, NULL, __ATOMIC_RELEASE);
+    munmap(mem, c->len);
+
+    p->nr_mapped--;
+    p->nr_empty--;
+}
+
+/* map the first chunk not mapped, chunks are few so a scan is fine */
+static int pool_grow(pool_t *p)
+{
+    pool_size_t k;
+
+    for(k = 0; k < p->nr_chunks; k++) {
+        if(!p->chunks[k].mem)
+            return chunk_map(p, k);
+    }
+
+    return -1;
 }
 
 /*
@@ -31,56 +146,151 @@ static inline pool_size_t objmem_to_idx(pool_t *p, void *obj)
  *          poolsize:
  *  @return: an pointer to struct pool on success
  *           NULL on failure
+ *
+ * all poolsize objects are mapped at once, the pool never grows, see
+ * pool_create_ex().
  */
 pool_t *pool_create(pool_obj_size_t objsize, pool_size_t poolsize)
 {
-    pool_size_t i;
-    pool_obj_head_t *head;
-    pool_t *p;
+    return pool_create_ex(objsize, poolsize, 0, 0);
+}
 
-    size_t manage_mem_size = sizeof(pool_t);
-    size_t free_list_mem_size = poolsize * sizeof(pool_size_t);
-    size_t obj_mem_size = (objsize + sizeof(pool_obj_head_t)) * poolsize;
+/*
+ * @function: pool_create_ex()
+ * @arguments:
+ *          objsize:
+ *          poolsize:   most objects in the pool
+ *          chunk_objs: objects mapped at a time, rounded up to a power
+ *                      of 2. 0 maps all of them now, as pool_create().
+ *          flags:      POOL_F_HUGEPAGE backs chunks by 2MB pages, a
+ *                      chunk then holds at least a page worth of
+ *                      objects. POOL_F_RELEASE unmaps a chunk whose
+ *                      objects are all freed once POOL_SPARE_CHUNKS free
+ *                      chunks are kept already.
+ *  @return: an pointer to struct pool on success
+ *           NULL on failure
+ */
+pool_t *pool_create_ex(pool_obj_size_t objsize, pool_size_t poolsize,
+        pool_size_t chunk_objs, unsigned int flags)
+{
+    pool_t *p;
+    uint32_t shift = 0, max_shift = 0;
+    int k;
 
-    p = calloc(1, manage_mem_size + free_list_mem_size + obj_mem_size);
+    p = calloc(1, sizeof(pool_t));
     if(!p)
         return NULL;
 
     p->num = poolsize;
     p->objsize = objsize;
     p->objmemsize = objsize + sizeof(pool_obj_head_t);
-    p->freeobj = (void*)p->buffer;
-    p->obj = p->buffer + free_list_mem_size;
+    p->flags = flags;
+    for(k = 0; k < POOL_GROUPS; k++)
+        INIT_LIST_HEAD(&p->partial[k]);
 
-    // initialize free list
-    p->free_idx = 0;
-    for(i = 0; i < p->num; i++)
-        p->freeobj[i] = i + 1;
+    while(max_shift < 31 && (1U << max_shift) < poolsize)
+        max_shift++;
 
-    // initialize obj head
-    for(i = 0; i < p->num; i++) {
-        head = (pool_obj_head_t *)(idx_to_objmem(p, i));
-        head->head = p;
+    if(chunk_objs == 0) {
+        shift = max_shift;
+        p->flags &= ~POOL_F_RELEASE;
+    } else {
+        while(shift < max_shift && (1U << shift) < chunk_objs)
+            shift++;
+        if(flags & POOL_F_HUGEPAGE) {
+            while(shift < max_shift &&
+                    ((size_t)p->objmemsize << (shift + 1)) <= POOL_HUGE_PAGE_SIZE)
+                shift++;
+        }
     }
+    p->chunk_shift = shift;
+    p->nr_chunks = DIV_ROUND_UP((uint64_t)poolsize, 1ULL << shift);
+
+    p->chunks = calloc(p->nr_chunks ? p->nr_chunks : 1, sizeof(pool_chunk_t));
+    p->freeobj = malloc((poolsize ? poolsize : 1) * sizeof(pool_size_t));
+    if(!p->chunks || !p->freeobj)
+        goto fail;
+
+    if(chunk_objs == 0 && poolsize && chunk_map(p, 0) != 0)
+        goto fail;
 
     return p;
+
+fail:
+    pool_destroy(p);
+    return NULL;
 }
 
 
+/*
+ * POOL_F_RELEASE: take from the fullest partial chunk and move the chunk
+ * to the group it lands in, to the tail so the chunks ahead are filled
+ * up first.
+ */
+static void *alloc_fullest(pool_t *p)
+{
+    pool_chunk_t *c;
+    pool_size_t idx;
+    int g;
+
+    for(g = POOL_GROUPS - 1; g >= 0; g--) {
+        if(!list_empty(&p->partial[g]))
+            break;
+    }
+    if(g < 0) {
+        if(pool_grow(p) != 0)
+            return NULL; // empty
+        g = 0;
+    }
+
+    c = list_first_entry(&p->partial[g], pool_chunk_t, list);
+    idx = c->free_idx;
+    c->free_idx = p->freeobj[idx];
+    if(c->nr_used++ == 0)
+        p->nr_empty--;
+
+    if(c->free_idx == POOL_IDX_NONE)
+        list_del_init(&c->list);
+    else if(chunk_group(p, c) != g)
+        list_move_tail(&c->list, &p->partial[chunk_group(p, c)]);
+
+    return objmem_to_obj(idx_to_objmem(p, c, idx));
+}
+
+static void free_release(pool_t *p, pool_chunk_t *c, pool_size_t idx)
+{
+    int g = c->free_idx == POOL_IDX_NONE ? -1 : chunk_group(p, c);
+
+    p->freeobj[idx] = c->free_idx;
+    c->free_idx = idx;
+
+    if(--c->nr_used == 0 && ++p->nr_empty > POOL_SPARE_CHUNKS) {
+        chunk_unmap(p, c);
+        return;
+    }
+
+    if(chunk_group(p, c) != g)
+        list_move_tail(&c->list, &p->partial[chunk_group(p, c)]);
+}
+
 void *pool_alloc_obj(pool_t *p)
 {
+    pool_chunk_t *c;
     pool_size_t idx;
-    void *obj;
 
-    if(unlikely(p->free_idx == p->num))
-        return NULL; // empty
+    if(p->flags & POOL_F_RELEASE)
+        return alloc_fullest(p);
 
-    idx = p->free_idx;
-    p->free_idx = p->freeobj[idx];
+    if(unlikely(list_empty(&p->partial[0])) && pool_grow(p) != 0)
+        return NULL; // empty
 
-    obj = idx_to_objmem(p, idx);
+    c = list_first_entry(&p->partial[0], pool_chunk_t, list);
+    idx = c->free_idx;
+    c->free_idx = p->freeobj[idx];
+    if(unlikely(c->free_idx == POOL_IDX_NONE))
+        list_del_init(&c->list);
 
-    return objmem_to_obj(obj);
+    return objmem_to_obj(idx_to_objmem(p, c, idx));
 }
 
 
@@ -88,20 +298,64 @@ void pool_free_obj(pool_t *p, void *obj)
 {
     pool_size_t idx;
     pool_obj_head_t *head;
+    pool_chunk_t *c;
 
     head = (pool_obj_head_t *)obj_to_objmem(obj);
     assert(head->head == p);
 
-    idx = objmem_to_idx(p, obj);
+    idx = head->idx;
+    c = &p->chunks[idx >> p->chunk_shift];
 
-    // insert to list head
-    p->freeobj[idx] = p->free_idx;
-    p->free_idx = idx;
+    if(p->flags & POOL_F_RELEASE) {
+        free_release(p, c, idx);
+        return;
+    }
+
+    // insert to the chunk's list head, a full chunk is partial again
+    if(unlikely(c->free_idx == POOL_IDX_NONE))
+        list_add_tail(&c->list, &p->partial[0]);
+    p->freeobj[idx] = c->free_idx;
+    c->free_idx = idx;
 }
 
-void pool_destroy(pool_t *p)
+/*
+ * @function: pool_alloc_bulk()
+ *  @return: number of objects stored to objs, less than n only when the
+ *           pool runs out
+ */
+pool_size_t pool_alloc_bulk(pool_t *p, void **objs, pool_size_t n)
 {
-    free(p);
+    pool_size_t i;
+
+    for(i = 0; i < n; i++) {
+        objs[i] = pool_alloc_obj(p);
+        if(unlikely(!objs[i]))
+            break;
+    }
+
+    return i;
+}
+
+void pool_free_bulk(pool_t *p, void **objs, pool_size_t n)
+{
+    pool_size_t i;
+
+    for(i = 0; i < n; i++)
+        pool_free_obj(p, objs[i]);
 }
 
+void pool_destroy(pool_t *p)
+{
+    pool_size_t k;
+
+    if(p->chunks) {
+        for(k = 0; k < p->nr_chunks; k++) {
+            if(p->chunks[k].mem)
+                munmap(p->chunks[k].mem, p->chunks[k].len);
+        }
+    }
 
+    free(p->chunks);
+    free(p->freeobj);
+    free(p);
+}